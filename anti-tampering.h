@@ -28,9 +28,17 @@ extern "C" {
 #endif
 
 
-#if defined(ANTI_TAMPERING_ENABLED)
 #include "md5.h"
 
+// Compute the MD5 of file i. Besides anti-tampering, this is used to key the gfx cache
+extern void md5( unsigned char *input, int ilen, unsigned char output[16] );
+static __inline void hash_file(u16 i)
+{
+	md5(fbuffer[i]+((i==LOADER)?LOADER_PADDING:0), fsize[i], fhash[i]);
+}
+
+#if defined(ANTI_TAMPERING_ENABLED)
+
 // MD5 hashes of the game data files
 
 #define FMD5HASHES	{																					\
@@ -47,20 +55,17 @@ extern "C" {
 	{ 0xcb, 0xe0, 0x09, 0xbe, 0x17, 0x15, 0xae, 0x03, 0xbf, 0xd6, 0x03, 0x91, 0x7f, 0x78, 0xe5, 0x67 }	}
 
 
-// This inline performs an MD5 check on file i
-extern void md5( unsigned char *input, int ilen, unsigned char output[16] );
+// This inline checks the MD5 of file i (computed by hash_file) against our table
 extern const u8  fmd5hash[NB_FILES][16];
 static __inline bool integrity_check(u16 i)
 {
 	int j;
-	u8 md5hash[16];
-	md5(fbuffer[i]+((i==LOADER)?LOADER_PADDING:0), fsize[i], md5hash);
 	for (j=0; j<16; j++)
-		if (md5hash[j] != fmd5hash[i][j])
+		if (fhash[i][j] != fmd5hash[i][j])
 			return false;
 //	printf("{ ");
 //	for (j=0; j<16; j++)
-//		printf("0x%02x, ", md5hash[j]);
+//		printf("0x%02x, ", fhash[i][j]);
 //	printf("}, \\\n");
 	return true;
 }
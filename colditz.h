@@ -116,6 +116,11 @@ extern "C" {
 #define ALT_LOADER				"SKR_COLD"
 #define ALT_LOADER_SIZE			28820
 #define ALT_LOADER_SIZE2        27940
+// MD5 cache for the files above: magic, 48 bytes (size, mtime, ctime, inode, MD5) per file
+// and the MD5 of all that
+#define HASH_CACHE_NAME			"md5_cache.bin"
+#define HASH_CACHE_MAGIC		MAKE_ID('M','D','5','C')
+#define HASH_CACHE_SIZE			(4 + 48*NB_FILES + 16)
 
 // Static images
 #define NB_TEXTURES				24
@@ -427,12 +432,22 @@ extern "C" {
 #define ANIMATION_INTERVAL		120
 // 20 ms provides the same speed (for patrols) as on the Amiga
 #define	REPOSITION_INTERVAL		15
+// The original loop ran a reposition once MORE than REPOSITION_INTERVAL ms had elapsed,
+// and restarted from there, so our fixed ticks are 1 ms longer to keep the same speed
+#define REPOSITION_TICK			(REPOSITION_INTERVAL+1)
 // defines how long a transition takes on animated picture effects
 #define TRANSITION_DURATION		1000
 // How long should we sleep when paused
 #define PAUSE_DELAY				40
+// Game time between the refresh of two of the pause screen views, in ms
+#define PAUSE_VIEW_INTERVAL		250
 // Minimum amount of sleep we are entitling ourselves to, in ms
 #define QUANTUM_OF_SOLACE		2
+// Longest time we'll catch up on, in ms. Anything longer (suspend, window drag...)
+// is considered as a pause
+#define MAX_CATCHUP_TIME		250
+// Moves larger than this (in pixels) during a reposition tick are not interpolated
+#define MAX_TICK_MOTION			16
 // Muhahahahahaha!!! Fear not, mere mortals, for I'll...
 #define TIME_MARKER				10000
 // NB: This is the duration of a game minute, in ms
@@ -725,6 +740,8 @@ extern bool		opt_no_guards;
 extern bool		opt_meh;
 extern bool		opt_haunted_castle;
 extern bool		opt_glsl_enabled;
+extern int		opt_scaler;
+extern int		opt_nb_workers;
 
 // Global variables
 extern bool		init_animations;
@@ -732,6 +749,7 @@ extern bool		is_fire_pressed;
 extern bool		can_consume_key;
 extern u8		*mbuffer;	// Generic TMP buffer
 extern u8		*fbuffer[NB_FILES];
+extern u8		fhash[NB_FILES][16];	// MD5 of the loaded files
 extern u8		*rbuffer;
 extern FILE		*fd;		// Generic file descriptor
 extern u8		*rgbCells;	// Cells table
@@ -754,6 +772,8 @@ extern u16		nb_objects;
 extern char		*fname[NB_FILES];
 extern u32		fsize[NB_FILES];
 extern char		*mod_name[NB_MODS];
+extern u8		*loadtune_buffer;
+extern size_t	loadtune_size;
 extern int		gl_width, gl_height;
 extern u8		current_nation;
 extern char		nb_props_message[32];
@@ -104,6 +104,13 @@ void set_xml_defaults()
 	SET_XML_NODE_DEFAULT(options, original_mode, false);
     SET_XML_NODE_COMMENT(options, original_mode,
 		" Bwak! Bwaaak! Chicken!!! ");
+#if defined(PSP)
+	SET_XML_NODE_DEFAULT(options, picture_cache, 1024);
+#else
+	SET_XML_NODE_DEFAULT(options, picture_cache, 8192);
+#endif
+    SET_XML_NODE_COMMENT(options, picture_cache,
+		" memory used to keep static pictures around, in KB (0 = only the current one) ");
 
 
 #if defined(PSP)
@@ -145,6 +145,7 @@ extern "C" {
 #define opt_fullscreen				XML_VALUE(options, fullscreen)
 #define JOY_DEADZONE				XML_VALUE(options, joy_deadzone)
 #define opt_original_mode			XML_VALUE(options, original_mode)
+#define opt_picture_cache			XML_VALUE(options, picture_cache)
 
 /////////////////////////////////////////////////////////////////////////////////
 // XML tables definitions
@@ -167,7 +168,8 @@ DEFINE_XML_NODES(options_nodes,
 				 gl_smoothing,
 				 fullscreen,
 				 joy_deadzone,
-				 original_mode)
+				 original_mode,
+				 picture_cache)
 CREATE_XML_TABLE(options, options_nodes, xml_int)
 
 // User input mappings
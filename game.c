@@ -45,12 +45,26 @@
 #include "cluck.h"
 #include "eschew/eschew.h"
 #include "conf.h"
+#include "anti-tampering.h"
+#include "pack.h"
+#include "tasks.h"
 
 
 /* Some more globals */
 u8  obs_to_sprite[NB_OBS_TO_SPRITE];
 u8	remove_props[CMP_MAP_WIDTH][CMP_MAP_HEIGHT];
 u8  overlay_order[MAX_OVERLAYS];
+u32 nb_overlay_compares = 0;
+// Memory mapped game files (LOADER excluded), when they don't come from the pack
+s_mmap fmap[NB_FILES];
+// File stamps at load time, and the content of the MD5 cache
+s_fstamp fstamp[NB_FILES];
+static s_fstamp cached_fstamp[NB_FILES];
+static u8  cached_fhash[NB_FILES][16];
+static bool fhash_from_cache[NB_FILES];
+// Pristine (patched) copies of the files reverted on a new game, and their modified pages
+static u8* pristine[NB_FILES_TO_RELOAD];
+u8* dirty_page[NB_FILES_TO_RELOAD];
 // Do we need to reload the files on newgame?
 bool game_restart = false;
 u8	nb_animations = 0;
@@ -59,6 +73,11 @@ s_guybrush guybrush[NB_GUYBRUSHES];
 
 
 int	currently_animated[MAX_ANIMATIONS];
+// The guys positions before the last reposition tick, for display interpolation
+static s16 tick_px[NB_GUYBRUSHES], tick_p2y[NB_GUYBRUSHES];
+// and the rest of what we display of them, to tell if the display needs updating
+static s16 tick_dir[NB_GUYBRUSHES];
+static u16 tick_state[NB_GUYBRUSHES], tick_room[NB_GUYBRUSHES];
 u32 exit_flags_offset;
 // Pointer to the message ID list of the currently allowed rooms
 u32 authorized_ptr;
@@ -122,83 +141,66 @@ const u8 looping_animation[NB_ANIMATED_SPRITES] =
 
 
 // Uncompress the PowerPacked LOADTUNE.MUS if needed
+// This can run on a worker thread, so it doesn't use the global fd
 void depack_loadtune()
 {
-    size_t read;
     u32 length;
     u8 *ppbuffer, *buffer;
+    s_res res;
 
     // Don't bother if we already have an uncompressed LOADTUNE
-    if ((fd = fopen (mod_name[MOD_LOADTUNE], "rb")) != NULL)
-    {
-        fclose(fd);
+    if (res_exists(mod_name[MOD_LOADTUNE]))
         return;
-    }
 
     // No uncompressed LOADTUNE? Look for the PowerPacked one
     printf("Couldn't find file '%s'\n  Trying to use PowerPacked '%s' instead\n", mod_name[0], PP_LOADTUNE_NAME);
 
-    if ((fd = fopen (PP_LOADTUNE_NAME, "rb")) == NULL)
+    if (!res_open(PP_LOADTUNE_NAME, &res))
     {
         printf("  Can't find '%s' - Aborting.\n", PP_LOADTUNE_NAME);
         return;
     }
 
-    if ( (ppbuffer = (u8*) calloc(PP_LOADTUNE_SIZE, 1)) == NULL)
-    {
-        printf("  Could not allocate source buffer for ppunpack\n");
-        fclose(fd);
-        return;
-    }
-
-    // So far so good
-    read = fread (ppbuffer, 1, PP_LOADTUNE_SIZE, fd);
-    fclose(fd);
-
     // Is it the file we are looking for?
-    if (read != PP_LOADTUNE_SIZE)
+    if (res.size != PP_LOADTUNE_SIZE)
     {
         printf("  '%s': Unexpected file size or read error\n", PP_LOADTUNE_NAME);
-        free(ppbuffer); return;
+        res_close(&res); return;
     }
+    // The data doesn't get modified, so we can decrunch from the pack directly
+    ppbuffer = res.data;
 
     if (ppbuffer[0] != 'P' || ppbuffer[1] != 'P' ||
         ppbuffer[2] != '2' || ppbuffer[3] != '0')
     {
         printf("  '%s': Not a PowerPacked file\n", PP_LOADTUNE_NAME);
-        free(ppbuffer); return;
+        res_close(&res); return;
     }
 
     // The uncompressed length is given at the end of the file
     length = read24(ppbuffer, PP_LOADTUNE_SIZE-4);
 
-    if ( (buffer = (u8*) calloc(length,1)) == NULL)
+    // No need to zero it, as the whole buffer gets written on success
+    if ( (buffer = (u8*) malloc(length)) == NULL)
     {
         printf("  Could not allocate destination buffer for ppunpack\n");
-        free(ppbuffer); return;
+        res_close(&res); return;
     }
 
     printf("  Uncompressing...");
     // Call the PowerPacker unpack subroutine
-    ppDecrunch(&ppbuffer[8], buffer, &ppbuffer[4], PP_LOADTUNE_SIZE-12, length, ppbuffer[PP_LOADTUNE_SIZE-1]);
-    free(ppbuffer);
-
-    // We'll play MOD directly from files, so write it
-    printf("  OK.\n  Now saving file as '%s'\n", mod_name[0]);
-    if ((fd = fopen (mod_name[0], "wb")) == NULL)
+    if (!ppDecrunch(&ppbuffer[8], buffer, &ppbuffer[4], PP_LOADTUNE_SIZE-12, length, ppbuffer[PP_LOADTUNE_SIZE-1]))
     {
-        printf("  Couldn't create file '%s'\n", mod_name[0]);
-        free(buffer); return;
+        printf("  Error!\n");
+        res_close(&res); free(buffer); return;
     }
+    res_close(&res);
 
-    read = fwrite (buffer, 1, length, fd);
-    if (read != length)
-        printf("  '%s': write error.\n", mod_name[0]);
-
-    printf("  DONE.\n\n");
-
-    fclose(fd);
-    free(buffer);
+    // No need to write it back: the player can parse it straight from memory,
+    // which also means we can run from a read-only directory
+    printf("  OK.\n\n");
+    loadtune_buffer = buffer;
+    loadtune_size = length;
 }
 
 // free all allocated data
@@ -208,140 +210,297 @@ void free_data()
 	free_xml();
 	free_gfx();
 	for (i=0; i<NB_FILES; i++)
-		SAFREE(fbuffer[i]);
+	{
+		if (i == LOADER)
+			SAFREE(fbuffer[i]);
+		else
+		{
+			mmap_close(&fmap[i]);
+			fbuffer[i] = NULL;
+		}
+	}
+	// After the game files, as they may point into it
+	pack_close();
+	for (i=0; i<NB_FILES_TO_RELOAD; i++)
+	{
+		SAFREE(pristine[i]);
+		SFREE(dirty_page[i]);
+	}
 	audio_release();
+	SFREE(loadtune_buffer);
+	loadtune_size = 0;
+	stop_workers();
 }
 
-// Initial file loader
-void load_all_files()
+// Load one of the data files. Returns false on error
+// This can run on a worker thread, so it doesn't use the global fd nor ERR_EXIT
+bool load_file(u16 i)
 {
     size_t read;
-    u16 i;
-    int compressed_loader = 0;
+    FILE* f;
+    s_res res;
+    u32 size;
+    bool from_pack;
 
-    // We need a little padding of the loader to keep the offsets happy
-    fsize[LOADER] += LOADER_PADDING;
+    // Stamp the file before we read it, so that any later change invalidates its cached MD5
+    res_fstamp(fname[i], &fstamp[i]);
 
-    for (i=0; i<NB_FILES; i++)
+    // The loader is patched all over, needs some padding and may have
+    // to be decompressed, so it's the only one we don't map
+    if (i != LOADER)
     {
-        if ( (fbuffer[i] = (u8*) aligned_malloc(fsize[i], 16)) == NULL)
+        // The pack is mapped copy-on-write, so we can use its data as is
+        if ((fbuffer[i] = pack_find(fname[i], &size)) != NULL)
         {
-            printf("Could not allocate buffers\n");
-            ERR_EXIT;
+            if (size < fsize[i])
+            {
+                printf("'%s': Unexpected size in pack\n", fname[i]);
+                fbuffer[i] = NULL;
+                return false;
+            }
+            return true;
         }
-
-        if (i==LOADER)
+        printv("Mapping file '%s'...\n", fname[i]);
+        if (!mmap_open(fname[i], fsize[i], &fmap[i]))
         {
-            fbuffer[LOADER] += LOADER_PADDING;
-            fsize[LOADER] -= LOADER_PADDING;
+            printf("'%s': File not found, unexpected file size or read error\n", fname[i]);
+            return false;
         }
+        fbuffer[i] = fmap[i].address;
+        return true;
+    }
 
-        if ((fd = fopen (fname[i], "rb")) == NULL)
-        {
-            printf("Couldn't find file '%s'\n", fname[i]);
+    // We need a little padding of the loader to keep the offsets happy
+    if ( (fbuffer[LOADER] = (u8*) aligned_malloc(fsize[LOADER]+LOADER_PADDING, 16)) == NULL)
+    {
+        printf("Could not allocate buffers\n");
+        return false;
+    }
+    fbuffer[LOADER] += LOADER_PADDING;
 
-            /* Take care of the compressed loader if present */
-            if (i == LOADER)
-            {
-                // Uncompressed loader was not found
-                // Maybe there's a compressed one?
-                printf("  Trying to use compressed loader '%s' instead\n", ALT_LOADER);
-                if ((fd = fopen (ALT_LOADER, "rb")) == NULL)
-                {
-                    printf("  '%s' not found - Aborting.\n", ALT_LOADER);
-                    ERR_EXIT;
-                }
-                // OK, file was found - let's allocated the compressed data buffer
-                if ((mbuffer = (u8*) aligned_malloc(ALT_LOADER_SIZE, 16)) == NULL)
-                {
-                    printf("  Could not allocate source buffer for loader decompression\n");
-                    ERR_EXIT;
-                }
+    if (!res_open(fname[LOADER], &res))
+    {
+        printf("Couldn't find file '%s'\n", fname[LOADER]);
 
-                read = fread (mbuffer, 1, ALT_LOADER_SIZE, fd);
-                if ((read != ALT_LOADER_SIZE) && (read != ALT_LOADER_SIZE2))
-                {
-                    printf("  '%s': Unexpected file size or read error\n", ALT_LOADER);
-                    ERR_EXIT;
-                }
-                compressed_loader = 1;
+        /* Take care of the compressed loader if present */
+        // Uncompressed loader was not found
+        // Maybe there's a compressed one?
+        printf("  Trying to use compressed loader '%s' instead\n", ALT_LOADER);
+        if (!res_open(ALT_LOADER, &res))
+        {
+            printf("  '%s' not found - Aborting.\n", ALT_LOADER);
+            goto error;
+        }
 
-                printf("  Uncompressing...");
-                if (uncompress(fsize[LOADER]))
-                {
-                    printf("  Error!\n");
-                    ERR_EXIT;
-                }
+        read = res.size;
+        if ((read != ALT_LOADER_SIZE) && (read != ALT_LOADER_SIZE2))
+        {
+            printf("  '%s': Unexpected file size or read error\n", ALT_LOADER);
+            res_close(&res);
+            goto error;
+        }
 
-                if (read == ALT_LOADER_SIZE2)   // SKR_COLD NTSC FIX, with one byte diff
-                    writebyte(fbuffer[LOADER], 0x1b36, 0x67);
+        printf("  Uncompressing...");
+        if (uncompress(res.data, read, fbuffer[LOADER], fsize[LOADER]))
+        {
+            printf("  Error!\n");
+            res_close(&res);
+            goto error;
+        }
 
-                printf("  OK.\n  Now saving file as '%s'\n",fname[LOADER]);
-                if ((fd = fopen (fname[LOADER], "wb")) == NULL)
-                {
-                    printf("  Can't create file '%s'\n", fname[LOADER]);
-                    ERR_EXIT;
-                }
+        if (read == ALT_LOADER_SIZE2)   // SKR_COLD NTSC FIX, with one byte diff
+            writebyte(fbuffer[LOADER], 0x1b36, 0x67);
 
-                // Write file
-                read = fwrite (fbuffer[LOADER], 1, fsize[LOADER], fd);
-                if (read != fsize[LOADER])
-                {
-                    printf("  '%s': Unexpected file size or write error\n", fname[LOADER]);
-                    ERR_EXIT;
-                }
-                printf("  DONE.\n\n");
-            }
-            else
-                ERR_EXIT;
+        from_pack = !res.allocated;
+        res_close(&res);
+        // If the compressed loader came from the pack, we'll use the pack next time too
+        if (from_pack)
+        {
+            res_fstamp(ALT_LOADER, &fstamp[LOADER]);
+            printf("  OK.\n\n");
         }
-
-        // Read file (except in the case of a compressed loader)
-        if (!((i == LOADER) && (compressed_loader)))
+        else
         {
-            printv("Reading file '%s'...\n", fname[i]);
-            read = fread (fbuffer[i], 1, fsize[i], fd);
-            if (read != fsize[i])
+            printf("  OK.\n  Now saving file as '%s'\n",fname[LOADER]);
+            if ((f = fopen (fname[LOADER], "wb")) == NULL)
             {
-                printf("'%s': Unexpected file size or read error\n", fname[i]);
-                ERR_EXIT;
+                printf("  Can't create file '%s'\n", fname[LOADER]);
+                goto error;
             }
-        }
 
-        fclose (fd);
-        fd = NULL;
+            // Write file
+            read = fwrite (fbuffer[LOADER], 1, fsize[LOADER], f);
+            fclose(f);
+            if (read != fsize[LOADER])
+            {
+                printf("  '%s': Unexpected file size or write error\n", fname[LOADER]);
+                goto error;
+            }
+            get_fstamp(fname[LOADER], &fstamp[LOADER]);
+            printf("  DONE.\n\n");
+        }
+    }
+    else
+    {
+        printv("Reading file '%s'...\n", fname[LOADER]);
+        read = res_read(fbuffer[LOADER], fsize[LOADER], &res);
+        res_close(&res);
+        if (read != fsize[LOADER])
+        {
+            printf("'%s': Unexpected file size or read error\n", fname[LOADER]);
+            goto error;
+        }
     }
 
     // OK, now we can reset our LOADER's start address
     fbuffer[LOADER] -= LOADER_PADDING;
+    return true;
+
+error:
+    fbuffer[LOADER] -= LOADER_PADDING;
+    SAFREE(fbuffer[LOADER]);
+    return false;
 }
 
 
-// Reload the files for a game restart
-void reload_files()
+// Read the MD5 cache sidecar file. A missing or invalid cache just means
+// that all the files will be hashed
+// The cache is only a startup speed-up: its own MD5 catches corruption, not tampering,
+// as anybody can recompute it. It is therefore not trusted for the integrity check
+void read_hash_cache()
+{
+    FILE* f;
+    u8  buffer[HASH_CACHE_SIZE];
+    u8  md5sum[16];
+    u32 i, pos;
+
+    memset(cached_fstamp, 0, sizeof(cached_fstamp));
+    if ((f = fopen(HASH_CACHE_NAME, "rb")) == NULL)
+        return;
+    pos = fread(buffer, 1, HASH_CACHE_SIZE, f);
+    fclose(f);
+    // The cache is checksummed, so that we don't use a truncated or corrupted one
+    if (pos != HASH_CACHE_SIZE)
+        return;
+    md5(buffer, HASH_CACHE_SIZE-16, md5sum);
+    if ( (readlong(buffer, 0) != HASH_CACHE_MAGIC) ||
+         (memcmp(md5sum, buffer+HASH_CACHE_SIZE-16, 16) != 0) )
+        return;
+
+    for (i=0, pos=4; i<NB_FILES; i++, pos+=48)
+    {
+        cached_fstamp[i].size  = (((u64)readlong(buffer, pos))<<32)    | readlong(buffer, pos+4);
+        cached_fstamp[i].mtime = (((u64)readlong(buffer, pos+8))<<32)  | readlong(buffer, pos+12);
+        cached_fstamp[i].ctime = (((u64)readlong(buffer, pos+16))<<32) | readlong(buffer, pos+20);
+        cached_fstamp[i].inode = (((u64)readlong(buffer, pos+24))<<32) | readlong(buffer, pos+28);
+        memcpy(cached_fhash[i], buffer+pos+32, 16);
+    }
+}
+
+// Set fhash[i], from the cache if the file hasn't changed since it was hashed, or by
+// hashing it otherwise. Must be called after read_hash_cache() and load_file(i)
+// Each file can be processed on a different thread
+void get_file_hash(u16 i)
+{
+    // A zero size means we couldn't stamp the file
+    fhash_from_cache[i] = (fstamp[i].size != 0) &&
+        (memcmp(&fstamp[i], &cached_fstamp[i], sizeof(s_fstamp)) == 0);
+#if defined(ANTI_TAMPERING_ENABLED)
+    // The integrity check needs the actual hash. We only keep track of the
+    // cache being current, so that it doesn't get rewritten for nothing
+    hash_file(i);
+    fhash_from_cache[i] = fhash_from_cache[i] && (memcmp(fhash[i], cached_fhash[i], 16) == 0);
+#else
+    if (fhash_from_cache[i])
+        memcpy(fhash[i], cached_fhash[i], 16);
+    else
+        hash_file(i);
+#endif
+}
+
+// Update the MD5 cache if we had to hash anything
+// Not being able to write it (eg. read-only install) is not an error
+void write_hash_cache()
+{
+    FILE* f;
+    u8  buffer[HASH_CACHE_SIZE];
+    u32 i, pos;
+    bool changed = false;
+
+    writelong(buffer, 0, HASH_CACHE_MAGIC);
+    for (i=0, pos=4; i<NB_FILES; i++, pos+=48)
+    {
+        changed |= !fhash_from_cache[i];
+        writelong(buffer, pos,    (u32)(fstamp[i].size>>32));
+        writelong(buffer, pos+4,  (u32)fstamp[i].size);
+        writelong(buffer, pos+8,  (u32)(fstamp[i].mtime>>32));
+        writelong(buffer, pos+12, (u32)fstamp[i].mtime);
+        writelong(buffer, pos+16, (u32)(fstamp[i].ctime>>32));
+        writelong(buffer, pos+20, (u32)fstamp[i].ctime);
+        writelong(buffer, pos+24, (u32)(fstamp[i].inode>>32));
+        writelong(buffer, pos+28, (u32)fstamp[i].inode);
+        memcpy(buffer+pos+32, fhash[i], 16);
+    }
+    if (!changed)
+        return;
+    md5(buffer, HASH_CACHE_SIZE-16, buffer+HASH_CACHE_SIZE-16);
+
+    if ( ((f = fopen(HASH_CACHE_NAME, "wb")) == NULL) ||
+         (fwrite(buffer, 1, HASH_CACHE_SIZE, f) != HASH_CACHE_SIZE) )
+    {
+        printv("Could not write MD5 cache file '%s'\n", HASH_CACHE_NAME);
+        if (f != NULL)
+        {
+            fclose(f);
+            remove(HASH_CACHE_NAME);
+        }
+        return;
+    }
+    fclose(f);
+}
+
+
+// Keep a copy of the files we need to revert for a game restart
+// Must be called after fix_files(), so that we don't have to patch them again
+bool snapshot_files()
 {
-    size_t read;
     u32 i;
 
     for (i=0; i<NB_FILES_TO_RELOAD; i++)
     {
-        if ((fd = fopen (fname[i], "rb")) == NULL)
+        pristine[i] = (u8*) aligned_malloc(fsize[i], 16);
+        dirty_page[i] = (u8*) calloc(NB_DIRTY_PAGES(i), 1);
+        if ((pristine[i] == NULL) || (dirty_page[i] == NULL))
         {
-            perrv ("fopen()");
-            printf("Can't find file '%s'\n", fname[i]);
+            printf("Could not allocate snapshot buffers\n");
+            return false;
         }
-        // Read file
-        printv("Reloading file '%s'...\n", fname[i]);
-        read = fread (fbuffer[i], 1, fsize[i], fd);
-        if (read != fsize[i])
+        memcpy(pristine[i], fbuffer[i], fsize[i]);
+    }
+    return true;
+}
+
+// Revert the files for a game restart, by copying back the pages that were modified
+void restore_files()
+{
+    u32 i, page, nb_pages, nb_restored;
+    u32 page_offset, len;
+
+    for (i=0; i<NB_FILES_TO_RELOAD; i++)
+    {
+        nb_pages = NB_DIRTY_PAGES(i);
+        nb_restored = 0;
+        for (page=0; page<nb_pages; page++)
         {
-            perrv ("fread()");
-            printf("'%s': Unexpected file size or read error\n", fname[i]);
-            ERR_EXIT;
+            if (!dirty_page[i][page])
+                continue;
+            page_offset = page << DIRTY_PAGE_SHIFT;
+            len = ((page_offset + (1<<DIRTY_PAGE_SHIFT)) > fsize[i])?(fsize[i]-page_offset):(1<<DIRTY_PAGE_SHIFT);
+            memcpy(fbuffer[i] + page_offset, pristine[i] + page_offset, len);
+            dirty_page[i][page] = 0;
+            nb_restored++;
         }
-
-        fclose (fd);
-        fd = NULL;
+        printv("Reverted %d/%d pages of '%s'\n", (int)nb_restored, (int)nb_pages, fname[i]);
     }
 }
 
@@ -390,10 +549,7 @@ void newgame_init()
     opt_haunted_castle = false;
 
     if (game_restart)
-    {
-        reload_files();
-        fix_files(true);
-    }
+        restore_files();
 
     // clear the events array
     for (i=0; i< NB_EVENTS; i++)
@@ -452,9 +608,7 @@ void newgame_init()
 
     // This will be needed to hide the pickable objects on the outside map
     // if the removable walls are set
-    for (i=0; i<CMP_MAP_WIDTH; i++)
-        for (j=0; j<CMP_MAP_HEIGHT; j++)
-            remove_props[i][j] = 0;
+    reset_cmp_grid();
 
 
     // Setup the start time
@@ -478,14 +632,13 @@ void newgame_init()
     if (game_restart)
     {	// Reset the palette
         palette_index = INITIAL_PALETTE_INDEX;
-        to_16bit_palette(palette_index, 0xFF, PALETTES);
-        cells_to_wGRAB(fbuffer[CELLS],rgbCells);
-        sprites_to_wGRAB();
+        set_palette(palette_index);
     }
 
     // Reset the room props & animations
     init_animations = true;
     set_room_props();
+    invalidate_pause_screen();
 
     // Reinit the time markers;
     // NB: to have the clock go at full throttle, set ctime to 0 and game_time to a high value
@@ -494,6 +647,7 @@ void newgame_init()
     last_ctime = 0;
     last_atime = 0;
     last_ptime = 0;
+    set_tick_positions();
 
     // Notify that we'll need a reload next time around
     game_restart = true;
@@ -544,7 +698,7 @@ bool save_game(char* save_name)
 
 bool load_game(char* load_name)
 {
-    int i,j;
+    int i;
     if ((fd = fopen(load_name, "rb")) == NULL)
         return false;
 
@@ -566,6 +720,9 @@ bool load_game(char* load_name)
     LOAD_ARRAY(selected_prop);
     for (i=0; i<NB_NATIONS; i++)
         LOAD_ARRAY(props[i])
+    // The whole of the files we revert on restart are overwritten
+    for (i=0; i<NB_FILES_TO_RELOAD; i++)
+        memset(dirty_page[i], 1, NB_DIRTY_PAGES(i));
     for (i=0; i<NB_FILES_TO_SAVE; i++)
         LOAD_BUFFER(i);
 
@@ -573,21 +730,19 @@ bool load_game(char* load_name)
     // clear a few arrays
     for (i=0; i< NB_EVENTS; i++)
         events[i].function = NULL;
-    for (i=0; i<CMP_MAP_WIDTH; i++)
-        for (j=0; j<CMP_MAP_HEIGHT; j++)
-            remove_props[i][j] = 0;
+    reset_cmp_grid();
 
     // Restore the palette
-    to_16bit_palette(palette_index, 0xFF, PALETTES);
-    cells_to_wGRAB(fbuffer[CELLS],rgbCells);
-    sprites_to_wGRAB();
+    set_palette(palette_index);
 
     // Reset the room props & animations
     init_animations = true;
     set_room_props();
+    invalidate_pause_screen();
 
     // Update time
     t_last = mtime();
+    set_tick_positions();
 
     fclose(fd);
 
@@ -595,6 +750,77 @@ bool load_game(char* load_name)
 }
 
 
+// Record the guys positions, before a reposition tick
+void set_tick_positions()
+{
+    u8 i;
+
+    for (i=0; i<NB_GUYBRUSHES; i++)
+    {
+        tick_px[i] = guy(i).px;
+        tick_p2y[i] = guy(i).p2y;
+        tick_dir[i] = guy(i).direction;
+        tick_state[i] = guy(i).state;
+        tick_room[i] = guy(i).room;
+    }
+}
+
+// Did anybody in our room move, turn or change state during the last reposition tick?
+// As long as someone moved, the display positions also change in between ticks
+bool tick_motion()
+{
+    u8 i;
+
+    for (i=0; i<NB_GUYBRUSHES; i++)
+    {
+        // The prisoners' states also show on the panel
+        if ((i < NB_NATIONS) && (tick_state[i] != guy(i).state))
+            return true;
+        if ((guy(i).room != current_room_index) && (tick_room[i] != current_room_index))
+            continue;
+        if ((tick_px[i] != guy(i).px) || (tick_p2y[i] != guy(i).p2y) ||
+            (tick_dir[i] != guy(i).direction) || (tick_state[i] != guy(i).state) ||
+            (tick_room[i] != guy(i).room))
+            return true;
+    }
+    return false;
+}
+
+// Is anybody in our room animated, and thus changing on animation ticks?
+bool room_animated()
+{
+    u8 i;
+
+    if (nb_animations != 0)
+        return true;
+    for (i=0; i<NB_GUYBRUSHES; i++)
+        if ((guy(i).room == current_room_index) && (guy(i).state & (STATE_MOTION|STATE_ANIMATED)))
+            return true;
+    return false;
+}
+
+// The display lags one reposition tick behind, so that we can interpolate between
+// the positions before and after the last tick, according to the time elapsed since
+static s16 tick_interpolate(s16 prev, s16 cur)
+{
+    u64 elapsed = game_time - last_ptime;
+
+    if ((elapsed >= REPOSITION_TICK) || (abs(cur-prev) > MAX_TICK_MOTION))
+        return cur;
+    return prev + (s16)(((s32)(cur-prev)*(s32)elapsed)/REPOSITION_TICK);
+}
+
+// Position to display guybrush i at
+s16 render_px(u8 i)
+{
+    return tick_interpolate(tick_px[i], guy(i).px);
+}
+
+s16 render_p2y(u8 i)
+{
+    return tick_interpolate(tick_p2y[i], guy(i).p2y);
+}
+
 // Simple event handler
 void enqueue_event(void (*f)(u32), u32 p, u64 delay)
 {
@@ -842,29 +1068,46 @@ void crm_set_overlays(s16 x, s16 y, u16 current_tile)
 // Populates the tile overlays, if we are on the CoMPressed map
 void cmp_set_overlays()
 {
-    u16 i;
+    // The overlays that apply to the last rem_bitmask we saw
+    static u16  active_ovl[OUTSIDE_OVL_NB+TUNNEL_OVL_NB];
+    static u8   nb_active_ovl = 0;
+    static u32  active_bitmask;
+    static bool active_valid = false;
+    u16 i, j;
     u32 bitset;
     short sx, sy;
     u8	exit_nr;
     int sid;	// sprite index
-    u8 io_file = ROOMS;	// We'll need to switch to TUNNEL_IO midway through
+    u8 io_file;
 
     // We're on the compressed map
     room_x = CMP_MAP_WIDTH;
 
-    for (i=0; i<(4*OUTSIDE_OVL_NB+4*TUNNEL_OVL_NB); i+=4)
+    // The removable walls only change when crossing specific tiles
+    if ((!active_valid) || (active_bitmask != rem_bitmask))
     {
-        if (i==(4*OUTSIDE_OVL_NB))
-            io_file = TUNNEL_IO;	// switch IO file
+        nb_active_ovl = 0;
+        for (i=0; i<(4*OUTSIDE_OVL_NB+4*TUNNEL_OVL_NB); i+=4)
+        {
+            // The relevant bit (byte[0]) from the bitmask must be set
+            bitset = 1 << (readbyte(fbuffer[LOADER], OUTSIDE_OVL_BASE+i));
+            if (!(rem_bitmask & bitset))
+                continue;
+            // But only if the bit identified by byte[1] is not set
+            bitset = 1 << (readbyte(fbuffer[LOADER], OUTSIDE_OVL_BASE+i+1));
+            if (rem_bitmask & bitset)
+                continue;
+            active_ovl[nb_active_ovl++] = i;
+        }
+        active_bitmask = rem_bitmask;
+        active_valid = true;
+    }
 
-        // The relevant bit (byte[0]) from the bitmask must be set
-        bitset = 1 << (readbyte(fbuffer[LOADER], OUTSIDE_OVL_BASE+i));
-        if (!(rem_bitmask & bitset))
-            continue;
-        // But only if the bit identified by byte[1] is not set
-        bitset = 1 << (readbyte(fbuffer[LOADER], OUTSIDE_OVL_BASE+i+1));
-        if (rem_bitmask & bitset)
-            continue;
+    for (j=0; j<nb_active_ovl; j++)
+    {
+        i = active_ovl[j];
+        // We need to switch to TUNNEL_IO midway through
+        io_file = (i<(4*OUTSIDE_OVL_NB))?ROOMS:TUNNEL_IO;
 
         // OK, now we know that our removable section is meant to show an exit
 
@@ -1025,13 +1268,88 @@ void sort_overlays(u8 a[], u8 n)
 
     i = 0; j = m; k = 0;
     while ((i < m) && (j < n))
+    {
         a[k++] = (overlay[a[j]].z < overlay[b[i]].z) ? a[j++] : b[i++];
         // => invariant: a[1..k] in final position
+        nb_overlay_compares++;
+    }
     while (i < m)
         a[k++] = b[i++];
         // => invariant: a[1..k] in final position
 }
 
+// The merge sort above is stable, so overlays with the same z are ordered by index
+static __inline bool overlay_before(u8 i, u8 j)
+{
+    nb_overlay_compares++;
+    return (overlay[i].z < overlay[j].z) || ((overlay[i].z == overlay[j].z) && (i < j));
+}
+
+// Insertion sort, which only takes n-1 comparisons when a[] is already sorted
+static void insertion_sort_overlays(u8 a[], u8 n)
+{
+    u8 i, j, v;
+
+    for (i=1; i<n; i++)
+    {
+        v = a[i];
+        for (j=i; (j>0) && overlay_before(v, a[j-1]); j--)
+            a[j] = a[j-1];
+        a[j] = v;
+    }
+}
+
+// Produces the same order as sort_overlays(), for overlays [0, nb_static) that are
+// the props and room tiles and [nb_static, n) that are the guybrushes.
+// Within a room, the static overlays are the same from one frame to the next, and
+// keep their relative z (they all scroll by the same amount), so we start from the
+// order of the last frame, as we do for the few guybrushes, which move slowly. The
+// two lists are then merged.
+void order_overlays(u8 a[], u8 nb_static, u8 n)
+{
+    static u8  static_order[MAX_OVERLAYS], dynamic_order[MAX_OVERLAYS];
+    static u8  nb_static_order = 0, nb_dynamic_order = 0, dynamic_base = 0;
+    static u16 order_room = 0xFFFF;
+    static u8  order_nation = 0xFF;
+    u8 i, j, k;
+
+    if ( (nb_static != nb_static_order) || (order_room != current_room_index) ||
+         (order_nation != current_nation) )
+    {	// New room, or overlays that came in or out of view => full sort
+        for (i=0; i<nb_static; i++)
+            static_order[i] = i;
+        sort_overlays(static_order, nb_static);
+        nb_static_order = nb_static;
+        order_room = current_room_index;
+        order_nation = current_nation;
+    }
+    else
+        // Some door animations change the z
+        insertion_sort_overlays(static_order, nb_static);
+
+    if ((nb_static != dynamic_base) || (n-nb_static != nb_dynamic_order))
+    {
+        dynamic_base = nb_static;
+        nb_dynamic_order = n-nb_static;
+        for (i=0; i<nb_dynamic_order; i++)
+            dynamic_order[i] = nb_static+i;
+    }
+    insertion_sort_overlays(dynamic_order, nb_dynamic_order);
+
+    // The dynamic overlays have the higher indexes, so static ones go first on same z
+    i = 0; j = 0; k = 0;
+    while ((i < nb_static) && (j < nb_dynamic_order))
+    {
+        a[k++] = (overlay[dynamic_order[j]].z < overlay[static_order[i]].z) ?
+            dynamic_order[j++] : static_order[i++];
+        nb_overlay_compares++;
+    }
+    while (i < nb_static)
+        a[k++] = static_order[i++];
+    while (j < nb_dynamic_order)
+        a[k++] = dynamic_order[j++];
+}
+
 // The compressed map (outside) uses a series of overlaid tiles to bring some walls
 // up or down, according to a bitmask
 void removable_walls()
@@ -1225,7 +1543,7 @@ u8 i, sid;
     // If you uncomment the lines below, you'll get confirmation that our position
     // computations are right to position our guy to the middle of the screen
 //	overlay[overlay_index].x = gl_off_x + guybrush[PRISONER].px + sprite[sid].x_offset;
-    overlay[overlay_index].y = gl_off_y + guybrush[current_nation].p2y/2 - sprite[sid].h + (in_tunnel?11:5);
+    overlay[overlay_index].y = gl_off_y + render_p2y(current_nation)/2 - sprite[sid].h + (in_tunnel?11:5);
     overlay[overlay_index].x = PSP_SCR_WIDTH/2 + sprite[sid].x_offset - (in_tunnel?24:0);
 //	overlay[overlay_index].y = PSP_SCR_HEIGHT/2 - NORTHWARD_HO - 32;
 
@@ -1258,9 +1576,9 @@ u8 i, sid;
         // How I wish there was an easy way to explain these small offsets we add
         // NB: The positions we compute below are still missing the sprite dimensions
         // which we will only add at the end. They are just good enough for ignore_offscreen()
-        overlay[overlay_index].x = gl_off_x + guy(i).px; // + sprite[sid].x_offset;
+        overlay[overlay_index].x = gl_off_x + render_px(i); // + sprite[sid].x_offset;
         ignore_offscreen_x(overlay_index);	// Don't bother if offscreen
-        overlay[overlay_index].y = gl_off_y + guy(i).p2y/2 + 5; //  - sprite[sid].h + 5;
+        overlay[overlay_index].y = gl_off_y + render_p2y(i)/2 + 5; //  - sprite[sid].h + 5;
         ignore_offscreen_y(overlay_index);	// Don't bother if offscreen
 
         // If the guy's under a removable wall, we ignore him too
@@ -1974,9 +2292,7 @@ void timed_events(u16 hours, u16 minutes_high, u16 minutes_low)
     if (event_data == TIMED_EVENT_PALETTE)
     {
         palette_index = readbyte(fbuffer[LOADER], next_timed_event_ptr+9);
-        to_16bit_palette(palette_index, 0xFF, PALETTES);
-        cells_to_wGRAB(fbuffer[CELLS],rgbCells);
-        sprites_to_wGRAB();
+        set_palette(palette_index);
         next_timed_event_ptr += 10;
     }
     else
@@ -2033,7 +2349,7 @@ void toggle_exit(u32 exit_nr)
         // Toggle the exit we are facing
         exit_flags = readbyte(fbuffer[ROOMS_TUNIO], exit_flags_offset);
         toggle_open_flag(exit_flags);
-        writebyte(fbuffer[ROOMS_TUNIO], exit_flags_offset, exit_flags);
+        writebyte_dirty(ROOMS_TUNIO, exit_flags_offset, exit_flags);
 
         // Get target:
         // If we are on the compressed map, we need to read 2 words (out of 4)
@@ -2047,7 +2363,7 @@ void toggle_exit(u32 exit_nr)
         // Toggle the exit we are facing
         exit_flags = readbyte(fbuffer[ROOMS], exit_flags_offset);
         toggle_open_flag(exit_flags);
-        writebyte(fbuffer[ROOMS], exit_flags_offset, exit_flags);
+        writebyte_dirty(ROOMS, exit_flags_offset, exit_flags);
 
         // Get target by reading from the ROOMS_EXIT_BASE data
         exit_index = (exit_nr&0xF)-1;
@@ -2069,7 +2385,7 @@ void toggle_exit(u32 exit_nr)
         // set the mirror door to open
         exit_flags = readbyte(fbuffer[ROOMS_TUNIO], _offset);
         toggle_open_flag(exit_flags);
-        writebyte(fbuffer[ROOMS_TUNIO], _offset, exit_flags);
+        writebyte_dirty(ROOMS_TUNIO, _offset, exit_flags);
     }
     else
     {	// inside destination (colditz_room_map)
@@ -2093,7 +2409,7 @@ void toggle_exit(u32 exit_nr)
                     // open exit
                     exit_flags = tile_data & 0xFF;
                     toggle_open_flag(exit_flags);
-                    writebyte(fbuffer[ROOMS], CRM_ROOMS_START+_offset+1, exit_flags);
+                    writebyte_dirty(ROOMS, CRM_ROOMS_START+_offset+1, exit_flags);
                     break;
                 }
                 _offset +=2;		// Read next tile
@@ -2697,9 +3013,9 @@ void go_to_jail(u32 p)
     p_event[p].unauthorized = false;
 
     // Make sure the jail doors are closed when we leave the prisoner in!
-    writebyte(fbuffer[ROOMS], solitary_cells_door_offset[p][0],
+    writebyte_dirty(ROOMS, solitary_cells_door_offset[p][0],
         readbyte(fbuffer[ROOMS], solitary_cells_door_offset[p][0]) & 0xEF);
-    writebyte(fbuffer[ROOMS], solitary_cells_door_offset[p][1],
+    writebyte_dirty(ROOMS, solitary_cells_door_offset[p][1],
         readbyte(fbuffer[ROOMS], solitary_cells_door_offset[p][1]) & 0xEF);
 
     // Set our guy in the cell
@@ -2928,7 +3244,7 @@ void check_on_prisoners()
 
 // Looks like the original programmer found that some of the data files had issues,
 // but rather than fixing the files, they patched them in the loader... go figure!
-void fix_files(bool reload)
+void fix_files()
 {
     u8 i;
     u32 mask;
@@ -2946,10 +3262,6 @@ void fix_files(bool reload)
     //00001C28                 move.w  #$114,(r116_exits+$E).l ; fix room #116's last exit (0 -> $114)
     writeword(fbuffer[ROOMS],ROOMS_EXITS_BASE+(0x116<<4)+0xE,0x0114);
 
-    if (reload)
-    // On a reload, no need to fix the other files again
-        return;
-
     // DEBUG: I've always wanted to have the stethoscope!
     // (replaces the stone in the courtyard)
 //	writeword(fbuffer[OBJECTS],32,0x000E);
@@ -84,12 +84,33 @@ extern "C" {
 		perr("Too many overlays!\n");		}
 
 
+// The files that are reverted on a new game must be modified through these, so that
+// we know which pages need to be copied back from the pristine snapshot
+#define DIRTY_PAGE_SHIFT			8
+#define NB_DIRTY_PAGES(file)		((fsize[file] + (1<<DIRTY_PAGE_SHIFT) - 1) >> DIRTY_PAGE_SHIFT)
+extern u8	*dirty_page[NB_FILES_TO_RELOAD];
+static __inline void writebyte_dirty(u8 file, u32 addr, u8 value)
+{
+	writebyte(fbuffer[file], addr, value);
+	dirty_page[file][addr>>DIRTY_PAGE_SHIFT] = 1;
+}
+
+static __inline void writeword_dirty(u8 file, u32 addr, u16 value)
+{
+	writeword(fbuffer[file], addr, value);
+	dirty_page[file][addr>>DIRTY_PAGE_SHIFT] = 1;
+	dirty_page[file][(addr+1)>>DIRTY_PAGE_SHIFT] = 1;
+}
+
+
 // A few definitions to make prop handling and status messages more readable
 extern u64  t_status_message_timeout;
 static __inline void set_status_message(void* msg, int priority, u64 timeout_duration)
 {
 	if (priority >= status_message_priority)
 	{
+		if (status_message != (char*)(msg))
+			display_dirty |= DIRTY_PANEL;
 		t_status_message_timeout = game_time + timeout_duration;
 		status_message = (char*)(msg);
 		status_message_priority = priority;
@@ -130,8 +151,12 @@ extern s_guybrush	guybrush[NB_GUYBRUSHES];
  *	Public prototypes
  */
 void free_data();
-void load_all_files();
-void reload_files();
+bool load_file(u16 i);
+void read_hash_cache();
+void get_file_hash(u16 i);
+void write_hash_cache();
+bool snapshot_files();
+void restore_files();
 void newgame_init();
 bool save_game(char* save_name);
 bool load_game(char* load_name);
@@ -145,7 +170,7 @@ s16  check_tunnel_io();
 bool check_guard_footprint(u8 g, s16 dx, s16 d2y);
 void switch_nation(u8 new_nation);
 void switch_room(s16 exit, bool tunnel_io);
-void fix_files(bool reload);
+void fix_files();
 void timed_events(u16 hours, u16 minutes_high, u16 minutes_low);
 void check_on_prisoners();
 void play_sfx(int sfx_id);
@@ -155,8 +180,14 @@ void set_props_overlays();
 void crm_set_overlays(s16 x, s16 y, u16 current_tile);
 void cmp_set_overlays();
 void removable_walls();
+void set_tick_positions();
+bool tick_motion();
+bool room_animated();
+s16  render_px(u8 i);
+s16  render_p2y(u8 i);
 void add_guybrushes();
 void sort_overlays(u8 a[], u8 n);
+void order_overlays(u8 a[], u8 nb_static, u8 n);
 void play_cluck();
 void thriller_toggle();
 
@@ -23,7 +23,9 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <math.h>
 #include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -57,6 +59,11 @@
 #include "conf.h"
 #include "graphics.h"
 #include "game.h"
+#include "md5.h"
+#include "pack.h"
+#include "soft-render.h"
+#include "tasks.h"
+#include "scaler.h"
 
 // For the savefile modification times
 #if defined(WIN32)
@@ -72,31 +79,116 @@
 // variables common to game & graphics
 extern u8	remove_props[CMP_MAP_WIDTH][CMP_MAP_HEIGHT];
 extern u8  overlay_order[MAX_OVERLAYS];
+extern u32 nb_overlay_compares;
 extern int	currently_animated[MAX_ANIMATIONS];
 extern u16 room_x, room_y;
 extern s16 tile_x, tile_y;
 extern u32 offset;
 
 // Whatever you do, you don't want local variables holding textures
-GLuint* cell_texid = NULL;
-GLuint* sprite_texid = NULL;
-GLuint* chars_texid = NULL;
+s_atlas_entry* cell_atlas = NULL;
+s_atlas_entry* sprite_atlas = NULL;
+s_atlas_entry  chars_atlas[NB_PANEL_CHARS];
 GLuint render_texid;
 GLuint paused_texid[4];
 
 u16  nb_cells;
 s16	gl_off_x = 0, gl_off_y  = 0;	// GL display offsets
 s16  last_p_x, last_p_y;			// Stored positions
-u8* background_buffer = NULL;		// (re)used for static pictures
+// Static pictures are decoded in one of these fixed size buffers, before
+// being handed over to GL
+static u8*  picture_buffer[NB_PICTURE_BUFFERS];
+static bool picture_buffer_used[NB_PICTURE_BUFFERS];
+// Static picture textures are kept in GL memory and evicted in LRU order,
+// once they use more than opt_picture_cache KB. 0 means not loaded
+static u32  picture_last_used[NB_IFFS];
+static u32  picture_use_count = 0;
+static u32  picture_cache_size = 0;
+// A picture larger than the cache is only kept until the next one is loaded
+static u32  picture_uncached = NB_IFFS;
+// The atlas pages the cells, sprites and panel chars are packed into
+static s_atlas_page	atlas_page[MAX_ATLAS_PAGES];
+static u8   nb_atlas_pages = 0;
+static u8*  atlas_buffer = NULL;	// where a page is composed before upload
+static u16* cell_alias = NULL;		// index of the first cell with the same data
+static u8   panel_chars[NB_PANEL_CHARS][8*8*2];
+// Texture bound on unit 0, so that we only rebind when needed
+static GLuint bound_texid = 0;
+static u32  nb_texture_binds = 0;
+// The backend we draw with, and the one that gets a copy of the textures, for testing
+const s_renderer* renderer = &gl_renderer;
+static const s_renderer* mirror = NULL;
+// The quads waiting to be drawn
+static s_quad   batch_quad[MAX_BATCH_QUADS];
+static s_vertex batch_vertex[6*MAX_BATCH_QUADS];
+static u32  nb_batch_quads = 0;
+static u16  batch_group = 0;		// sortable section of the current quads, if not 0
+static u8   batch_colour[4] = {0xFF, 0xFF, 0xFF, 0xFF};
+static u32  nb_draw_calls = 0, nb_vertices = 0;
+static u32  batch_base = 0;			// the quads below this are kept for the screen
+// What was drawn on the last frame, to find out which part of the screen changed
+static s_quad   frame_quad[MAX_BATCH_QUADS];
+static u32  nb_frame_quads = 0;
+static bool frame_open = false;		// the quads are being queued for a whole frame
+static bool frame_tracked;			// false if part of the frame had to be drawn directly
+static bool frame_cleared;
+static bool frame_dirty = true;		// the next frame must be redrawn in full
+static bool frame_partial = false;	// only the damage area of the frame was redrawn
+static s16  damage_x1, damage_y1, damage_x2, damage_y2;
+static u32  nb_frames_skipped = 0;
+u8   display_dirty = DIRTY_ALL;
+// Resolved outside tiles, for cmp_grid_bitmask (the props flags go to remove_props[])
+static u16  cmp_grid[CMP_MAP_WIDTH][CMP_MAP_HEIGHT];
+static u32  cmp_grid_bitmask;
+static bool cmp_grid_valid = false;
+// The tiles whose overlap list depends on bit n of rem_bitmask are at
+// cmp_bit_tiles[cmp_bit_start[n]] to cmp_bit_tiles[cmp_bit_start[n+1]-1], as y*CMP_MAP_WIDTH+x
+static u16* cmp_bit_tiles = NULL;
+static u16  cmp_bit_start[33];
+#if defined(WIN32)
+static GLuint batch_vbo = 0;
+// The tile layer of the room, as last rendered to an FBO. Inside, this is the whole
+// room. Outside, it starts at a tile multiple of ROOM_CACHE_STEP, with the removables
+// as they were when it was rendered
+static void init_room_cache();
+static void init_scene_fbo();
+static void bind_scene_fbo();
+static void init_pause_fbo();
+static void build_room_cache(s16 origin_x, s16 origin_y);
+static GLuint room_fbo = 0, room_cache_texid = 0;
+static bool room_cache_enabled = false;
+static bool room_cache_valid = false;
+static u16  room_cache_room;
+static s16  room_cache_x, room_cache_y;
+static u32  room_cache_bitmask;
+// Stands in for the window's buffers when rendering offscreen
+static GLuint offscreen_fbo = 0, offscreen_rbo = 0;
+// Where the frames are drawn at our native resolution, into render_texid
+static GLuint scene_fbo = 0;
+// Where the pause screen views are drawn while playing, rather than over the frame
+static GLuint pause_fbo = 0, pause_rbo = 0;
+// The frame as scaled by the CPU scaler, when one is selected
+static GLuint scaled_texid = 0;
+static uint*  scaler_src = NULL;
+static uint*  scaler_dest = NULL;
+#endif
 u8  pause_rgb[3];					// colour for the pause screen borders
 u16  aPalette[32];					// Global palette (32 instead of 16, because
                                     // we also use it to load 5 bpp IFF images
+// The cells & sprites have their own palettes, so that they can be converted
+// in parallel with anything that uses aPalette
+static u16 game_palette[16], panel_palette[16];
 s_sprite*	sprite;
 s_overlay*	overlay;
 u8			overlay_index;
 #if defined(WIN32)
 GLuint sp;							// Shader Program for zoom
+static GLuint palette_sp;			// Shader Program for the palette lookup
+static GLuint palette_texid;		// 16x1 texture of game_palette, on texture unit 1
 #endif
+// When set, the cells & standard sprites are kept as 8 bit palette indexes, and
+// palette_sp applies game_palette. Otherwise, they are converted to GRAB
+static bool indexed_gfx = false;
 
 /*
  *	Menu variables & consts
@@ -200,6 +292,17 @@ static const u16 props_tile [0x213] = {
 
 
 
+// Bind a texture on unit 0, unless it's already bound
+static __inline void bind_texture(GLuint texid)
+{
+    if (texid == bound_texid)
+        return;
+    glBindTexture(GL_TEXTURE_2D, texid);
+    bound_texid = texid;
+    nb_texture_binds++;
+}
+
+
 /*
  * Win32 OpenGL 2.0 Shader functions (hq2x "lite" 2x zoom)
  */
@@ -219,36 +322,30 @@ void printLog(GLuint obj)
 		printf("%s\n", infoLog);
 }
 
-// Convert a shader file to text
+// Convert a shader file (or pack entry) to text
 char *file2string(const char *path)
 {
-	FILE *fd;
-	long len,
-		 r;
+	s_res res;
 	char *str;
 
-	if (!(fd = fopen(path, "rb")))
+	if (!res_open(path, &res))
 	{
 		fprintf(stderr, "Can't open shader file '%s' for reading\n", path);
 		return NULL;
 	}
 
-	fseek(fd, 0, SEEK_END);
-	len = ftell(fd);
-
-	fseek(fd, 0, SEEK_SET);
-
-	if (!(str = malloc((len+2) * sizeof(char))))
+	if (!(str = malloc((res.size+2) * sizeof(char))))
 	{
 		fprintf(stderr, "Can't malloc space for shader '%s'\n", path);
+		res_close(&res);
 		return NULL;
 	}
 
-	r = fread(str, sizeof(char), len, fd);
+	memcpy(str, res.data, res.size);
 	// Files without an ending CR will produce compilation errors
-	str[r] = 0x0A;
-	str[r+1] = '\0';
- 	fclose(fd);
+	str[res.size] = 0x0A;
+	str[res.size+1] = '\0';
+	res_close(&res);
 
 	return str;
 }
@@ -316,6 +413,68 @@ bool compile_shader(u8 zoomfactor)
 	return true;
 }
 
+// The palette lookup. An index >= 16 (C2P_TRANSPARENT set) is a masked out pixel
+static const char* palette_fs_source =
+	"uniform sampler2D indexes;\n"
+	"uniform sampler2D palette;\n"
+	"void main()\n"
+	"{\n"
+	"	float index = floor(texture2D(indexes, gl_TexCoord[0].xy).r * 255.0 + 0.5);\n"
+	"	vec4 colour = texture2D(palette, vec2((mod(index, 16.0) + 0.5) / 16.0, 0.5));\n"
+	"	if (index > 15.5)\n"
+	"		colour.a = 0.0;\n"
+	"	gl_FragColor = colour * gl_Color;\n"
+	"}\n";
+
+// Compile the palette lookup shader, and create the palette texture it uses
+static bool compile_palette_shader()
+{
+	const char* fsSource = palette_fs_source;
+	GLuint fs;
+	GLint status;
+
+	fs = glCreateShader(GL_FRAGMENT_SHADER);
+	glShaderSource(fs, 1, &fsSource, NULL);
+	glCompileShader(fs);
+	glGetShaderiv(fs, GL_COMPILE_STATUS, &status);
+	if (status != GL_TRUE)
+	{	// Compilation error
+		perr("Error compiling palette shader:\n");
+		printLog(fs);
+		return false;
+	}
+
+	// No vertex shader: the fixed pipeline does the job
+	palette_sp = glCreateProgram();
+	glAttachShader(palette_sp, fs);
+	glLinkProgram(palette_sp);
+	glGetProgramiv(palette_sp, GL_LINK_STATUS, &status);
+	if (status != GL_TRUE)
+	{	// Compilation error
+		perr("Error linking palette shader program:\n");
+		printLog(palette_sp);
+		return false;
+	}
+
+	// The indexes are on texture unit 0 and the palette on unit 1, for good
+	glUseProgram(palette_sp);
+	glUniform1i(glGetUniformLocation(palette_sp, "indexes"), 0);
+	glUniform1i(glGetUniformLocation(palette_sp, "palette"), 1);
+	glUseProgram(0);
+
+	glGenTextures(1, &palette_texid);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, palette_texid);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 16, 1, 0, GL_RGBA, GL_UNSIGNED_SHORT_4_4_4_4_REV, NULL);
+	glActiveTexture(GL_TEXTURE0);
+
+	return true;
+}
+
 // Init the shader. Returns false if an issue was encountered
 bool init_shader()
 {
@@ -331,11 +490,15 @@ bool init_shader()
 	if (!GLEW_VERSION_2_0)
 		return false;
 
+	// Without the palette shader, we fall back to converting the cells & sprites
+	// to GRAB, which must then be redone on each palette change
+	indexed_gfx = compile_palette_shader();
+	printv("Using %s cells & sprites\n", indexed_gfx?"palette indexed":"GRAB");
+
 	// For now, only HQ2X **LITE** is available as HQnX GLSL shader,
-	// (and it's not doing as good a job as the **FULL** CPU HQ2X
-	// version -- which is too slow for our use) so 2x factor only.
-	// When someone actually bothers writing proper GLSL versions of
-	// **BOTH** HQ3X and HQ4X, we'll see about adding them
+	// so 2x factor only. The CPU scalers (-z) can do 3x and 4x, but
+	// not as fast. When someone actually bothers writing proper GLSL
+	// versions of **BOTH** HQ3X and HQ4X, we'll see about adding them
 	if (compile_shader(2))
 	{
 		opt_glsl_enabled = true;
@@ -350,10 +513,12 @@ bool init_shader()
 void free_gfx()
 {
 	int i;
-	SAFREE(background_buffer);
-	SFREE(cell_texid);
-	SFREE(sprite_texid);
-	SFREE(chars_texid);
+	for (i=0; i<NB_PICTURE_BUFFERS; i++)
+		SAFREE(picture_buffer[i]);
+	SFREE(cell_atlas);
+	SFREE(sprite_atlas);
+	SFREE(cell_alias);
+	SAFREE(atlas_buffer);
 	SAFREE(texture[PANEL_BASE1].buffer);
 	SAFREE(texture[PANEL_BASE2].buffer);
 	SAFREE(texture[PICTURE_CORNER].buffer);
@@ -370,34 +535,20 @@ void set_textures()
 {
     int	i;
 
-    // Allocate the main background buffer, which is not tied to any file but shared
-    // to display static images, etc...
-    // The maximum size for our static image textures is 512x256x2 (IFF) or 512x512x3
-    // (RAW RGB) bytes
-    // NOTE that because we don't want to waste the 512x(512-272)x3 (=360 KB) extra
-    // space on the PSP (the PSP can only deal with texture dimensions that are in
-    // power of twos), we are doing something really dodgy here, which is that we
-    // pretend the extra 360K have been allocated, and let the system blatantly
-    // overflow our image buffer if it wants to (since it should never display that
-    // data anyway). Doesn't seem to be too much of an issue...
-    //
-    //
-    // If you're really unhappy about this kind of practice, just allocate 512x512x3
-    background_buffer = (u8*) aligned_malloc(512*PSP_SCR_HEIGHT*3,16);
-//	background_buffer = (u8*) aligned_malloc(512*512*3,16);
-    if (background_buffer == NULL)
-        printf("Could not allocate buffer for static images display\n");
-
-    // Now that we have that buffer alloc'd, we can set the textures that will make
-    // use of it. This includes all the IFFs
-    for (i=0; i<NB_IFFS; i++)
-        texture[i].buffer = background_buffer;
+    // Allocate the buffers static pictures are decoded into. Their size is that of
+    // the largest (powerized) texture we accept for an IFF, i.e. 512x256x2 bytes
+    for (i=0; i<NB_PICTURE_BUFFERS; i++)
+    {
+        picture_buffer[i] = (u8*) aligned_malloc(PICTURE_BUFFER_SIZE, 16);
+        if (picture_buffer[i] == NULL)
+            printf("Could not allocate buffer for static images display\n");
+    }
 
     // Setup the backdrop cells
     // A backdrop cell is exactly 256 bytes (32*16*4bits)
     nb_cells = fsize[CELLS] / 0x100;
-    cell_texid = calloc(sizeof(GLuint) * nb_cells, 1);
-    glGenTextures(nb_cells, cell_texid);
+    cell_atlas = calloc(sizeof(s_atlas_entry) * nb_cells, 1);
+    cell_alias = calloc(sizeof(u16) * nb_cells, 1);
 
     if (readword(fbuffer[SPRITES],0) != (NB_STANDARD_SPRITES-1))
     {
@@ -405,16 +556,26 @@ void set_textures()
         ERR_EXIT;
     }
 
-    sprite_texid = calloc(sizeof(GLuint) * NB_SPRITES, 1);
-    glGenTextures(NB_SPRITES, sprite_texid);
-
-    chars_texid = calloc(sizeof(GLuint) * NB_PANEL_CHARS, 1);
-    glGenTextures(NB_PANEL_CHARS, chars_texid);
+    sprite_atlas = calloc(sizeof(s_atlas_entry) * NB_SPRITES, 1);
+    atlas_buffer = (u8*) aligned_malloc(ATLAS_SIZE*ATLAS_SIZE*RGBA_SIZE, 16);
+    if ((cell_atlas == NULL) || (cell_alias == NULL) || (sprite_atlas == NULL) || (atlas_buffer == NULL))
+    {
+        printf("Could not allocate texture atlas\n");
+        ERR_EXIT;
+    }
 
     // Setup textures for the zoom and paused function
-    glGenTextures(1, &render_texid);
+    if (renderer->gl)
+    {
+        glGenTextures(1, &render_texid);
+#if defined(WIN32)
+        init_scene_fbo();
+        init_room_cache();
+        init_pause_fbo();
+#endif
+    }
     for (i=0; i<4; i++)
-        glGenTextures(1, &paused_texid[i]);
+        paused_texid[i] = renderer->gen_texture();
 
     // Load the panel & corner textures
     load_texture(&texture[PANEL_BASE1]);
@@ -425,7 +586,7 @@ void set_textures()
 
 
 // Convert an Amiga 12 bit RGB colour palette to 16 bit GRAB
-void to_16bit_palette(u8 pal_index, u8 transparent_index, u8 io_file)
+void to_16bit_palette(u16* palette, u8 pal_index, u8 transparent_index, u8 io_file)
 {
     u32 i;
     u16 rgb, grab;
@@ -451,133 +612,711 @@ void to_16bit_palette(u8 pal_index, u8 transparent_index, u8 io_file)
         // 3) Set Green
         grab |= (rgb << 8) & 0xF000;
         // 4) Write in the palette
-        aPalette[i] = grab;
+        palette[i] = grab;
     }
     printv("\n\n");
 }
 
 
+// Planar to chunky kernel. Only changed to check the SIMD kernels against the scalar one
+static void (*c2p)(const u8* const*, u8, const u8*, u32, const u16*, u8*) = c2p_wGRAB;
+
 // Convert a <bpp> bits line-interleaved source to 16 bit RGBA (GRAB) destination
 // bpp parameter = bits per pixels, a.k.a. colour depth
 // Assumes w to be a multiple of 8, and bpp < 8 as well
-void line_interleaved_to_wGRAB(u8* source, u8* dest, u16 w, u16 h, u8 bpp)
+// With a NULL palette, the destination is 8 bit palette indexes instead
+void line_interleaved_to_wGRAB(u8* source, u8* dest, u16 w, u16 h, u8 bpp, const u16* palette)
 {
-    u8 colour_index;
-    u32 i,j,l,pos;
-    int k;
-    u32 wb;
-    u8 line_byte[8];
+    u32 i, k, wb;
+    const u8* line[8];
 
     // the width of interest to us is the one in bytes.
     wb = w/8;
 
-    // We'll write sequentially to the destination
-    pos = 0;
     for (i=0; i<h; i++)
-    {	// h lines to process
-        for (j=0; j<wb; j++)
-        {	// wb bytes per line
-            for (k=0; k<bpp; k++)
-                // Read one byte from each of the <bpp> lines (starting from max y for openGL)
-                line_byte[bpp-k-1] = readbyte(source, bpp*(wb*i) + k*wb + j);
-            // Write 8 RGBA values
-            for (k=0; k<8; k++)
-            {
-                colour_index = 0;
-                // Get the palette colour index and rotate the line bytes
-                for (l=0; l<bpp; l++)
-                {
-                    colour_index <<= 1;
-                    colour_index |= (line_byte[l]&0x80)?1:0;
-                    line_byte[l] <<= 1;
-                }
-                // Alpha is always set to 0
-                writeword(dest, pos, aPalette[colour_index]);
-                pos += 2;
-            }
-        }
+    {	// Each line has <bpp> lines of wb bytes, one per bitplane, starting with the LSb
+        for (k=0; k<bpp; k++)
+            line[k] = source + bpp*wb*i + k*wb;
+        if (palette == NULL)
+            c2p_index(line, bpp, NULL, wb, dest + w*i);
+        else
+            c2p(line, bpp, NULL, wb, palette, dest + 2*w*i);
     }
 }
 
 
 // Convert a 1+4 bits (mask+colour) bitplane source
-// to 16 bit GRAB destination
-void bitplane_to_wGRAB(u8* source, u8* dest, u16 w, u16 ext_w, u16 h)
+// to 16 bit GRAB destination, or 8 bit indexes if palette is NULL
+void bitplane_to_wGRAB(u8* source, u8* dest, u16 w, u16 ext_w, u16 h, const u16* palette)
 {
-    u16 bitplane_size;
-    u8  colour_index;
-    u16 i,j,k,wb,ext_wb;
-    u8  bitplane_byte[5], mask_byte;
-    u32 pos = 0;
+    u32 i, k, wb, bitplane_size;
+    const u8* line[4];
 
     wb = w/8;	// width in bytes
-    ext_wb = ext_w/8;
     bitplane_size = h*wb;
 
-    for (i=0; i<bitplane_size; i++)
+    // The mask is the first bitplane, followed by the colour ones, starting with the LSb
+    // Lines are padded to ext_w, and the padding left as is (calloced to zero)
+    for (i=0; i<h; i++)
+    {
+        for (k=0; k<4; k++)
+            line[k] = source + (k+1)*bitplane_size + i*wb;
+        if (palette == NULL)
+            c2p_index(line, 4, source + i*wb, wb, dest + ext_w*i);
+        else
+            c2p(line, 4, source + i*wb, wb, palette, dest + 2*ext_w*i);
+    }
+}
+
+
+// Converts the room cells [first, last[ to RGB data we can handle
+// In indexed mode, this is palette independent and only needs to be done once
+void cells_to_wGRAB(u32 first, u32 last)
+{
+    u32 i;
+
+    // Convert each 32x16x4bit (=256 bytes) cell to RGB
+    for (i=first; i<last; i++)
+    {
+        if (indexed_gfx)
+            line_interleaved_to_wGRAB(fbuffer[CELLS] + (256*i), rgbCells+(2*256*i), 32, 16, 4, NULL);
+        else
+            line_interleaved_to_wGRAB(fbuffer[CELLS] + (256*i), rgbCells+(2*RGBA_SIZE*256*i), 32, 16, 4,
+                game_palette);
+    }
+}
+
+// Switch the palette lookup on, for the indexed textures, or off
+static __inline void use_palette_shader(bool enable)
+{
+#if defined(WIN32)
+    static bool enabled = false;
+
+    if ((!indexed_gfx) || (enable == enabled))
+        return;
+    glUseProgram(enable?palette_sp:0);
+    enabled = enable;
+#endif
+}
+
+/*
+ * The GL renderers: the quads are either drawn as batched vertex arrays (streamed in
+ * a VBO on Windows), or one by one in immediate mode, as a reference point
+ */
+static bool gl_init()
+{	// The context is set up by glut_init()
+    return true;
+}
+
+static unsigned int gl_gen_texture()
+{
+    GLuint texid;
+
+    glGenTextures(1, &texid);
+    return texid;
+}
+
+static void gl_upload(unsigned int texid, u16 w, u16 h, u8 format, const u8* data)
+{
+    bind_texture(texid);
+    // Don't modify pixel colour ever. The quads that want something else set their own
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+#if defined(PSP)
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+#else
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+#endif
+    switch (format)
     {
-        // Read one byte from each bitplane...
-        for (j=0; j<5; j++)
-            // bitplanes are in reverse order for colour
-            // and so is openGL's coordinate system for y
-            bitplane_byte[4-j] = readbyte(source, i + (j*bitplane_size) );
+    case TEX_FMT_INDEX:
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, w, h, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, data);
+        break;
+    case TEX_FMT_RGB:
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, w, h, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
+        break;
+    case TEX_FMT_RGBA:
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+        break;
+    default:	// 4 bpp GRAB => BEST PERFORMANCE ON PSP!!
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, h, 0, GL_RGBA, GL_UNSIGNED_SHORT_4_4_4_4_REV, data);
+        break;
+    }
+}
+
+static void gl_capture(unsigned int texid, s16 x, s16 y, u16 w, u16 h)
+{
+    bind_texture(texid);
+    glCopyTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, x, y, w, h, 0);
+}
+
+static void gl_discard(unsigned int texid)
+{
+    if (bound_texid == texid)
+        bound_texid = 0;
+    glDeleteTextures(1, &texid);
+}
+
+// Upload the palette to the palette texture
+static void gl_set_palette(const u16* palette)
+{
+#if defined(WIN32)
+    u8  buffer[16*RGBA_SIZE];
+    int i;
+
+    // Same byte order as the converted GRAB data
+    for (i=0; i<16; i++)
+        writeword(buffer, 2*i, palette[i]);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, palette_texid);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 16, 1, GL_RGBA, GL_UNSIGNED_SHORT_4_4_4_4_REV, buffer);
+    glActiveTexture(GL_TEXTURE0);
+#endif
+}
+
+// The scissor stays on until the frame is presented
+static void gl_clear(s16 x1, s16 y1, s16 x2, s16 y2)
+{
+    if ((x1 > 0) || (y1 > 0) || (x2 < PSP_SCR_WIDTH) || (y2 < PSP_SCR_HEIGHT))
+    {	// GL has its origin at the bottom
+        glScissor(x1, PSP_SCR_HEIGHT-y2, x2-x1, y2-y1);
+        glEnable(GL_SCISSOR_TEST);
+    }
+    else
+        glDisable(GL_SCISSOR_TEST);
+    glClear(GL_COLOR_BUFFER_BIT);
+}
+
+// Set the filter of the texture of a quad
+static void gl_set_filter(const s_quad* q)
+{
+    if ((q->filter != FILTER_ATLAS) && (q->filter != FILTER_NONE))
+    {	// The atlas pages have their parameters set on upload
+        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, (q->filter==FILTER_LINEAR)?GL_LINEAR:GL_NEAREST);
+        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, (q->filter==FILTER_LINEAR)?GL_LINEAR:GL_NEAREST);
+        // If we don't set clamp, our tiling will show
+#if defined(PSP)
+        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+#else
+        // For some reason GL_CLAMP_TO_EDGE on Win achieves the same as GL_CLAMP on PSP
+        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+#endif
+    }
+}
+
+// Set the state for a run of quads sharing the same texture, filter, shader and blending
+static void gl_set_state(const s_quad* q)
+{
+    if (q->filter == FILTER_NONE)
+        glDisable(GL_TEXTURE_2D);
+    else
+        bind_texture(q->texid);
+    gl_set_filter(q);
+    // textures won't appear on PSP without blend disabled (but works on Windows)
+    if (q->opaque)
+        glDisable(GL_BLEND);
+    use_palette_shader(q->indexed);
+}
+
+static void gl_reset_state(const s_quad* q)
+{
+    if (q->filter == FILTER_NONE)
+        glEnable(GL_TEXTURE_2D);
+    if (q->opaque)
+        glEnable(GL_BLEND);
+}
+
+static __inline bool same_state(const s_quad* q1, const s_quad* q2)
+{
+    return (q1->texid == q2->texid) && (q1->filter == q2->filter) &&
+        (q1->indexed == q2->indexed) && (q1->opaque == q2->opaque);
+}
+
+static __inline void set_vertex(s_vertex* v, const s_quad* q, float x, float y, float u, float t)
+{
+    v->u = u;
+    v->v = t;
+    memcpy(v->colour, q->colour, 4);
+    v->x = x;
+    v->y = y;
+    v->z = 0.0f;
+}
 
-        // For clarity
-        mask_byte = bitplane_byte[4];
+// Fill batch_vertex with the triangles of the quads
+static void gl_set_vertices(const s_quad* quad, u32 nb_quads)
+{
+    u32 i;
+    const s_quad* q;
+    s_vertex* v;
 
-        // Write 8 RGBA words
-        for (k=0; k<8; k++)
+    // pspGL does not implement QUADS => 2 triangles each
+    for (i=0; i<nb_quads; i++)
+    {
+        q = &quad[i];
+        v = &batch_vertex[6*i];
+        set_vertex(v++, q, q->x1, q->y1, q->u1, q->v1);
+        set_vertex(v++, q, q->x2, q->y1, q->u2, q->v1);
+        set_vertex(v++, q, q->x1, q->y2, q->u1, q->v2);
+        if (q->half)
+        {	// Degenerate second triangle
+            set_vertex(v++, q, q->x1, q->y1, q->u1, q->v1);
+            set_vertex(v++, q, q->x1, q->y1, q->u1, q->v1);
+            set_vertex(v, q, q->x1, q->y1, q->u1, q->v1);
+        }
+        else
         {
+            set_vertex(v++, q, q->x2, q->y1, q->u2, q->v1);
+            set_vertex(v++, q, q->x2, q->y2, q->u2, q->v2);
+            set_vertex(v, q, q->x1, q->y2, q->u1, q->v2);
+        }
+    }
+}
+
+// One glDrawArrays per run of quads sharing the same state
+static void gl_draw(const s_quad* quad, u32 nb_quads)
+{
+    u32 i, j;
+    const s_quad* q;
+
+    gl_set_vertices(quad, nb_quads);
+
+    // T2F_C4UB_V3F also happens to be what the PSP GE uses natively
+#if defined(WIN32)
+    if (GLEW_VERSION_1_5)
+    {	// Stream the vertices into a VBO
+        if (batch_vbo == 0)
+            glGenBuffers(1, &batch_vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, batch_vbo);
+        glBufferData(GL_ARRAY_BUFFER, 6*nb_quads*sizeof(s_vertex), batch_vertex, GL_STREAM_DRAW);
+        glInterleavedArrays(GL_T2F_C4UB_V3F, 0, NULL);
+    }
+    else
+#endif
+        glInterleavedArrays(GL_T2F_C4UB_V3F, 0, batch_vertex);
+
+    for (i=0; i<nb_quads; i=j)
+    {
+        q = &quad[i];
+        for (j=i+1; (j<nb_quads) && (same_state(&quad[j], q)); j++);
+        gl_set_state(q);
+        glDrawArrays(GL_TRIANGLES, 6*i, 6*(j-i));
+        gl_reset_state(q);
+        nb_draw_calls++;
+    }
+
+    use_palette_shader(false);
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+#if defined(WIN32)
+    if (GLEW_VERSION_1_5)
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+#endif
+}
+
+static __inline void gl_vertex(float x, float y, float u, float v)
+{
+    glTexCoord2f(u, v);
+    glVertex2f(x, y);
+}
 
-            colour_index = 0;
-            // Get the palette colour index and rotate the bitplane bytes
-            for (j=0; j<4; j++)
+// glBegin/glEnd for each quad
+static void gl_immediate_draw(const s_quad* quad, u32 nb_quads)
+{
+    u32 i;
+    const s_quad* q;
+
+    for (i=0; i<nb_quads; i++)
+    {
+        q = &quad[i];
+        gl_set_state(q);
+        glColor4ub(q->colour[0], q->colour[1], q->colour[2], q->colour[3]);
+        glBegin(GL_TRIANGLES);
+            gl_vertex(q->x1, q->y1, q->u1, q->v1);
+            gl_vertex(q->x2, q->y1, q->u2, q->v1);
+            gl_vertex(q->x1, q->y2, q->u1, q->v2);
+            if (!q->half)
             {
-                colour_index <<= 1;
-                colour_index |= (bitplane_byte[j]&0x80)?1:0;
-                bitplane_byte[j] <<= 1;
+                gl_vertex(q->x2, q->y1, q->u2, q->v1);
+                gl_vertex(q->x2, q->y2, q->u2, q->v2);
+                gl_vertex(q->x1, q->y2, q->u1, q->v2);
             }
-            // Alpha is in 3rd position, and needs to be cleared on empty mask
-            writeword(dest, pos, aPalette[colour_index] & ((mask_byte&0x80)?0xFFFF:0xFF0F));
-            pos += 2;
-            // Takes care of padding in width
-            while ((u16)(pos%(2*ext_w))>=(2*w))
-                pos +=2;	// calloced to zero, so just skim
-            mask_byte <<=1;
-        }
+        glEnd();
+        gl_reset_state(q);
+        nb_draw_calls++;
     }
+    use_palette_shader(false);
+}
+
+// The back buffer is undefined after a swap, but the last frame is kept in render_texid,
+// either as the scene FBO, or because that's what rescale_buffer() copies the redrawn area into
+static bool gl_keeps_frame()
+{
+#if defined(WIN32)
+    return (scene_fbo != 0) || ((gl_width != PSP_SCR_WIDTH) || (gl_height != PSP_SCR_HEIGHT));
+#else
+    return false;
+#endif
 }
 
+static void gl_present()
+{
+    glDisable(GL_SCISSOR_TEST);
+#if defined(WIN32)
+    // Rescale the screen on Windows
+    rescale_buffer();
+    if (offscreen_fbo != 0)
+    {	// Nothing to swap
+        glFlush();
+        return;
+    }
+#endif
+    glutSwapBuffers();
+}
 
-// Converts the room cells to RGB data we can handle
-void cells_to_wGRAB(u8* source, u8* dest)
+static u8* gl_read_frame(u16* w, u16* h)
 {
-    u32 i;
+    u8* rgb;
+    int y;
 
-    // Convert each 32x16x4bit (=256 bytes) cell to RGB
-    for (i=0; i<nb_cells; i++)
+    if ((rgb = (u8*) malloc(3*gl_width*gl_height)) == NULL)
+        return NULL;
+#if defined(WIN32)
+    // What we want is the rescaled frame, not the scene
+    if (scene_fbo != 0)
+        glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, offscreen_fbo);
+    // Once swapped, what we drew is in the front buffer
+    glReadBuffer((offscreen_fbo != 0)?GL_COLOR_ATTACHMENT0_EXT:GL_FRONT);
+#endif
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    // GL has its origin at the bottom
+    for (y=0; y<gl_height; y++)
+        glReadPixels(0, gl_height-1-y, gl_width, 1, GL_RGB, GL_UNSIGNED_BYTE, rgb + 3*y*gl_width);
+#if defined(WIN32)
+    glReadBuffer((offscreen_fbo != 0)?GL_COLOR_ATTACHMENT0_EXT:GL_BACK);
+    if (scene_fbo != 0)
+        glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, scene_fbo);
+#endif
+    *w = (u16)gl_width;
+    *h = (u16)gl_height;
+    return rgb;
+}
+
+const s_renderer gl_renderer = { "gl", true, gl_init, gl_gen_texture, gl_upload, gl_capture,
+    gl_discard, gl_set_palette, gl_clear, gl_draw, gl_keeps_frame, gl_present, gl_read_frame };
+const s_renderer gl_immediate_renderer = { "gl-immediate", true, gl_init, gl_gen_texture,
+    gl_upload, gl_capture, gl_discard, gl_set_palette, gl_clear, gl_immediate_draw,
+    gl_keeps_frame, gl_present, gl_read_frame };
+
+#if defined(WIN32)
+/*
+ * The GL 3.3 renderer: the same batches, streamed into a VBO through a VAO, and drawn
+ * with a shader that does both the fixed pipeline's job and the palette lookup.
+ * Everything else (textures, capture, rescaling) is shared with the GL renderer, bar
+ * the zoom shader, which has its own port. Nothing is drawn by the fixed pipeline, but
+ * the shared code still sets its matrices, so we rely on GLUT's compatibility context.
+ * All our projections are an ortho of the viewport, with the origin at the top
+ */
+static const char* gl33_vs_source =
+	"#version 330 core\n"
+	"uniform vec2 viewport;\n"
+	"layout(location = 0) in vec2 tex_coord;\n"
+	"layout(location = 1) in vec4 colour;\n"
+	"layout(location = 2) in vec3 position;\n"
+	"out vec2 uv;\n"
+	"out vec4 tint;\n"
+	"void main()\n"
+	"{\n"
+	"	uv = tex_coord;\n"
+	"	tint = colour;\n"
+	"	gl_Position = vec4(2.0*position.x/viewport.x - 1.0, 1.0 - 2.0*position.y/viewport.y, 0.0, 1.0);\n"
+	"}\n";
+
+// mode is 0 for plain coloured quads, 1 for textured, 2 for palette indexed
+static const char* gl33_fs_source =
+	"#version 330 core\n"
+	"uniform sampler2D tex;\n"
+	"uniform sampler2D palette;\n"
+	"uniform int mode;\n"
+	"in vec2 uv;\n"
+	"in vec4 tint;\n"
+	"out vec4 frag_colour;\n"
+	"void main()\n"
+	"{\n"
+	"	vec4 colour = vec4(1.0);\n"
+	"	float index;\n"
+	"	if (mode == 1)\n"
+	"		colour = texture(tex, uv);\n"
+	"	else if (mode == 2)\n"
+	"	{\n"
+	"		index = floor(texture(tex, uv).r * 255.0 + 0.5);\n"
+	"		colour = texture(palette, vec2((mod(index, 16.0) + 0.5) / 16.0, 0.5));\n"
+	"		if (index > 15.5)\n"
+	"			colour.a = 0.0;\n"
+	"	}\n"
+	"	frag_colour = colour * tint;\n"
+	"}\n";
+
+// The zoom pass of rescale_buffer(): a GLSL 3.30 port of bin/shader-hq2x.vert/.frag
+// (2xGLSL HqFilter shader, by guest(r) - guest.r@gmail.com, GNU-GPL)
+static const char* gl33_zoom_vs_source =
+	"#version 330 core\n"
+	"uniform vec2 viewport;\n"
+	"uniform vec4 OGL2Size;\n"
+	"layout(location = 0) in vec2 tex_coord;\n"
+	"layout(location = 2) in vec3 position;\n"
+	"out vec2 uv0;\n"
+	"out vec4 uv1, uv2, uv3, uv4;\n"
+	"void main()\n"
+	"{\n"
+	"	float x = 0.5 / OGL2Size.x;\n"
+	"	float y = 0.5 / OGL2Size.y;\n"
+	"	vec2 dg1 = vec2( x,y);\n"
+	"	vec2 dg2 = vec2(-x,y);\n"
+	"	vec2 dx = vec2(x,0.0);\n"
+	"	vec2 dy = vec2(0.0,y);\n"
+	"	gl_Position = vec4(2.0*position.x/viewport.x - 1.0, 1.0 - 2.0*position.y/viewport.y, 0.0, 1.0);\n"
+	"	uv0 = tex_coord;\n"
+	"	uv1 = vec4(uv0 - dg1, uv0 - dy);\n"
+	"	uv2 = vec4(uv0 - dg2, uv0 + dx);\n"
+	"	uv3 = vec4(uv0 + dg1, uv0 + dy);\n"
+	"	uv4 = vec4(uv0 + dg2, uv0 - dx);\n"
+	"}\n";
+
+static const char* gl33_zoom_fs_source =
+	"#version 330 core\n"
+	"uniform sampler2D OGL2Texture;\n"
+	"const float mx = 0.325;\n"
+	"const float k = -0.250;\n"
+	"const float max_w = 0.25;\n"
+	"const float min_w =-0.05;\n"
+	"const float lum_add = 0.25;\n"
+	"in vec2 uv0;\n"
+	"in vec4 uv1, uv2, uv3, uv4;\n"
+	"out vec4 frag_colour;\n"
+	"void main()\n"
+	"{\n"
+	"	vec3 c00 = texture(OGL2Texture, uv1.xy).xyz;\n"
+	"	vec3 c10 = texture(OGL2Texture, uv1.zw).xyz;\n"
+	"	vec3 c20 = texture(OGL2Texture, uv2.xy).xyz;\n"
+	"	vec3 c01 = texture(OGL2Texture, uv4.zw).xyz;\n"
+	"	vec3 c11 = texture(OGL2Texture, uv0).xyz;\n"
+	"	vec3 c21 = texture(OGL2Texture, uv2.zw).xyz;\n"
+	"	vec3 c02 = texture(OGL2Texture, uv4.xy).xyz;\n"
+	"	vec3 c12 = texture(OGL2Texture, uv3.zw).xyz;\n"
+	"	vec3 c22 = texture(OGL2Texture, uv3.xy).xyz;\n"
+	"	vec3 dt = vec3(1.0,1.0,1.0);\n"
+	"	float md1=dot(abs(c00-c22),dt);\n"
+	"	float md2=dot(abs(c02-c20),dt);\n"
+	"	float w1=dot(abs(c22-c11),dt)*md2;\n"
+	"	float w2=dot(abs(c02-c11),dt)*md1;\n"
+	"	float w3=dot(abs(c00-c11),dt)*md2;\n"
+	"	float w4=dot(abs(c20-c11),dt)*md1;\n"
+	"	float t1 = w1+w3;\n"
+	"	float t2 = w2+w4;\n"
+	"	float ww = max(t1,t2)+0.0001;\n"
+	"	c11 = (w1*c00+w2*c20+w3*c22+w4*c02+ww*c11)/(t1+t2+ww);\n"
+	"	float lc1 = k/(0.12*dot(c10+c12+c11,dt)+lum_add);\n"
+	"	float lc2 = k/(0.12*dot(c01+c21+c11,dt)+lum_add);\n"
+	"	w1 = clamp(lc1*dot(abs(c11-c10),dt)+mx,min_w,max_w);\n"
+	"	w2 = clamp(lc2*dot(abs(c11-c21),dt)+mx,min_w,max_w);\n"
+	"	w3 = clamp(lc1*dot(abs(c11-c12),dt)+mx,min_w,max_w);\n"
+	"	w4 = clamp(lc2*dot(abs(c11-c01),dt)+mx,min_w,max_w);\n"
+	"	frag_colour = vec4(w1*c10+w2*c21+w3*c12+w4*c01+(1.0-w1-w2-w3-w4)*c11, 1.0);\n"
+	"}\n";
+
+static GLuint gl33_sp = 0, gl33_zoom_sp = 0, gl33_vao = 0, gl33_vbo = 0;
+static GLint  gl33_viewport_loc, gl33_mode_loc, gl33_zoom_viewport_loc;
+
+static GLuint gl33_compile(GLenum type, const char* source)
+{
+    GLuint shader;
+    GLint status;
+
+    shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (status != GL_TRUE)
+    {
+        perr("Error compiling GL 3.3 %s shader:\n", (type == GL_VERTEX_SHADER)?"vertex":"fragment");
+        printLog(shader);
+        return 0;
+    }
+    return shader;
+}
+
+static GLuint gl33_link(const char* vs_source, const char* fs_source)
+{
+    GLuint vs, fs, program;
+    GLint status;
+
+    if ( ((vs = gl33_compile(GL_VERTEX_SHADER, vs_source)) == 0) ||
+         ((fs = gl33_compile(GL_FRAGMENT_SHADER, fs_source)) == 0) )
+        return 0;
+    program = glCreateProgram();
+    glAttachShader(program, vs);
+    glAttachShader(program, fs);
+    glLinkProgram(program);
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (status != GL_TRUE)
+    {
+        perr("Error linking GL 3.3 shader program:\n");
+        printLog(program);
+        return 0;
+    }
+    return program;
+}
+
+static bool gl33_init()
+{
+    // glewInit() has been called by init_shader()
+    if (!GLEW_VERSION_3_3)
+    {
+        perr("The gl33 renderer needs OpenGL 3.3\n");
+        return false;
+    }
+    if ( ((gl33_sp = gl33_link(gl33_vs_source, gl33_fs_source)) == 0) ||
+         ((gl33_zoom_sp = gl33_link(gl33_zoom_vs_source, gl33_zoom_fs_source)) == 0) )
+        return false;
+    // Same texture units as the palette shader
+    glUseProgram(gl33_sp);
+    glUniform1i(glGetUniformLocation(gl33_sp, "tex"), 0);
+    glUniform1i(glGetUniformLocation(gl33_sp, "palette"), 1);
+    gl33_viewport_loc = glGetUniformLocation(gl33_sp, "viewport");
+    gl33_mode_loc = glGetUniformLocation(gl33_sp, "mode");
+    // rescale_buffer() always zooms the PSP screen
+    glUseProgram(gl33_zoom_sp);
+    glUniform1i(glGetUniformLocation(gl33_zoom_sp, "OGL2Texture"), 0);
+    glUniform4f(glGetUniformLocation(gl33_zoom_sp, "OGL2Size"), PSP_SCR_WIDTH, PSP_SCR_HEIGHT, 0.0, 0.0);
+    gl33_zoom_viewport_loc = glGetUniformLocation(gl33_zoom_sp, "viewport");
+    glUseProgram(0);
+
+    // The s_vertex layout only needs to be described once
+    glGenVertexArrays(1, &gl33_vao);
+    glGenBuffers(1, &gl33_vbo);
+    glBindVertexArray(gl33_vao);
+    glBindBuffer(GL_ARRAY_BUFFER, gl33_vbo);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(s_vertex), (void*)offsetof(s_vertex, u));
+    glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(s_vertex), (void*)offsetof(s_vertex, colour));
+    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(s_vertex), (void*)offsetof(s_vertex, x));
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    glEnableVertexAttribArray(2);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    printv("Using the OpenGL 3.3 renderer\n");
+    return true;
+}
+
+// One glDrawArrays per run of quads sharing the same state, from a single VBO upload
+static void gl33_draw(const s_quad* quad, u32 nb_quads)
+{
+    u32 i, j;
+    const s_quad* q;
+    GLint program, viewport[4];
+    bool zoom;
+
+    // The zoom shader that rescale_buffer() selects is written for the fixed pipeline,
+    // so we swap it for our own port. Nothing else is drawn with a program set
+    glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+    zoom = (program != 0) && ((GLuint)program == sp);
+
+    gl_set_vertices(quad, nb_quads);
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    glUseProgram(zoom?gl33_zoom_sp:gl33_sp);
+    glUniform2f(zoom?gl33_zoom_viewport_loc:gl33_viewport_loc, (float)viewport[2], (float)viewport[3]);
+    glBindVertexArray(gl33_vao);
+    glBindBuffer(GL_ARRAY_BUFFER, gl33_vbo);
+    glBufferData(GL_ARRAY_BUFFER, 6*nb_quads*sizeof(s_vertex), batch_vertex, GL_STREAM_DRAW);
+
+    for (i=0; i<nb_quads; i=j)
     {
-        line_interleaved_to_wGRAB(source + (256*i), dest+(2*RGBA_SIZE*256*i), 32, 16, 4);
-        glBindTexture(GL_TEXTURE_2D, cell_texid[i]);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 32, 16, 0, GL_RGBA, GL_UNSIGNED_SHORT_4_4_4_4_REV,
-            ((u8*)rgbCells) + i*2*RGBA_SIZE*0x100);
+        q = &quad[i];
+        for (j=i+1; (j<nb_quads) && (same_state(&quad[j], q)); j++);
+        if (q->filter != FILTER_NONE)
+        {
+            bind_texture(q->texid);
+            gl_set_filter(q);
+        }
+        if (!zoom)
+            glUniform1i(gl33_mode_loc, (q->filter == FILTER_NONE)?0:((q->indexed)?2:1));
+        if (q->opaque)
+            glDisable(GL_BLEND);
+        glDrawArrays(GL_TRIANGLES, 6*i, 6*(j-i));
+        if (q->opaque)
+            glEnable(GL_BLEND);
+        nb_draw_calls++;
     }
 
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindVertexArray(0);
+    glUseProgram(program);
+}
+
+const s_renderer gl33_renderer = { "gl33", true, gl33_init, gl_gen_texture, gl_upload,
+    gl_capture, gl_discard, gl_set_palette, gl_clear, gl33_draw, gl_keeps_frame, gl_present,
+    gl_read_frame };
+#endif
+
+// Select one of our renderers by name. Must be done before any texture is created
+bool set_renderer(const char* name)
+{
+    const s_renderer* list[] = { &gl_renderer, &gl_immediate_renderer,
+#if defined(WIN32)
+        &gl33_renderer,
+#endif
+        &soft_renderer };
+    u32 i;
+
+    for (i=0; i<SIZE_A(list); i++)
+        if (strcmp(list[i]->name, name) == 0)
+        {
+            renderer = list[i];
+            return true;
+        }
+    perr("Unknown renderer '%s'\n", name);
+    return false;
+}
+
+// The textures also go to the mirror renderer, if any, so that it can replay our frames
+static void upload_texture(unsigned int texid, u16 w, u16 h, u8 format, const u8* data)
+{
+    renderer->upload(texid, w, h, format, data);
+    if (mirror != NULL)
+        mirror->upload(texid, w, h, format, data);
+}
+
+static void discard_texture(unsigned int texid)
+{
+    renderer->discard(texid);
+    if (mirror != NULL)
+        mirror->discard(texid);
+}
+
+// Hand game_palette over to the renderers
+static void texturize_palette()
+{
+    frame_invalidate();
+    renderer->set_palette(game_palette);
+    if (mirror != NULL)
+        mirror->set_palette(game_palette);
 }
 
 // Create the sprites for the panel text characters
 void init_panel_chars()
 {
     u8 c, y, x, m, b;
-    static u8 panel_chars[NB_PANEL_CHARS][8*8*2];
 
     // Take care of the menu marker character
     for (y = 0; y < PANEL_CHARS_H+1; y++)
         for (x=0; x<PANEL_CHARS_W; x++)
             writeword((u8*)panel_chars[MENU_MARKER], y*16 + 2*x, 0xFFFF);
-    glBindTexture(GL_TEXTURE_2D, chars_texid[MENU_MARKER]);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, PANEL_CHARS_W, 8, 0, GL_RGBA,
-        GL_UNSIGNED_SHORT_4_4_4_4_REV, (u8*)panel_chars[MENU_MARKER]);
 
 
     for (c = 0; c < NB_PANEL_CHARS; c++)
@@ -608,11 +1347,6 @@ void init_panel_chars()
         // last line is transparent too
         for (x=0; x<PANEL_CHARS_W; x++)
             writeword((u8*)panel_chars[c],y*16 + 2*x,GRAB_TRANSPARENT_COLOUR);
-
-        // Convert to textures
-        glBindTexture(GL_TEXTURE_2D, chars_texid[c]);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, PANEL_CHARS_W, 8, 0, GL_RGBA,
-            GL_UNSIGNED_SHORT_4_4_4_4_REV, (u8*)panel_chars[c]);
     }
 
 }
@@ -664,23 +1398,202 @@ s_panel_sprite get_panel_sprite(u16 sprite_index)
 }
 
 
-// Initialize the sprite array
-void init_sprites()
+/*
+ * Texture atlas: the cells, sprites and panel chars are packed, unpadded, into a few
+ * pages, rather than having one powerized texture each. The identical cells share
+ * the same entry. The cells & standard sprites get their own pages, as they are
+ * the ones that depend on the palette (and are 8 bit indexes in indexed mode)
+ */
+
+// Packing order: tallest first, then widest
+static int atlas_compare(const void* a, const void* b)
 {
-    u32 i = 2;	// We need to ignore the first word (nb of sprites)
-    u16 sprite_index = 0;
-    u16 sprite_w;	// width, in words
-    u32 sprite_address;
+    const s_atlas_entry* e1 = *(const s_atlas_entry* const*)a;
+    const s_atlas_entry* e2 = *(const s_atlas_entry* const*)b;
 
-    // Allocate the sprites and overlay arrays
-    sprite = aligned_malloc(NB_SPRITES * sizeof(s_sprite), 16);
-    overlay = aligned_malloc(MAX_OVERLAYS * sizeof(s_overlay), 16);
+    if (e1->h != e2->h)
+        return e2->h - e1->h;
+    return e2->w - e1->w;
+}
 
-    // First thing we do is populate the standard sprite offsets at the beginning of the table
-    sprite_address = i + 4* (readword(fbuffer[SPRITES],0) + 1);
-    for (sprite_index=0; sprite_index<NB_STANDARD_SPRITES; sprite_index++)
-    {
-        sprite_address += readlong(fbuffer[SPRITES],i);
+// Shelf pack nb entries onto new pages. Returns false if we run out of pages
+static bool atlas_pack(s_atlas_entry** entry, u32 nb, bool game_gfx)
+{
+    u32 i;
+    u16 x = 0, y = 0, shelf_h = 0;
+    s_atlas_page* page = NULL;
+
+    qsort(entry, nb, sizeof(s_atlas_entry*), atlas_compare);
+    for (i=0; i<nb; i++)
+    {
+        if (x + entry[i]->w > ATLAS_SIZE)
+        {	// Next shelf
+            x = 0;
+            y += shelf_h;
+            shelf_h = 0;
+        }
+        if ((page == NULL) || (y + entry[i]->h > ATLAS_SIZE))
+        {	// Next page
+            if (nb_atlas_pages >= MAX_ATLAS_PAGES)
+                return false;
+            page = &atlas_page[nb_atlas_pages++];
+            page->w = ATLAS_SIZE;
+            page->h = 0;
+            page->game_gfx = game_gfx;
+            x = 0;
+            y = 0;
+            shelf_h = 0;
+        }
+        entry[i]->page = (u8)(page - atlas_page);
+        entry[i]->x = x;
+        entry[i]->y = y;
+        x += entry[i]->w;
+        if (entry[i]->h > shelf_h)
+            shelf_h = entry[i]->h;
+        if (y + shelf_h > page->h)
+            page->h = y + shelf_h;
+    }
+    return true;
+}
+
+// Lay the cells, sprites and panel chars out on the atlas pages, and create the
+// page textures. Must be called once the sprite sizes are known
+static void init_atlas()
+{
+    s_atlas_entry** entry;
+    u16 bucket[ATLAS_HASH_SIZE];
+    u16* next;
+    u32 i, j, n, nb_game, hash;
+    u32 nb_folded = 0, textures_size = 0, atlas_size = 0;
+    u8  p, game_pixel_size = indexed_gfx?1:RGBA_SIZE;
+
+    entry = (s_atlas_entry**) malloc(sizeof(s_atlas_entry*) * (nb_cells+NB_SPRITES+NB_PANEL_CHARS));
+    next = (u16*) malloc(sizeof(u16) * nb_cells);
+    if ((entry == NULL) || (next == NULL))
+    {
+        printf("Could not allocate texture atlas\n");
+        ERR_EXIT;
+    }
+
+    // Fold the identical cells, by looking their (planar) data up in a hash table
+    for (i=0; i<ATLAS_HASH_SIZE; i++)
+        bucket[i] = NO_CELL;
+    n = 0;
+    for (i=0; i<nb_cells; i++)
+    {
+        // FNV-1a
+        hash = 2166136261u;
+        for (j=0; j<0x100; j++)
+            hash = (hash ^ fbuffer[CELLS][0x100*i+j]) * 16777619u;
+        hash &= ATLAS_HASH_SIZE-1;
+        for (j=bucket[hash]; j!=NO_CELL; j=next[j])
+            if (memcmp(fbuffer[CELLS] + 0x100*j, fbuffer[CELLS] + 0x100*i, 0x100) == 0)
+                break;
+        textures_size += 32*16*game_pixel_size;
+        if (j != NO_CELL)
+        {
+            cell_alias[i] = (u16)j;
+            nb_folded++;
+            continue;
+        }
+        cell_alias[i] = (u16)i;
+        next[i] = bucket[hash];
+        bucket[hash] = (u16)i;
+        cell_atlas[i].w = 32;
+        cell_atlas[i].h = 16;
+        entry[n++] = &cell_atlas[i];
+    }
+    for (i=0; i<NB_STANDARD_SPRITES; i++)
+    {
+        sprite_atlas[i].w = sprite[i].w;
+        sprite_atlas[i].h = sprite[i].h;
+        textures_size += sprite[i].corrected_w*sprite[i].corrected_h*game_pixel_size;
+        entry[n++] = &sprite_atlas[i];
+    }
+    nb_game = n;
+    for (i=NB_STANDARD_SPRITES; i<NB_SPRITES; i++)
+    {
+        sprite_atlas[i].w = sprite[i].w;
+        sprite_atlas[i].h = sprite[i].h;
+        textures_size += sprite[i].corrected_w*sprite[i].corrected_h*RGBA_SIZE;
+        entry[n++] = &sprite_atlas[i];
+    }
+    for (i=0; i<NB_PANEL_CHARS; i++)
+    {
+        chars_atlas[i].w = PANEL_CHARS_W;
+        chars_atlas[i].h = PANEL_CHARS_CORRECTED_H;
+        textures_size += PANEL_CHARS_W*PANEL_CHARS_CORRECTED_H*RGBA_SIZE;
+        entry[n++] = &chars_atlas[i];
+    }
+
+    nb_atlas_pages = 0;
+    if ( (!atlas_pack(entry, nb_game, true)) || (!atlas_pack(entry+nb_game, n-nb_game, false)) )
+    {
+        printf("Too many textures for the atlas\n");
+        ERR_EXIT;
+    }
+
+    // Now that the pages are filled, we know how tall they need to be
+    for (p=0; p<nb_atlas_pages; p++)
+    {
+        atlas_page[p].h = powerize(atlas_page[p].h);
+        atlas_page[p].texid = renderer->gen_texture();
+        atlas_size += atlas_page[p].w*atlas_page[p].h*
+            (atlas_page[p].game_gfx?game_pixel_size:RGBA_SIZE);
+    }
+    for (i=0; i<n; i++)
+    {
+        entry[i]->u1 = (float)entry[i]->x / atlas_page[entry[i]->page].w;
+        entry[i]->v1 = (float)entry[i]->y / atlas_page[entry[i]->page].h;
+        entry[i]->u2 = (float)(entry[i]->x + entry[i]->w) / atlas_page[entry[i]->page].w;
+        entry[i]->v2 = (float)(entry[i]->y + entry[i]->h) / atlas_page[entry[i]->page].h;
+    }
+    for (i=0; i<nb_cells; i++)
+        cell_atlas[i] = cell_atlas[cell_alias[i]];
+
+    printv("Texture atlas: %d pages, %d KB instead of %d KB (%d identical cells folded)\n",
+        nb_atlas_pages, (int)(atlas_size/1024), (int)(textures_size/1024), (int)nb_folded);
+    free(entry);
+    free(next);
+}
+
+
+// Initialize the sprite array
+void init_sprites()
+{
+    // Fatigue bar base sprite colours (4_4_4_4 GRAB)
+    static const u16 fatigue_colour[8] = {0x29F0, 0x4BF0, 0x29F0, 0x06F0,
+        0x16F1, GRAB_TRANSPARENT_COLOUR, GRAB_TRANSPARENT_COLOUR, GRAB_TRANSPARENT_COLOUR};
+
+    // We'll use this 4x8 GRAB sprite as an indicator for guards fooled by a pass
+    // Can't use it directly as it needs to be 16 bit aligned on PSP
+    // Also padded to 8x8 because goddam PSP can't use anything less
+    static const u16 fooled_by_sprite[8][8] = {
+        {0xbdf7,0xbdf7,0xbdf7,0xbdf7,0xff0f,0xff0f,0xff0f,0xff0f},
+        {0xbdf7,0xbdf7,0x09f0,0xbdf7,0xff0f,0xff0f,0xff0f,0xff0f},
+        {0xbdf7,0xbdf7,0xbdf7,0xbdf7,0xff0f,0xff0f,0xff0f,0xff0f},
+        {0xbdf7,0x9bf5,0xbdf7,0xbdf7,0xff0f,0xff0f,0xff0f,0xff0f},
+        {0xbdf7,0x9bf5,0xbdf7,0xbdf7,0xff0f,0xff0f,0xff0f,0xff0f},
+        {0xbdf7,0x9bf5,0xbdf7,0xbdf7,0xff0f,0xff0f,0xff0f,0xff0f},
+        {0xbdf7,0xbdf7,0xbdf7,0xbdf7,0xff0f,0xff0f,0xff0f,0xff0f},
+        {0xff0f,0xff0f,0xff0f,0xff0f,0xff0f,0xff0f,0xff0f,0xff0f}
+    };
+
+    u32 i = 2;	// We need to ignore the first word (nb of sprites)
+    u16 sprite_index = 0;
+    u16 sprite_w;	// width, in words
+    u32 sprite_address;
+    int x,y;
+
+    // Allocate the sprites and overlay arrays
+    sprite = aligned_malloc(NB_SPRITES * sizeof(s_sprite), 16);
+    overlay = aligned_malloc(MAX_OVERLAYS * sizeof(s_overlay), 16);
+
+    // First thing we do is populate the standard sprite offsets at the beginning of the table
+    sprite_address = i + 4* (readword(fbuffer[SPRITES],0) + 1);
+    for (sprite_index=0; sprite_index<NB_STANDARD_SPRITES; sprite_index++)
+    {
+        sprite_address += readlong(fbuffer[SPRITES],i);
         writelong(fbuffer[SPRITES],i,sprite_address);
         i+=4;
     }
@@ -703,7 +1616,15 @@ void init_sprites()
         // There's an offset to position the sprite depending on the mask's presence
         sprite[sprite_index].x_offset = (sprite_w & 0x8000)?16:1;
         sprite[sprite_index].y_offset = 0;
-        sprite[sprite_index].z_offset = 0;
+        // Populate the z_offset, which we'll use later on to decide the z position
+        // of the overlays. We substract h because we use top left corner rather than
+        // bottom right as in original game (speed up computations for later)
+        // A sprite with no mask should always display under anything else
+        if (sprite_w & 0x8000)
+            sprite[sprite_index].z_offset = MIN_Z;
+        else
+            sprite[sprite_index].z_offset = readword(fbuffer[SPRITES],sprite_address+4) -
+                sprite[sprite_index].h;
         sprite[sprite_index].data = aligned_malloc( RGBA_SIZE *
             sprite[sprite_index].corrected_w * sprite[sprite_index].corrected_h, 16);
 //		printb("  w,h = %0X, %0X\n", sprite[sprite_index].w , sprite[sprite_index].h);
@@ -738,6 +1659,7 @@ void init_sprites()
         sprite[sprite_index].h = 16;
         sprite[sprite_index].corrected_h = 16;
         sprite[sprite_index].x_offset = 1;
+        sprite[sprite_index].z_offset = MIN_Z;
         sprite[sprite_index].data = aligned_malloc( RGBA_SIZE *
             sprite[sprite_index].w * sprite[sprite_index].h, 16);
     }
@@ -760,40 +1682,34 @@ void init_sprites()
     sprite[FOOLED_BY_SPRITE].data = aligned_malloc( RGBA_SIZE *
             sprite[FOOLED_BY_SPRITE].w * sprite[FOOLED_BY_SPRITE].h, 16);
 
+    // The fatigue and fooled_by sprites are initialized manually, and don't depend on the palette
+    for (y=0; y<8; y++)
+        for (x=0; x<8; x++)
+            writeword(sprite[PANEL_FATIGUE_SPRITE].data, 16*y+2*x, fatigue_colour[y]);
+    for (y=0; y<8; y++)
+        for (x=0; x<8; x++)
+            writeword(sprite[FOOLED_BY_SPRITE].data, 16*y+2*x, fooled_by_sprite[y][x]);
+
     // We use a different sprite array for status message chars
     init_panel_chars();
+
+    // Now that we know all the sizes, we can lay the textures out
+    init_atlas();
 }
 
 
-// Converts the sprites to 16 bit GRAB data we can handle
-void sprites_to_wGRAB()
+// Converts the sprites [first, last[ to 16 bit GRAB data we can handle
+// In indexed mode, the standard sprites are converted to palette indexes
+void sprites_to_wGRAB(u16 first, u16 last)
 {
-    // Fatigue bar base sprite colours (4_4_4_4 GRAB)
-    static const u16 fatigue_colour[8] = {0x29F0, 0x4BF0, 0x29F0, 0x06F0,
-        0x16F1, GRAB_TRANSPARENT_COLOUR, GRAB_TRANSPARENT_COLOUR, GRAB_TRANSPARENT_COLOUR};
-
-    // We'll use this 4x8 GRAB sprite as an indicator for guards fooled by a pass
-    // Can't use it directly as it needs to be 16 bit aligned on PSP
-    // Also padded to 8x8 because goddam PSP can't use anything less
-    static const u16 fooled_by_sprite[8][8] = {
-        {0xbdf7,0xbdf7,0xbdf7,0xbdf7,0xff0f,0xff0f,0xff0f,0xff0f},
-        {0xbdf7,0xbdf7,0x09f0,0xbdf7,0xff0f,0xff0f,0xff0f,0xff0f},
-        {0xbdf7,0xbdf7,0xbdf7,0xbdf7,0xff0f,0xff0f,0xff0f,0xff0f},
-        {0xbdf7,0x9bf5,0xbdf7,0xbdf7,0xff0f,0xff0f,0xff0f,0xff0f},
-        {0xbdf7,0x9bf5,0xbdf7,0xbdf7,0xff0f,0xff0f,0xff0f,0xff0f},
-        {0xbdf7,0x9bf5,0xbdf7,0xbdf7,0xff0f,0xff0f,0xff0f,0xff0f},
-        {0xbdf7,0xbdf7,0xbdf7,0xbdf7,0xff0f,0xff0f,0xff0f,0xff0f},
-        {0xff0f,0xff0f,0xff0f,0xff0f,0xff0f,0xff0f,0xff0f,0xff0f}
-    };
-
     u16 sprite_index;
     u32 sprite_address;
     u8* sbuffer;
     int no_mask = 0;
-    int x,y;
+    u16* palette;
 
 
-    for (sprite_index=0; sprite_index<NB_SPRITES-NB_EXTRA_SPRITES; sprite_index++)
+    for (sprite_index=first; sprite_index<last; sprite_index++)
     {
         // Standard sprites (from SPRITES.SPR)
         if (sprite_index < NB_STANDARD_SPRITES)
@@ -804,168 +1720,962 @@ void sprites_to_wGRAB()
             // if MSb is set, we have 4 bitplanes instead of 5
             no_mask = readword(fbuffer[SPRITES],sprite_address) & 0x8000;
 
-            // Populate the z_offset, which we'll use later on to decide the z position
-            // of the overlays. We substract h because we use top left corner rather than
-            // bottom right as in original game (speed up computations for later)
-            sprite[sprite_index].z_offset = readword(fbuffer[SPRITES],sprite_address+4) -
-                sprite[sprite_index].h;
-
             // Compute the source address
             sbuffer = fbuffer[SPRITES] + sprite_address + 8;
+            palette = game_palette;
+            if (indexed_gfx)
+            {	// Index 0 is opaque, so the padding must be set to transparent
+                palette = NULL;
+                memset(sprite[sprite_index].data, C2P_TRANSPARENT,
+                    sprite[sprite_index].corrected_w * sprite[sprite_index].corrected_h);
+            }
         }
         // Panel (nonstandard sprites)
         else
         {
-            if (sprite_index == NB_STANDARD_SPRITES)
-            {	// we're getting into panel overlays => switch to the panel palette
-                // but before we do that, save the RGB index for the pause screen borders
-                // Index 10 is the current border color
-                pause_rgb[RED] = ((aPalette[10]>>8)&0xF)*0x11;
-                pause_rgb[GREEN] = ((aPalette[10]>>12)&0xF)*0x11;
-                pause_rgb[BLUE] = (aPalette[10]&0xF)*0x11;
-                to_16bit_palette(0, 1, SPRITES_PANEL);
-            }
+            // panel overlays use the panel palette
+            palette = panel_palette;
             sbuffer = fbuffer[SPRITES_PANEL] + get_panel_sprite(sprite_index).offset +
                 8*sprite[sprite_index].w*(sprite_index-get_panel_sprite(sprite_index).base);
             no_mask = 1;
         }
 
         if (no_mask)
-        {
             // Bitplanes that have no mask are line-interleaved, like cells
             line_interleaved_to_wGRAB(sbuffer, sprite[sprite_index].data,
-                sprite[sprite_index].w, sprite[sprite_index].h, 4);
-            // A sprite with no mask should always display under anything else
-            sprite[sprite_index].z_offset = MIN_Z;
-        }
+                sprite[sprite_index].w, sprite[sprite_index].h, 4, palette);
         else
             // bitplane interleaved with mask
             bitplane_to_wGRAB(sbuffer, sprite[sprite_index].data, sprite[sprite_index].w,
-                sprite[sprite_index].corrected_w, sprite[sprite_index].h);
+                sprite[sprite_index].corrected_w, sprite[sprite_index].h, palette);
+    }
+}
+
+#if defined(DEBUG_ENABLED)
+// Check that the SIMD planar to chunky kernel produces the same output as the scalar
+// one, for all the cells and sprites. Must be called once the palettes are set
+bool c2p_check()
+{
+    u8* buffer;
+    u32 i, size, nb_mismatches = 0;
+    u16 sprite_index;
+
+    // The indexed conversion doesn't go through c2p, so check the GRAB one
+    // This leaves GRAB data in the buffers, but we exit right after
+    indexed_gfx = false;
 
-        // Now that we have data in a GL readable format, let's texturize it!
-        glBindTexture(GL_TEXTURE_2D, sprite_texid[sprite_index]);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, sprite[sprite_index].corrected_w,
-            sprite[sprite_index].corrected_h, 0, GL_RGBA, GL_UNSIGNED_SHORT_4_4_4_4_REV,
-            sprite[sprite_index].data);
+    size = fsize[CELLS]*2*RGBA_SIZE;
+    for (sprite_index=0; sprite_index<NB_SPRITES-NB_EXTRA_SPRITES; sprite_index++)
+        if (RGBA_SIZE*sprite[sprite_index].corrected_w*sprite[sprite_index].corrected_h > size)
+            size = RGBA_SIZE*sprite[sprite_index].corrected_w*sprite[sprite_index].corrected_h;
+    if ((buffer = (u8*) aligned_malloc(size, 16)) == NULL)
+        return false;
+
+    // The scalar kernel goes first, so that we leave the data as it should be
+    c2p = c2p_wGRAB_scalar;
+    cells_to_wGRAB(0, nb_cells);
+    memcpy(buffer, rgbCells, fsize[CELLS]*2*RGBA_SIZE);
+    c2p = c2p_wGRAB;
+    cells_to_wGRAB(0, nb_cells);
+    for (i=0; i<nb_cells; i++)
+        if (memcmp(buffer + i*2*RGBA_SIZE*0x100, rgbCells + i*2*RGBA_SIZE*0x100, 2*RGBA_SIZE*0x100) != 0)
+        {
+            perr("c2p_check: mismatch for cell %d\n", (int)i);
+            nb_mismatches++;
+        }
+
+    // Standard and panel sprites
+    for (sprite_index=0; sprite_index<NB_SPRITES-NB_EXTRA_SPRITES; sprite_index++)
+    {
+        size = RGBA_SIZE*sprite[sprite_index].corrected_w*sprite[sprite_index].corrected_h;
+        c2p = c2p_wGRAB_scalar;
+        sprites_to_wGRAB(sprite_index, sprite_index+1);
+        memcpy(buffer, sprite[sprite_index].data, size);
+        c2p = c2p_wGRAB;
+        sprites_to_wGRAB(sprite_index, sprite_index+1);
+        if (memcmp(buffer, sprite[sprite_index].data, size) != 0)
+        {
+            perr("c2p_check: mismatch for sprite 0x%02X\n", sprite_index);
+            nb_mismatches++;
+        }
     }
+    SAFREE(buffer);
 
-    // The fatigue and fooled_by sprites are initialized manually
-    for (y=0; y<8; y++)
-        for (x=0; x<8; x++)
-            writeword(sprite[PANEL_FATIGUE_SPRITE].data, 16*y+2*x, fatigue_colour[y]);
+    print("c2p_check: %s kernel => %d mismatch(es) over %d cells and %d sprites\n",
+        c2p_kernel_name(), (int)nb_mismatches, nb_cells, NB_SPRITES-NB_EXTRA_SPRITES);
+    return (nb_mismatches == 0);
+}
+#endif
+
+// Copy the converted data of an entry to its place in the page being composed
+static void atlas_blit(const s_atlas_entry* entry, const u8* source, u16 source_w, u8 pixel_size)
+{
+    u16 y;
+    u32 page_w = atlas_page[entry->page].w;
 
-    glBindTexture(GL_TEXTURE_2D, sprite_texid[PANEL_FATIGUE_SPRITE]);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, sprite[PANEL_FATIGUE_SPRITE].corrected_w,
-        sprite[PANEL_FATIGUE_SPRITE].corrected_h, 0, GL_RGBA, GL_UNSIGNED_SHORT_4_4_4_4_REV,
-        sprite[PANEL_FATIGUE_SPRITE].data);
+    for (y=0; y<entry->h; y++)
+        memcpy(atlas_buffer + ((entry->y+y)*page_w + entry->x)*pixel_size,
+            source + y*source_w*pixel_size, entry->w*pixel_size);
+}
 
-    for (y=0; y<8; y++)
-        for (x=0; x<8; x++)
-            writeword(sprite[FOOLED_BY_SPRITE].data, 16*y+2*x, fooled_by_sprite[y][x]);
+// Compose and upload the atlas pages from the converted data
+// With palette_only, only the pages holding the cells & standard sprites are redone
+void texturize_atlas(bool palette_only)
+{
+    u32 i;
+    u8  p, pixel_size;
+
+#if defined(WIN32)
+    room_cache_valid = false;
+#endif
+    frame_invalidate();
+    for (p=0; p<nb_atlas_pages; p++)
+    {
+        if ((palette_only) && (!atlas_page[p].game_gfx))
+            continue;
+        pixel_size = ((indexed_gfx) && (atlas_page[p].game_gfx))?1:RGBA_SIZE;
+        // Whatever isn't used on the page is transparent
+        memset(atlas_buffer, (pixel_size == 1)?C2P_TRANSPARENT:0,
+            atlas_page[p].w*atlas_page[p].h*pixel_size);
+        if (atlas_page[p].game_gfx)
+        {
+            for (i=0; i<nb_cells; i++)
+                if ((cell_alias[i] == i) && (cell_atlas[i].page == p))
+                    atlas_blit(&cell_atlas[i], rgbCells + i*2*0x100*pixel_size, 32, pixel_size);
+            for (i=0; i<NB_STANDARD_SPRITES; i++)
+                if (sprite_atlas[i].page == p)
+                    atlas_blit(&sprite_atlas[i], sprite[i].data, sprite[i].corrected_w, pixel_size);
+        }
+        else
+        {
+            for (i=NB_STANDARD_SPRITES; i<NB_SPRITES; i++)
+                if (sprite_atlas[i].page == p)
+                    atlas_blit(&sprite_atlas[i], sprite[i].data, sprite[i].corrected_w, pixel_size);
+            for (i=0; i<NB_PANEL_CHARS; i++)
+                if (chars_atlas[i].page == p)
+                    atlas_blit(&chars_atlas[i], panel_chars[i], 8, pixel_size);
+        }
+
+        upload_texture(atlas_page[p].texid, atlas_page[p].w, atlas_page[p].h,
+            (pixel_size == 1)?TEX_FMT_INDEX:TEX_FMT_GRAB, atlas_buffer);
+    }
+
+    if ((indexed_gfx) && (!palette_only))
+        texturize_palette();
+}
+
+
+/*
+ * Converted graphics cache: the planar to chunky conversion of the cells and sprites
+ * is saved on disk for each palette, so that we can skip it on the next launches
+ */
+
+// Size of the converted data we cache for one palette
+static u32 gfx_cache_size()
+{
+    u16 sprite_index;
+    u32 size = fsize[CELLS]*2*RGBA_SIZE;
+
+    for (sprite_index=0; sprite_index<NB_SPRITES-NB_EXTRA_SPRITES; sprite_index++)
+        size += RGBA_SIZE * sprite[sprite_index].corrected_w * sprite[sprite_index].corrected_h;
+    return size;
+}
+
+// The cache key is the MD5 of the MD5s of all the files that are used in the conversion
+// so that the cache is automatically rebuilt if any of these change
+static u8* gfx_cache_key()
+{
+    static u8 key[16];
+    static bool key_set = false;
+    static const u16 key_files[] = { CELLS, SPRITES, SPRITES_PANEL, PALETTES };
+    u8 version = GFX_CACHE_VERSION;
+    md5_context ctx;
+    u32 i;
+
+    if (!key_set)
+    {
+        md5_starts(&ctx);
+        md5_update(&ctx, &version, 1);
+        for (i=0; i<SIZE_A(key_files); i++)
+            md5_update(&ctx, fhash[key_files[i]], 16);
+        md5_finish(&ctx, key);
+        key_set = true;
+    }
+    return key;
+}
+
+// Try to read the converted cells and sprites for palette pal_index from the cache
+static bool read_gfx_cache(u8 pal_index)
+{
+    char cache_name[32];
+    FILE* f;
+    u8  header[20];
+    u16 sprite_index;
+    u32 size;
+    bool success = false;
+
+    sprintf(cache_name, GFX_CACHE_NAME, pal_index);
+    if ((f = fopen(cache_name, "rb")) == NULL)
+        return false;
+
+    // Check the magic and the key, as well as the size of the file
+    if ( (fread(header, 1, 20, f) != 20) || (readlong(header, 0) != GFX_CACHE_MAGIC) ||
+         (memcmp(header+4, gfx_cache_key(), 16) != 0) || (fseek(f, 0, SEEK_END) != 0) ||
+         ((u32)ftell(f) != gfx_cache_size() + 20) || (fseek(f, 20, SEEK_SET) != 0) )
+        goto out;
+
+    if (fread(rgbCells, 1, fsize[CELLS]*2*RGBA_SIZE, f) != fsize[CELLS]*2*RGBA_SIZE)
+        goto out;
+    for (sprite_index=0; sprite_index<NB_SPRITES-NB_EXTRA_SPRITES; sprite_index++)
+    {
+        size = RGBA_SIZE * sprite[sprite_index].corrected_w * sprite[sprite_index].corrected_h;
+        if (fread(sprite[sprite_index].data, 1, size, f) != size)
+        {	// The conversion relies on zeroed sprite paddings, so don't leave any junk there
+            for (sprite_index=0; sprite_index<NB_SPRITES-NB_EXTRA_SPRITES; sprite_index++)
+                memset(sprite[sprite_index].data, 0, RGBA_SIZE *
+                    sprite[sprite_index].corrected_w * sprite[sprite_index].corrected_h);
+            goto out;
+        }
+    }
+    success = true;
+
+out:
+    fclose(f);
+    return success;
+}
+
+// Save the converted cells and sprites for palette pal_index
+// Not being able to write the cache (eg. read-only install) is not an error
+void write_gfx_cache(u8 pal_index)
+{
+    char cache_name[32];
+    FILE* f;
+    u8  header[20];
+    u16 sprite_index;
+    u32 size;
+    bool success;
+
+    // Indexed data is palette independent, and quick enough to convert
+    if (indexed_gfx)
+        return;
+
+    sprintf(cache_name, GFX_CACHE_NAME, pal_index);
+    if ((f = fopen(cache_name, "wb")) == NULL)
+    {
+        printv("Could not create gfx cache file '%s'\n", cache_name);
+        return;
+    }
+
+    writelong(header, 0, GFX_CACHE_MAGIC);
+    memcpy(header+4, gfx_cache_key(), 16);
+    success = (fwrite(header, 1, 20, f) == 20) &&
+        (fwrite(rgbCells, 1, fsize[CELLS]*2*RGBA_SIZE, f) == fsize[CELLS]*2*RGBA_SIZE);
+    for (sprite_index=0; (success) && (sprite_index<NB_SPRITES-NB_EXTRA_SPRITES); sprite_index++)
+    {
+        size = RGBA_SIZE * sprite[sprite_index].corrected_w * sprite[sprite_index].corrected_h;
+        success = (fwrite(sprite[sprite_index].data, 1, size, f) == size);
+    }
+    fclose(f);
+
+    // Don't leave a truncated cache behind
+    if (!success)
+    {
+        printv("Could not write gfx cache file '%s'\n", cache_name);
+        remove(cache_name);
+    }
+}
+
+// Set up the palettes for one of the game palettes, and try to get the converted
+// cells & sprites from the cache. Returns false if they need to be converted.
+// Must be called after init_sprites()
+bool load_palette(u8 pal_index)
+{
+    to_16bit_palette(game_palette, pal_index, 0xFF, PALETTES);
+    to_16bit_palette(panel_palette, 0, 1, SPRITES_PANEL);
+
+    // Save the RGB index for the pause screen borders
+    // Index 10 is the current border color
+    pause_rgb[RED] = ((game_palette[10]>>8)&0xF)*0x11;
+    pause_rgb[GREEN] = ((game_palette[10]>>12)&0xF)*0x11;
+    pause_rgb[BLUE] = (game_palette[10]&0xF)*0x11;
+
+    if ((!indexed_gfx) && (read_gfx_cache(pal_index)))
+    {
+        printv("Using gfx cache for palette %d\n", pal_index);
+        return true;
+    }
+    return false;
+}
+
+// Switch to one of the game palettes, and (re)create the cells & sprites textures
+// Must be called after init_sprites()
+void set_palette(u8 pal_index)
+{
+#if defined(WIN32)
+    // The room cache holds palette colours, in both modes
+    room_cache_valid = false;
+#endif
+    if (indexed_gfx)
+    {	// The textures don't depend on the palette => 16 texels to upload
+        load_palette(pal_index);
+        texturize_palette();
+        return;
+    }
+
+    if (!load_palette(pal_index))
+    {
+        cells_to_wGRAB(0, nb_cells);
+        sprites_to_wGRAB(0, NB_SPRITES-NB_EXTRA_SPRITES);
+        write_gfx_cache(pal_index);
+    }
+
+    texturize_atlas(true);
+}
+
+
+/*
+ * Quad batching: the textured quads are queued, and handed over to the renderer, which
+ * draws runs of consecutive quads sharing the same texture, filter and shader. The quads of
+ * a sortable section (i.e. ones that don't overlap, like the room tiles) are grouped
+ * by state first. Anything else keeps its order, as the blending depends on it.
+ * Must be flushed before any immediate mode drawing, or anything reading the buffer.
+ */
+
+// Set the colour of the quads queued from now on
+static __inline void set_colour(float r, float g, float b, float a)
+{
+    batch_colour[0] = (u8)(255.0f*((r<0.0f)?0.0f:((r>1.0f)?1.0f:r)) + 0.5f);
+    batch_colour[1] = (u8)(255.0f*((g<0.0f)?0.0f:((g>1.0f)?1.0f:g)) + 0.5f);
+    batch_colour[2] = (u8)(255.0f*((b<0.0f)?0.0f:((b>1.0f)?1.0f:b)) + 0.5f);
+    batch_colour[3] = (u8)(255.0f*((a<0.0f)?0.0f:((a>1.0f)?1.0f:a)) + 0.5f);
+}
+
+// Start or end a section of quads that can be reordered
+static void batch_sort(bool sortable)
+{
+    static u16 nb_groups = 0;
+
+    if (sortable)
+    {
+        if (++nb_groups == 0)
+            nb_groups = 1;
+        batch_group = nb_groups;
+    }
+    else
+        batch_group = 0;
+}
+
+// Order of the quads in a sortable section. The submission order is only used
+// to keep the sort stable, so that we draw the same thing every frame
+static int batch_compare(const void* a, const void* b)
+{
+    const s_quad* q1 = (const s_quad*)a;
+    const s_quad* q2 = (const s_quad*)b;
+
+    if (q1->texid != q2->texid)
+        return (q1->texid < q2->texid)?-1:1;
+    if (q1->filter != q2->filter)
+        return q1->filter - q2->filter;
+    if (q1->indexed != q2->indexed)
+        return q1->indexed - q2->indexed;
+    return q1->order - q2->order;
+}
+
+// Group the quads of the sortable sections by state
+static void batch_sort_groups(s_quad* quad, u32 nb_quads)
+{
+    u32 i, j;
+
+    for (i=0; i<nb_quads; i=j)
+    {
+        for (j=i+1; (j<nb_quads) && (quad[j].group == quad[i].group); j++);
+        if ((quad[i].group != 0) && (j-i > 1))
+            qsort(&quad[i], j-i, sizeof(s_quad), batch_compare);
+    }
+}
+
+// Draw the quads queued since batch_base
+static void batch_draw()
+{
+    if (nb_batch_quads <= batch_base)
+        return;
+
+    batch_sort_groups(&batch_quad[batch_base], nb_batch_quads-batch_base);
+    renderer->draw(&batch_quad[batch_base], nb_batch_quads-batch_base);
+    nb_vertices += 6*(nb_batch_quads-batch_base);
+    nb_batch_quads = batch_base;
+}
+
+// Draw all the queued quads. When composing a frame, this means that something is
+// about to be drawn directly, so we won't be able to tell if the frame changed
+void batch_flush()
+{
+    if (frame_open)
+    {
+        if (!frame_cleared)
+            renderer->clear(0, 0, PSP_SCR_WIDTH, PSP_SCR_HEIGHT);
+        frame_cleared = true;
+        frame_tracked = false;
+    }
+    batch_draw();
+}
+
+/*
+ * Damage tracking: the game loop only builds a frame when one of the display_dirty
+ * flags is set. The quads of the frame are then queued, and compared to the ones of
+ * the last frame drawn. If none changed, the frame is neither drawn nor swapped. If only
+ * some did, and the renderer keeps the previous frame (for GL, in render_texid when
+ * rescaling), only the area they cover is redrawn, with the clear clipping the rest.
+ */
+void frame_begin()
+{
+    batch_flush();
+    frame_open = true;
+    frame_tracked = true;
+    frame_cleared = false;
+    frame_partial = false;
+}
+
+// For anything that changes the display without changing the quads (palette, textures
+// window size...)
+void frame_invalidate()
+{
+    frame_dirty = true;
+    display_dirty |= DIRTY_DISPLAY;
+}
+
+static __inline void damage_quad(const s_quad* q)
+{
+    s16 x1 = (s16)floorf(min(q->x1, q->x2)), x2 = (s16)ceilf(max(q->x1, q->x2));
+    s16 y1 = (s16)floorf(min(q->y1, q->y2)), y2 = (s16)ceilf(max(q->y1, q->y2));
+
+    if (x1 < damage_x1)
+        damage_x1 = x1;
+    if (x2 > damage_x2)
+        damage_x2 = x2;
+    if (y1 < damage_y1)
+        damage_y1 = y1;
+    if (y2 > damage_y2)
+        damage_y2 = y2;
+}
+
+// The group and submission order are not relevant to what ends up on screen
+static __inline bool same_quad(const s_quad* q1, const s_quad* q2)
+{
+    return (q1->texid == q2->texid) && (q1->filter == q2->filter) && (q1->indexed == q2->indexed) &&
+        (q1->half == q2->half) && (q1->opaque == q2->opaque) && (memcmp(&q1->x1, &q2->x1, sizeof(s_quad) - offsetof(s_quad, x1)) == 0);
+}
+
+// Draw the frame, if it differs from the last one. Returns false if nothing was drawn
+bool frame_end()
+{
+    u32 i;
+
+    frame_open = false;
+    if (!frame_tracked)
+    {	// Part of the frame has been drawn already
+        batch_draw();
+        nb_frame_quads = 0;
+        frame_dirty = true;
+        return true;
+    }
+
+    // Find the area covered by the quads that changed, either way
+    damage_x1 = PSP_SCR_WIDTH;
+    damage_y1 = PSP_SCR_HEIGHT;
+    damage_x2 = 0;
+    damage_y2 = 0;
+    for (i=0; (i<nb_batch_quads) || (i<nb_frame_quads); i++)
+    {
+        if ( (i<nb_batch_quads) && (i<nb_frame_quads) && same_quad(&batch_quad[i], &frame_quad[i]) )
+            continue;
+        if (i<nb_batch_quads)
+            damage_quad(&batch_quad[i]);
+        if (i<nb_frame_quads)
+            damage_quad(&frame_quad[i]);
+    }
+    if (damage_x1 < 0)
+        damage_x1 = 0;
+    if (damage_y1 < 0)
+        damage_y1 = 0;
+    if (damage_x2 > PSP_SCR_WIDTH)
+        damage_x2 = PSP_SCR_WIDTH;
+    if (damage_y2 > PSP_SCR_HEIGHT)
+        damage_y2 = PSP_SCR_HEIGHT;
+
+    if ( (!frame_dirty) && ((damage_x1 >= damage_x2) || (damage_y1 >= damage_y2)) )
+    {	// Same as what's on screen
+        nb_batch_quads = 0;
+        nb_frames_skipped++;
+        return false;
+    }
+    // Must be saved before sorting
+    memcpy(frame_quad, batch_quad, nb_batch_quads*sizeof(s_quad));
+    nb_frame_quads = nb_batch_quads;
+
+    frame_partial = (!frame_dirty) && renderer->keeps_frame();
+    if (frame_partial)
+        renderer->clear(damage_x1, damage_y1, damage_x2, damage_y2);
+    else
+        renderer->clear(0, 0, PSP_SCR_WIDTH, PSP_SCR_HEIGHT);
+    batch_draw();
+    frame_dirty = false;
+    return true;
+}
+
+#if defined(DEBUG_ENABLED)
+// Have a second renderer get the textures and palette, so that it can replay our frames
+bool set_mirror(const s_renderer* mirror_renderer)
+{
+    if ((mirror_renderer == renderer) || (!mirror_renderer->init()))
+        return false;
+    mirror = mirror_renderer;
+    return true;
+}
+
+// Draw the last frame again and again, with each of the renderers we have textures for
+void renderer_benchmark(u32 nb_iterations)
+{
+    const s_renderer* list[3];
+    u32 i, j, nb_renderers = 0;
+    u64 t;
+
+    if (nb_frame_quads == 0)
+    {
+        perr("renderer_benchmark: no frame to replay\n");
+        return;
+    }
+    list[nb_renderers++] = renderer;
+    if (renderer->gl)
+        list[nb_renderers++] = (renderer == &gl_renderer)?&gl_immediate_renderer:&gl_renderer;
+    if (mirror != NULL)
+        list[nb_renderers++] = mirror;
+
+    for (i=0; i<nb_renderers; i++)
+    {
+        t = mtime();
+        for (j=0; j<nb_iterations; j++)
+        {	// Same as frame_end(), which sorts the quads in place
+            memcpy(batch_quad, frame_quad, nb_frame_quads*sizeof(s_quad));
+            batch_sort_groups(batch_quad, nb_frame_quads);
+            list[i]->clear(0, 0, PSP_SCR_WIDTH, PSP_SCR_HEIGHT);
+            list[i]->draw(batch_quad, nb_frame_quads);
+        }
+        if (list[i]->gl)
+            glFinish();
+        t = mtime() - t;
+        if (t == 0)
+            t = 1;
+        printf("%-12s: %d frames of %d quads in %d ms => %.1f fps\n", list[i]->name,
+            (int)nb_iterations, (int)nb_frame_quads, (int)t, (1000.0f*nb_iterations)/t);
+    }
+    nb_batch_quads = 0;
+}
+#endif
+
+// Queue a textured quad, using the top left corner as the origin
+static __inline void batch_add(float x1, float y1, float w, float h, GLuint texid, u8 filter,
+                               bool indexed, float u1, float v1, float u2, float v2)
+{
+    s_quad* q;
+
+    if (nb_batch_quads >= MAX_BATCH_QUADS)
+    {
+        if (batch_base != 0)
+            batch_draw();
+        else
+            batch_flush();
+    }
+    q = &batch_quad[nb_batch_quads];
+    q->texid = texid;
+    q->filter = filter;
+    q->indexed = indexed;
+    q->group = batch_group;
+    q->order = (u16)nb_batch_quads++;
+    q->half = false;
+    q->opaque = false;
+    q->x1 = x1;
+    q->y1 = y1;
+    q->x2 = x1 + w;
+    q->y2 = y1 + h;
+    q->u1 = u1;
+    q->v1 = v1;
+    q->u2 = u2;
+    q->v2 = v2;
+    memcpy(q->colour, batch_colour, 4);
+}
+
+// Display a sprite, cell or panel char from the atlas, using the top left corner as the origin
+static __inline void display_sprite(float x1, float y1, float w, float h, const s_atlas_entry* entry)
+{
+    batch_add(x1, y1, w, h, atlas_page[entry->page].texid, FILTER_ATLAS,
+        (indexed_gfx) && (atlas_page[entry->page].game_gfx), entry->u1, entry->v1, entry->u2, entry->v2);
+}
+
+
+// Display a whole texture, using the top left corner as the origin
+static __inline void display_texture(float x1, float y1, float w, float h, unsigned int texid)
+{
+    batch_add(x1, y1, w, h, texid, FILTER_NEAREST, false, 0.0f, 0.0f, 1.0f, 1.0f);
+}
+
+
+// Same, with linear interpolation. Looks better, but if you zoom, you have to zoom
+// the whole colour buffer, else the sprite seams will show
+void display_sprite_linear(float x1, float y1, float w, float h, unsigned int texid)
+{
+    batch_add(x1, y1, w, h, texid, FILTER_LINEAR, false, 0.0f, 0.0f, 1.0f, 1.0f);
+}
+
+// Plain rectangle, in the current colour
+static __inline void display_rectangle(float x1, float y1, float w, float h)
+{
+    batch_add(x1, y1, w, h, 0, FILTER_NONE, false, 0.0f, 0.0f, 0.0f, 0.0f);
+}
+
+// Plain right triangle, with its right angle at (x1,y1), in the current colour
+static __inline void display_triangle(float x1, float y1, float w, float h)
+{
+    batch_add(x1, y1, w, h, 0, FILTER_NONE, false, 0.0f, 0.0f, 0.0f, 0.0f);
+    batch_quad[nb_batch_quads-1].half = true;
+}
+
+// Display all our overlays. The ones below nb_static are the props and room tiles
+void display_overlays(u8 nb_static)
+{
+    u8 i, j;
+
+    // OK, first we need to reorganize our overlays according to the z position
+    order_overlays(overlay_order, nb_static, overlay_index);
 
-    glBindTexture(GL_TEXTURE_2D, sprite_texid[FOOLED_BY_SPRITE]);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, sprite[FOOLED_BY_SPRITE].corrected_w,
-        sprite[FOOLED_BY_SPRITE].corrected_h, 0, GL_RGBA, GL_UNSIGNED_SHORT_4_4_4_4_REV,
-        sprite[FOOLED_BY_SPRITE].data);
+    for (j=0; j<overlay_index; j++)
+    {
+        i = overlay_order[j];
+        display_sprite(overlay[i].x, overlay[i].y, sprite[overlay[i].sid].w,
+            sprite[overlay[i].sid].h, &sprite_atlas[overlay[i].sid]);
+//		printb("ovl(%d,%d), sid = %X\n", overlay[i].x, overlay[i].y, overlay[i].sid);
+    }
 }
 
+// Resolve the outside tile at (x,y), according to the current rem_bitmask, into
+// cmp_grid[], and set remove_props[] if the props on this tile must be hidden
+static void cmp_resolve_tile(s16 x, s16 y)
+{
+    u16 tile_data;
+    u32 raw_data;
+    u16 rem_offset;
+    u16 tile_tmp, nb_tiles;
+    u8  bit_index;
+    int u;
+
+    /* Read a longword in the first part of the compressed map
+     * The compressed map elements are of the form
+     * OOOO OOOO OOOO OOOT TTTT TTTT IIII IIDD
+     * where:
+     * OOO OOOO OOOO OOOO is the index for overlay tile (or 0 for tiles without cmp map overlays)
+     * T TTTT TTTT is the base tile index (tile to display with all overlays removed)
+     * II IIII is the removable_mask index to use when positionned on this tile
+     *         (REMOVABLES_MASKS_LENGTH possible values)
+     * DD is the index for the direction subroutine to pick
+     *
+     * NB: in the case of an exit (T TTTT TTTT < 0x900), IIII IIDD is the exit index
+     */
+
+    raw_data = readlong((u8*)fbuffer[COMPRESSED_MAP], (y*CMP_MAP_WIDTH+x)*4);
+    tile_data = (u16)(raw_data>>1) & 0xFF80;
+
+    // For the time being, we'll reset the removable boolean for props
+    remove_props[x][y] = 0;
+
+    // If the first 15 bits of this longword are zero, then we have a simple tile,
+    // with remainder 17 being the tile data
+    rem_offset = (raw_data >> 16) & 0xFFFE;
+    // First word (with mask 0xFFFE) indicates if we have a simple tile or not
+
+    if (rem_offset != 0)
+    // If the first 15 bits are not null, we have a complex sequence,
+    // which we must read in second part of the compressed map,
+    // the 15 bits being the offset from start of second part
+    {
+        // The first word read is the number of overlapping tiles
+        // overlapping tiles occur when there might be a wall hiding a walkable section
+        nb_tiles = readword((u8*)fbuffer[COMPRESSED_MAP], CMP_TILES_START+rem_offset);
+        // The rest of the data is a tile index (FF80), a bit index (1F), and 2 bits unused.
+        // the later being used to check bits of an overlay bitmap longword
+        for (u=nb_tiles; u!=0; u--)
+        {
+            tile_tmp = readword((u8*)fbuffer[COMPRESSED_MAP], CMP_TILES_START+rem_offset + 2*u);
+            bit_index = tile_tmp & 0x1F;
+            if ( (1<<bit_index) & rem_bitmask )
+            {
+                tile_data = tile_tmp;
+                // Do we need to hide the props beneath?
+                if (!props_tile[tile_data>>7])
+                    remove_props[x][y] = 1;
+                break;
+            }
+        }
+    }
+
+    cmp_grid[x][y] = tile_data;
+}
+
+// Find the tiles whose overlap list depends on each bit of rem_bitmask
+static void cmp_grid_init()
+{
+    u32 raw_data;
+    u16 rem_offset, nb_tiles, count[32];
+    u8  bit_index, pass;
+    s16 x, y;
+    int u;
+
+    // First pass counts the tiles for each bit, second pass fills the lists
+    for (pass=0; pass<2; pass++)
+    {
+        memset(count, 0, sizeof(count));
+        for (y=0; y<CMP_MAP_HEIGHT; y++)
+            for (x=0; x<CMP_MAP_WIDTH; x++)
+            {
+                raw_data = readlong((u8*)fbuffer[COMPRESSED_MAP], (y*CMP_MAP_WIDTH+x)*4);
+                rem_offset = (raw_data >> 16) & 0xFFFE;
+                if (rem_offset == 0)
+                    continue;
+                nb_tiles = readword((u8*)fbuffer[COMPRESSED_MAP], CMP_TILES_START+rem_offset);
+                for (u=nb_tiles; u!=0; u--)
+                {
+                    bit_index = readword((u8*)fbuffer[COMPRESSED_MAP], CMP_TILES_START+rem_offset + 2*u) & 0x1F;
+                    if (pass == 1)
+                        cmp_bit_tiles[cmp_bit_start[bit_index] + count[bit_index]] = y*CMP_MAP_WIDTH+x;
+                    count[bit_index]++;
+                }
+            }
+        if (pass == 0)
+        {
+            cmp_bit_start[0] = 0;
+            for (u=0; u<32; u++)
+                cmp_bit_start[u+1] = cmp_bit_start[u] + count[u];
+            cmp_bit_tiles = (u16*) malloc(sizeof(u16) * (cmp_bit_start[32]+1));
+            if (cmp_bit_tiles == NULL)
+            {
+                printf("Could not allocate outside tiles grid\n");
+                ERR_EXIT;
+            }
+        }
+    }
+    printv("Outside tiles grid: %d dependencies on removable walls\n", cmp_bit_start[32]);
+}
+
+// Bring cmp_grid[] up to date with rem_bitmask. Only the tiles depending on the bits
+// that changed since the last call are resolved again
+void update_cmp_grid()
+{
+    u32 changed;
+    u16 i;
+    u8  bit_index;
+    s16 x, y;
+
+    if (cmp_bit_tiles == NULL)
+        cmp_grid_init();
 
-// Display a sprite or cell, using the top left corner as the origin
-static __inline void display_sprite(float x1, float y1, float w, float h, unsigned int texid)
-{
-    float register x2, y2;
+    if (!cmp_grid_valid)
+    {
+        for (y=0; y<CMP_MAP_HEIGHT; y++)
+            for (x=0; x<CMP_MAP_WIDTH; x++)
+                cmp_resolve_tile(x, y);
+        cmp_grid_valid = true;
+        cmp_grid_bitmask = rem_bitmask;
+        return;
+    }
 
-    x2 = x1 + w;
-    y2 = y1 + h;
+    changed = cmp_grid_bitmask ^ rem_bitmask;
+    if (changed == 0)
+        return;
+    for (bit_index=0; bit_index<32; bit_index++)
+    {
+        if (!(changed & (1<<bit_index)))
+            continue;
+        // A tile can be listed more than once, which is harmless
+        for (i=cmp_bit_start[bit_index]; i<cmp_bit_start[bit_index+1]; i++)
+            cmp_resolve_tile(cmp_bit_tiles[i]%CMP_MAP_WIDTH, cmp_bit_tiles[i]/CMP_MAP_WIDTH);
+    }
+    cmp_grid_bitmask = rem_bitmask;
+}
 
-    glBindTexture(GL_TEXTURE_2D, texid);
-    // Don't modify pixel colour ever
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+// To be called whenever remove_props[] or the compressed map are reset
+void reset_cmp_grid()
+{
+    memset(remove_props, 0, sizeof(remove_props));
+    cmp_grid_valid = false;
+}
 
-    // If we don't set clamp, our tiling will show
-#if defined(PSP)
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+// Make sure the cache holds the tiles of the current room from tile (origin_x, origin_y),
+// and queue it for display. Returns false if the tiles must be displayed one by one
+static bool display_room_cache(s16 origin_x, s16 origin_y)
+{
+#if defined(WIN32)
+    // The software renderer can't read the FBO
+    if ((!room_cache_enabled) || (mirror != NULL))
+        return false;
+    if ((is_inside) && ((room_x*32 > ROOM_CACHE_W) || (room_y*16 > ROOM_CACHE_H)))
+        return false;
+    if ( (!room_cache_valid) || (room_cache_room != current_room_index) ||
+         (room_cache_x != origin_x) || (room_cache_y != origin_y) ||
+         ((is_outside) && (room_cache_bitmask != rem_bitmask)) )
+        build_room_cache(origin_x, origin_y);
+    // The FBO texture is upside down
+    display_texture(gl_off_x + 32*origin_x, gl_off_y + 16*origin_y + ROOM_CACHE_H,
+        ROOM_CACHE_W, -ROOM_CACHE_H, room_cache_texid);
+    return true;
 #else
-    // For some reason GL_CLAMP_TO_EDGE on Win achieves the same as GL_CLAMP on PSP
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    return false;
 #endif
-
-    // pspGL does not implement QUADS
-    glBegin(GL_TRIANGLE_FAN);
-        glTexCoord2f(0.0f, 0.0f);
-        glVertex3f(x1, y1, 0.0f);
-        glTexCoord2f(0.0f, 1.0f);
-        glVertex3f(x1, y2, 0.0f);
-        glTexCoord2f(1.0f, 1.0f);
-        glVertex3f(x2, y2, 0.0f);
-        glTexCoord2f(1.0f, 0.0f);
-        glVertex3f(x2, y1, 0.0f);
-    glEnd();
 }
 
-
-// That's right: we define 2 different display_sprite routines just
-// to spare the processing time of an if condition for linear/nearest!
-void display_sprite_linear(float x1, float y1, float w, float h, unsigned int texid)
+#if defined(WIN32)
+// Have the frames drawn into render_texid, at our native resolution, so that
+// rescale_buffer() doesn't have to copy them out of the back buffer
+static void init_scene_fbo()
 {
-    float register x2, y2;
+    if (!GLEW_EXT_framebuffer_object)
+        return;
 
-    x2 = x1 + w;
-    y2 = y1 + h;
+    bind_texture(render_texid);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, PSP_SCR_WIDTH, PSP_SCR_HEIGHT, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glGenFramebuffersEXT(1, &scene_fbo);
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, scene_fbo);
+    glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, render_texid, 0);
+    if (glCheckFramebufferStatusEXT(GL_FRAMEBUFFER_EXT) != GL_FRAMEBUFFER_COMPLETE_EXT)
+    {
+        printv("Scene FBO is not supported - rescaling from the back buffer\n");
+        glDeleteFramebuffersEXT(1, &scene_fbo);
+        scene_fbo = 0;
+    }
+    bind_scene_fbo();
+    glClear(GL_COLOR_BUFFER_BIT);
+    frame_invalidate();
+}
 
-    glBindTexture(GL_TEXTURE_2D, texid);
-    // Do linear interpolation. Looks better, but if you zoom, you have to zoom
-    // the whole colour buffer, else the sprite seams will show
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+// Draw to the scene FBO if we have one, else to the window (or offscreen) buffer
+static void bind_scene_fbo()
+{
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, (scene_fbo != 0)?scene_fbo:offscreen_fbo);
+}
 
-    // If we don't set clamp, our tiling will show
-#if defined(PSP)
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-#else
-    // For some reason GL_CLAMP_TO_EDGE on Win achieves the same as GL_CLAMP on PSP
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-#endif
+// Create the pause views FBO, if the extension is there
+static void init_pause_fbo()
+{
+    if (!GLEW_EXT_framebuffer_object)
+        return;
 
-    // pspGL does not implement QUADS
-    glBegin(GL_TRIANGLE_FAN);
-        glTexCoord2f(0.0f, 0.0f);
-        glVertex3f(x1, y1, 0.0f);
-        glTexCoord2f(0.0f, 1.0f);
-        glVertex3f(x1, y2, 0.0f);
-        glTexCoord2f(1.0f, 1.0f);
-        glVertex3f(x2, y2, 0.0f);
-        glTexCoord2f(1.0f, 0.0f);
-        glVertex3f(x2, y1, 0.0f);
-    glEnd();
+    glGenRenderbuffersEXT(1, &pause_rbo);
+    glBindRenderbufferEXT(GL_RENDERBUFFER_EXT, pause_rbo);
+    glRenderbufferStorageEXT(GL_RENDERBUFFER_EXT, GL_RGBA8, PSP_SCR_WIDTH, PSP_SCR_HEIGHT);
+    glBindRenderbufferEXT(GL_RENDERBUFFER_EXT, 0);
+    glGenFramebuffersEXT(1, &pause_fbo);
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, pause_fbo);
+    glFramebufferRenderbufferEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_RENDERBUFFER_EXT, pause_rbo);
+    if (glCheckFramebufferStatusEXT(GL_FRAMEBUFFER_EXT) != GL_FRAMEBUFFER_COMPLETE_EXT)
+    {
+        printv("Pause views FBO is not supported - drawing them over the frame\n");
+        glDeleteFramebuffersEXT(1, &pause_fbo);
+        glDeleteRenderbuffersEXT(1, &pause_rbo);
+        pause_fbo = 0;
+        pause_rbo = 0;
+    }
+    bind_scene_fbo();
 }
 
-// Display all our overlays
-void display_overlays()
+// Create the room cache FBO, if the extension is there
+static void init_room_cache()
 {
-    u8 i, j;
-
-    // OK, first we need to reorganize our overlays according to the z position
-    for (i=0; i<overlay_index; i++)
-        overlay_order[i] = i;	// dummy indexes
+    if (!GLEW_EXT_framebuffer_object)
+        return;
 
-    // Recursive "merge" sort
-    sort_overlays(overlay_order, overlay_index);
+    glGenTextures(1, &room_cache_texid);
+    bind_texture(room_cache_texid);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, ROOM_CACHE_W, ROOM_CACHE_H, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glGenFramebuffersEXT(1, &room_fbo);
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, room_fbo);
+    glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, room_cache_texid, 0);
+    room_cache_enabled = (glCheckFramebufferStatusEXT(GL_FRAMEBUFFER_EXT) == GL_FRAMEBUFFER_COMPLETE_EXT);
+    bind_scene_fbo();
+    if (!room_cache_enabled)
+    {
+        printv("Room cache FBO is not supported - disabled\n");
+        glDeleteFramebuffersEXT(1, &room_fbo);
+        bound_texid = 0;
+        glDeleteTextures(1, &room_cache_texid);
+    }
+}
 
-    for (j=0; j<overlay_index; j++)
+// Draw the tiles into the room cache
+static void build_room_cache(s16 origin_x, s16 origin_y)
+{
+    s16 x, y, max_x, max_y;
+    u32 tile_offset = offset;	// room start, as set by set_room_xy()
+    u16 tile_data;
+    u32 frame_base = batch_base;
+
+    // Whatever was queued for the screen so far must stay queued
+    batch_base = nb_batch_quads;
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, room_fbo);
+    glViewport(0, 0, ROOM_CACHE_W, ROOM_CACHE_H);
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    glOrtho(0, ROOM_CACHE_W, ROOM_CACHE_H, 0, -1, 1);
+    glClear(GL_COLOR_BUFFER_BIT);
+    // The fading is applied when displaying the cache
+    set_colour(1.0f, 1.0f, 1.0f, 1.0f);
+
+    batch_sort(true);
+    if (is_inside)
     {
-        i = overlay_order[j];
-        display_sprite(overlay[i].x, overlay[i].y, sprite[overlay[i].sid].corrected_w,
-            sprite[overlay[i].sid].corrected_h, sprite_texid[overlay[i].sid]);
-//		printb("ovl(%d,%d), sid = %X\n", overlay[i].x, overlay[i].y, overlay[i].sid);
+        for (y=0; y<room_y; y++)
+            for (x=0; x<room_x; x++)
+            {
+                tile_data = readword((u8*)fbuffer[ROOMS], tile_offset);
+                display_sprite(32*x, 16*y, 32, 16,
+                    &cell_atlas[(tile_data>>7) + ((current_room_index>0x202)?0x1E0:0)]);
+                tile_offset += 2;
+            }
+    }
+    else
+    {
+        max_x = origin_x + ROOM_CACHE_W/32;
+        if (max_x > room_x)
+            max_x = room_x;
+        max_y = origin_y + ROOM_CACHE_H/16;
+        if (max_y > room_y)
+            max_y = room_y;
+        for (y=origin_y; y<max_y; y++)
+            for (x=origin_x; x<max_x; x++)
+                display_sprite(32*(x-origin_x), 16*(y-origin_y), 32, 16, &cell_atlas[cmp_grid[x][y]>>7]);
     }
+    batch_draw();
+    batch_base = frame_base;
+
+    // Back to the screen
+    bind_scene_fbo();
+    glLoadIdentity();
+    glOrtho(0, PSP_SCR_WIDTH, PSP_SCR_HEIGHT, 0, -1, 1);
+    glMatrixMode(GL_MODELVIEW);
+    glViewport(0, 0, PSP_SCR_WIDTH, PSP_SCR_HEIGHT);
+    set_colour(fade_value, fade_value, fade_value, 1.0f);
+
+    room_cache_valid = true;
+    room_cache_room = current_room_index;
+    room_cache_x = origin_x;
+    room_cache_y = origin_y;
+    room_cache_bitmask = rem_bitmask;
+    // The quad displaying the cache won't change
+    frame_invalidate();
+    printb("Room cache rebuilt for room %X at (%d,%d)\n", current_room_index, origin_x, origin_y);
 }
+#endif
 
 // Display room
 void display_room()
@@ -976,15 +2686,13 @@ void display_room()
 // But hey, the PSP can handle it, and so should a decent PC, so why bother?
 
     u16 tile_data;
-    u32 raw_data;
-    u16 rem_offset;
     s16 min_x, max_x, min_y, max_y;
-    u16 tile_tmp, nb_tiles;
-    u8  bit_index;
     s16 pixel_x, pixel_y;
     int u;
+    bool cached;
+    u8  nb_static;
 
-    glColor3f(fade_value, fade_value, fade_value);
+    set_colour(fade_value, fade_value, fade_value, 1.0f);
 
     if (init_animations)
     {	// We might have to init the room animations after a room switch or nationality change
@@ -999,8 +2707,9 @@ void display_room()
     }
 
     // Compute GL offsets (position of 0,0 corner of the room wrt center of the screen)
-    gl_off_x = PSP_SCR_WIDTH/2 - prisoner_x;
-    gl_off_y = PSP_SCR_HEIGHT/2 - (prisoner_2y/2) - NORTHWARD_HO;
+    // NB: we use the display positions, which are interpolated between reposition ticks
+    gl_off_x = PSP_SCR_WIDTH/2 - render_px(current_nation);
+    gl_off_y = PSP_SCR_HEIGHT/2 - (render_p2y(current_nation)/2) - NORTHWARD_HO;
 
     // reset room overlays
     overlay_index = 0;
@@ -1031,11 +2740,15 @@ void display_room()
     // This sets the room_x, room_y and offset values
     set_room_xy(current_room_index);
 
+    // The tiles don't overlap, so they can be drawn in any order
+    batch_sort(true);
+
     // No readtile() macros used here, for speed
     if (is_inside)
     {	// Standard room (inside)
+        cached = display_room_cache(0, 0);
 
-        // Read the tiles data
+        // Read the tiles data. We still need to go through them for the overlays
         pixel_y = gl_off_y;	// A little optimization can't hurt
         for (tile_y=0; tile_y<room_y; tile_y++)
         {
@@ -1054,8 +2767,9 @@ void display_room()
                 */
                 tile_data = readword((u8*)fbuffer[ROOMS], offset);
 
-                display_sprite(pixel_x,pixel_y,32,16,
-                    cell_texid[(tile_data>>7) + ((current_room_index>0x202)?0x1E0:0)]);
+                if (!cached)
+                    display_sprite(pixel_x,pixel_y,32,16,
+                        &cell_atlas[(tile_data>>7) + ((current_room_index>0x202)?0x1E0:0)]);
 
                 // Display sprite overlay
                 crm_set_overlays(pixel_x, pixel_y, tile_data & 0xFF80);
@@ -1073,88 +2787,40 @@ void display_room()
 
         // Since we're outside, take care of removable sections
         removable_walls();
+        update_cmp_grid();
 
         // These are the min/max tile boundary computation for PSP screen
-        // according to our cropped section
-        min_y = prisoner_2y/32 - 7;
+        // according to our cropped section. We use the same interpolated
+        // position as for gl_off_x/gl_off_y, so that the edge tiles scroll in on time
+        min_y = render_p2y(current_nation)/32 - 7;
         if (min_y < 0)
             min_y = 0;
 
         // +12 if you remove the bottom crop
-        max_y = prisoner_2y/32 + 10;
+        max_y = render_p2y(current_nation)/32 + 10;
         if (max_y > room_y)
             max_y = room_y;
 
-        min_x = prisoner_x/32 - 8;
+        min_x = render_px(current_nation)/32 - 8;
         if (min_x < 0)
             min_x = 0;
 
-        max_x = prisoner_x/32 + 9;
+        max_x = render_px(current_nation)/32 + 9;
         if (max_x > room_x)
             max_x = room_x;
 
-        // Read the tiles data
+        cached = display_room_cache((min_x/ROOM_CACHE_STEP)*ROOM_CACHE_STEP,
+            (min_y/ROOM_CACHE_STEP)*ROOM_CACHE_STEP);
+
+        // The tiles and props flags have already been resolved in cmp_grid[]
         pixel_y = gl_off_y+min_y*16;
-        for (tile_y=min_y; tile_y<max_y; tile_y++)
+        for (tile_y=min_y; (!cached) && (tile_y<max_y); tile_y++)
         {
-            offset = (tile_y*room_x+min_x)*4;
             pixel_x = gl_off_x+32*min_x;
             for(tile_x=min_x; tile_x<max_x; tile_x++)
             {
-                /* Read a longword in the first part of the compressed map
-                 * The compressed map elements are of the form
-                 * OOOO OOOO OOOO OOOT TTTT TTTT IIII IIDD
-                 * where:
-                 * OOO OOOO OOOO OOOO is the index for overlay tile (or 0 for tiles without cmp map overlays)
-                 * T TTTT TTTT is the base tile index (tile to display with all overlays removed)
-                 * II IIII is the removable_mask index to use when positionned on this tile
-                 *         (REMOVABLES_MASKS_LENGTH possible values)
-                 * DD is the index for the direction subroutine to pick
-                 *
-                 * NB: in the case of an exit (T TTTT TTTT < 0x900), IIII IIDD is the exit index
-                 */
-
-                raw_data = readlong((u8*)fbuffer[COMPRESSED_MAP], offset);
-                tile_data = (u16)(raw_data>>1) & 0xFF80;
-
-                // For the time being, we'll reset the removable boolean for props
-                remove_props[tile_x][tile_y] = 0;
-
-                // If the first 15 bits of this longword are zero, then we have a simple tile,
-                // with remainder 17 being the tile data
-                rem_offset = (raw_data >> 16) & 0xFFFE;
-                // First word (with mask 0xFFFE) indicates if we have a simple tile or not
-
-                if (rem_offset != 0)
-                // If the first 15 bits are not null, we have a complex sequence,
-                // which we must read in second part of the compressed map,
-                // the 15 bits being the offset from start of second part
-                {
-                    // The first word read is the number of overlapping tiles
-                    // overlapping tiles occur when there might be a wall hiding a walkable section
-                    nb_tiles = readword((u8*)fbuffer[COMPRESSED_MAP], CMP_TILES_START+rem_offset);
-                    // The rest of the data is a tile index (FF80), a bit index (1F), and 2 bits unused.
-                    // the later being used to check bits of an overlay bitmap longword
-                    for (u=nb_tiles; u!=0; u--)
-                    {
-                        tile_tmp = readword((u8*)fbuffer[COMPRESSED_MAP], CMP_TILES_START+rem_offset + 2*u);
-                        bit_index = tile_tmp & 0x1F;
-                        if ( (1<<bit_index) & rem_bitmask )
-                        {
-                            tile_data = tile_tmp;
-                            // Do we need to hide the props beneath?
-                            if (!props_tile[tile_data>>7])
-                                remove_props[tile_x][tile_y] = 1;
-                            break;
-                        }
-                    }
-                }
-
-                // At last, we have a tile we can display
                 display_sprite(pixel_x,pixel_y,32,16,
-                    cell_texid[(tile_data>>7)]);
-
-                offset += 4;
+                    &cell_atlas[cmp_grid[tile_x][tile_y]>>7]);
                 pixel_x += 32;
             }
             pixel_y += 16;
@@ -1164,10 +2830,12 @@ void display_room()
     }
 
     // Add all our guys
+    nb_static = overlay_index;
     add_guybrushes();
 
     // Now that the background is done, and we have all the overlays, display the overlay sprites
-    display_overlays();
+    batch_sort(false);
+    display_overlays(nb_static);
 
     // Make sure we only reset the overlay animations once
     if (init_animations)
@@ -1196,7 +2864,7 @@ void display_message(char string[])
     while ((c = string[i++]))
     {
         display_sprite(PANEL_MESSAGE_X+8*pos, PANEL_MESSAGE_Y,
-            PANEL_CHARS_W, PANEL_CHARS_CORRECTED_H, chars_texid[c-0x20]);
+            PANEL_CHARS_W, PANEL_CHARS_CORRECTED_H, &chars_atlas[c-0x20]);
         pos++;
     }
 }
@@ -1210,26 +2878,12 @@ void display_picture()
     // before calling this function
 
     // Set white to the current fade_value for fading effects
-    glColor3f(fade_value, fade_value, fade_value);
-
-    // Display the current IFF image
-    glBindTexture(GL_TEXTURE_2D, texture[current_picture].texid);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    set_colour(fade_value, fade_value, fade_value, 1.0f);
 
     // The image
-    glBegin(GL_TRIANGLE_FAN);
-        glTexCoord2f(0.0f, 0.0f);
-        glVertex2f((PSP_SCR_WIDTH-texture[current_picture].w)/2, (PSP_SCR_HEIGHT-texture[current_picture].h)/2);
-        glTexCoord2f(1.0f, 0.0f);
-        glVertex2f(512 + (PSP_SCR_WIDTH-texture[current_picture].w)/2, (PSP_SCR_HEIGHT-texture[current_picture].h)/2);
-        glTexCoord2f(1.0, 1.0);
-        glVertex2f(512 + (PSP_SCR_WIDTH-texture[current_picture].w)/2,
-            powerize(texture[current_picture].h) + (PSP_SCR_HEIGHT-texture[current_picture].h)/2);
-        glTexCoord2f(0.0, 1.0);
-        glVertex2f((PSP_SCR_WIDTH-texture[current_picture].w)/2,
-            powerize(texture[current_picture].h) + (PSP_SCR_HEIGHT-texture[current_picture].h)/2);
-    glEnd();
+    display_sprite_linear((PSP_SCR_WIDTH-texture[current_picture].w)/2,
+        (PSP_SCR_HEIGHT-texture[current_picture].h)/2, 512, powerize(texture[current_picture].h),
+        texture[current_picture].texid);
 }
 
 
@@ -1243,55 +2897,15 @@ void display_tunnel_area()
     h = (float) powerize(texture[TUNNEL_VISION].h);
 
     // Hidde everything that's outside our texture using 4 black rectangles
-    glDisable(GL_TEXTURE_2D);		// Disable textures and set colour to black
-    glColor3f(0.0f, 0.0f, 0.0f);
-
-    glBegin(GL_TRIANGLE_FAN);
-        glVertex2f(0, 0);
-        glVertex2f(TUN_X, 0);
-        glVertex2f(TUN_X, PSP_SCR_HEIGHT);
-        glVertex2f(0, PSP_SCR_HEIGHT);
-    glEnd();
-
-    glBegin(GL_TRIANGLE_FAN);
-        glVertex2f(TUN_X+w, 0);
-        glVertex2f(PSP_SCR_WIDTH, 0);
-        glVertex2f(PSP_SCR_WIDTH, PSP_SCR_HEIGHT);
-        glVertex2f(TUN_X+w, PSP_SCR_HEIGHT);
-    glEnd();
-
-    glBegin(GL_TRIANGLE_FAN);
-        glVertex2f(TUN_X, 0);
-        glVertex2f(TUN_X+w, 0);
-        glVertex2f(TUN_X+w, TUN_Y);
-        glVertex2f(TUN_X, TUN_Y);
-    glEnd();
-
-    glBegin(GL_TRIANGLE_FAN);
-        glVertex2f(TUN_X, TUN_Y+h);
-        glVertex2f(TUN_X+w, TUN_Y+h);
-        glVertex2f(TUN_X+w, PSP_SCR_HEIGHT);
-        glVertex2f(TUN_X, PSP_SCR_HEIGHT);
-    glEnd();
-
-    // Restore for texturing
-    glColor3f(fade_value, fade_value, fade_value);
-    glEnable(GL_TEXTURE_2D);
-
-    glBindTexture(GL_TEXTURE_2D, texture[TUNNEL_VISION].texid);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    set_colour(0.0f, 0.0f, 0.0f, 1.0f);
+    display_rectangle(0, 0, TUN_X, PSP_SCR_HEIGHT);
+    display_rectangle(TUN_X+w, 0, PSP_SCR_WIDTH-(TUN_X+w), PSP_SCR_HEIGHT);
+    display_rectangle(TUN_X, 0, w, TUN_Y);
+    display_rectangle(TUN_X, TUN_Y+h, w, PSP_SCR_HEIGHT-(TUN_Y+h));
+
     // Display our texture
-    glBegin(GL_TRIANGLE_FAN);
-        glTexCoord2f(0.0f, 0.0f);
-        glVertex2f(TUN_X, TUN_Y);
-        glTexCoord2f(1.0f, 0.0f);
-        glVertex2f(TUN_X+w, TUN_Y);
-        glTexCoord2f(1.0f, 1.0f);
-        glVertex2f(TUN_X+w, TUN_Y+h);
-        glTexCoord2f(0.0f, 1.0f);
-        glVertex2f(TUN_X, TUN_Y+h);
-    glEnd();
+    set_colour(fade_value, fade_value, fade_value, 1.0f);
+    display_texture(TUN_X, TUN_Y, w, h, texture[TUNNEL_VISION].texid);
 }
 
 
@@ -1302,51 +2916,15 @@ void display_panel()
     u16 i, sid;
 
     // Black rectangle (panel base) at the bottom
-    glDisable(GL_TEXTURE_2D);		// Disable textures and set colour to black
-    glColor3f(0.0f, 0.0f, 0.0f);
-
-    glBegin(GL_TRIANGLE_FAN);
-        glVertex2f(0, PSP_SCR_HEIGHT-32);
-        glVertex2f(PSP_SCR_WIDTH, PSP_SCR_HEIGHT-32);
-        glVertex2f(PSP_SCR_WIDTH, PSP_SCR_HEIGHT);
-        glVertex2f(0, PSP_SCR_HEIGHT);
-    glEnd();
-
-    // Restore for texturing
-    glColor3f(fade_value, fade_value, fade_value);
-    glEnable(GL_TEXTURE_2D);
+    set_colour(0.0f, 0.0f, 0.0f, 1.0f);
+    display_rectangle(0, PSP_SCR_HEIGHT-32, PSP_SCR_WIDTH, 32);
 
     // Draw the 2 parts of our panel
-    glBindTexture(GL_TEXTURE_2D, texture[PANEL_BASE1].texid);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-
-    // pspGL does not implement QUADS
-    glBegin(GL_TRIANGLE_FAN);
-        glTexCoord2f(0.0f, 0.0f);
-        glVertex2f(PANEL_OFF_X, PSP_SCR_HEIGHT-PANEL_BASE_H+PANEL_OFF_Y );
-        glTexCoord2f(1.0f, 0.0f);
-        glVertex2f(PANEL_OFF_X+PANEL_BASE1_W, PSP_SCR_HEIGHT-PANEL_BASE_H+PANEL_OFF_Y );
-        glTexCoord2f(1.0, 1.0);
-        glVertex2f(PANEL_OFF_X+PANEL_BASE1_W, PSP_SCR_HEIGHT+PANEL_OFF_Y);
-        glTexCoord2f(0.0, 1.0);
-        glVertex2f(PANEL_OFF_X, PSP_SCR_HEIGHT+PANEL_OFF_Y);
-    glEnd();
-
-    glBindTexture(GL_TEXTURE_2D, texture[PANEL_BASE2].texid);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-
-    glBegin(GL_TRIANGLE_FAN);
-        glTexCoord2f(0.0f, 0.0f);
-        glVertex2f(PANEL_OFF_X+PANEL_BASE1_W, PSP_SCR_HEIGHT-PANEL_BASE_H+PANEL_OFF_Y );
-        glTexCoord2f(1.0f, 0.0f);
-        glVertex2f(PANEL_OFF_X+PANEL_BASE1_W+PANEL_BASE2_W, PSP_SCR_HEIGHT-PANEL_BASE_H+PANEL_OFF_Y );
-        glTexCoord2f(1.0, 1.0);
-        glVertex2f(PANEL_OFF_X+PANEL_BASE1_W+PANEL_BASE2_W, PSP_SCR_HEIGHT+PANEL_OFF_Y);
-        glTexCoord2f(0.0, 1.0);
-        glVertex2f(PANEL_OFF_X+PANEL_BASE1_W, PSP_SCR_HEIGHT+PANEL_OFF_Y);
-    glEnd();
+    set_colour(fade_value, fade_value, fade_value, 1.0f);
+    display_texture(PANEL_OFF_X, PSP_SCR_HEIGHT-PANEL_BASE_H+PANEL_OFF_Y,
+        PANEL_BASE1_W, PANEL_BASE_H, texture[PANEL_BASE1].texid);
+    display_texture(PANEL_OFF_X+PANEL_BASE1_W, PSP_SCR_HEIGHT-PANEL_BASE_H+PANEL_OFF_Y,
+        PANEL_BASE2_W, PANEL_BASE_H, texture[PANEL_BASE2].texid);
 
     // Because the original game wasn't designed for widescreen we have to
     // diagonally crop the area to keep some elements hidden
@@ -1360,86 +2938,25 @@ void display_panel()
         w = (float) powerize(texture[PICTURE_CORNER].w);
         h = (float) powerize(texture[PICTURE_CORNER].h);
 
-        glBindTexture(GL_TEXTURE_2D, texture[PICTURE_CORNER].texid);
-        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-
-        // upper left
-        glBegin(GL_TRIANGLE_FAN);
-            glTexCoord2f(0.0f, 0.0f);
-            glVertex2f(0.0f, 0.0f);
-            glTexCoord2f(1.0f, 0.0f);
-            glVertex2f(w, 0.0f);
-            glTexCoord2f(1.0f, 1.0f);
-            glVertex2f(w, h);
-            glTexCoord2f(0.0f, 1.0f);
-            glVertex2f(0.0f, h);
-        glEnd();
-
-        // upper right
-        glBegin(GL_TRIANGLE_FAN);
-            glTexCoord2f(0, 0);
-            glVertex2f(PSP_SCR_WIDTH-0, 0);
-            glTexCoord2f(1, 0);
-            glVertex2f(PSP_SCR_WIDTH-w, 0);
-            glTexCoord2f(1, 1);
-            glVertex2f(PSP_SCR_WIDTH-w, h);
-            glTexCoord2f(0, 1);
-            glVertex2f(PSP_SCR_WIDTH-0, h);
-        glEnd();
-
-        // bottom right
-        glBegin(GL_TRIANGLE_FAN);
-            glTexCoord2f(0, 0);
-            glVertex2f(PSP_SCR_WIDTH-0, PSP_SCR_HEIGHT-0);
-            glTexCoord2f(1, 0);
-            glVertex2f(PSP_SCR_WIDTH-w, PSP_SCR_HEIGHT-0);
-            glTexCoord2f(1, 1);
-            glVertex2f(PSP_SCR_WIDTH-w, PSP_SCR_HEIGHT-0-h);
-            glTexCoord2f(0, 1);
-            glVertex2f(PSP_SCR_WIDTH-0, PSP_SCR_HEIGHT-0-h);
-        glEnd();
-
-        // bottom left
-        glBegin(GL_TRIANGLE_FAN);
-            glTexCoord2f(0, 0);
-            glVertex2f(0, PSP_SCR_HEIGHT-0-0);
-            glTexCoord2f(1, 0);
-            glVertex2f(w, PSP_SCR_HEIGHT-0-0);
-            glTexCoord2f(1, 1);
-            glVertex2f(w, PSP_SCR_HEIGHT-h-0);
-            glTexCoord2f(0, 1);
-            glVertex2f(0, PSP_SCR_HEIGHT-h-0);
-        glEnd();
+        // upper left, upper right, bottom right, bottom left
+        display_texture(0, 0, w, h, texture[PICTURE_CORNER].texid);
+        display_texture(PSP_SCR_WIDTH, 0, -w, h, texture[PICTURE_CORNER].texid);
+        display_texture(PSP_SCR_WIDTH, PSP_SCR_HEIGHT, -w, -h, texture[PICTURE_CORNER].texid);
+        display_texture(0, PSP_SCR_HEIGHT, w, -h, texture[PICTURE_CORNER].texid);
     }
     else
     {	// Use black triangles
-        glDisable(GL_TEXTURE_2D);
-        glColor3f(0.0f, 0.0f, 0.0f);
+        set_colour(0.0f, 0.0f, 0.0f, 1.0f);
 
         h = (float) (28-NORTHWARD_HO)+36;	// 36
         w = (float) 2*h;					// 72
 
-        glBegin(GL_TRIANGLES);
-            glVertex2f(0, 0);
-            glVertex2f(w, 0);
-            glVertex2f(0, h);
-
-            glVertex2f(PSP_SCR_WIDTH, 0);
-            glVertex2f(PSP_SCR_WIDTH-w, 0);
-            glVertex2f(PSP_SCR_WIDTH, h);
+        display_triangle(0, 0, w, h);
+        display_triangle(PSP_SCR_WIDTH, 0, -w, h);
+        display_triangle(PSP_SCR_WIDTH, PSP_SCR_HEIGHT-32, -w, -h);
+        display_triangle(0, PSP_SCR_HEIGHT-32, w, -h);
 
-            glVertex2f(PSP_SCR_WIDTH, PSP_SCR_HEIGHT-32);
-            glVertex2f(PSP_SCR_WIDTH-w, PSP_SCR_HEIGHT-32);
-            glVertex2f(PSP_SCR_WIDTH, PSP_SCR_HEIGHT-32-h);
-
-            glVertex2f(0, PSP_SCR_HEIGHT-32);
-            glVertex2f(w, PSP_SCR_HEIGHT-32);
-            glVertex2f(0, PSP_SCR_HEIGHT-32-h);
-        glEnd();
-
-        glColor3f(fade_value, fade_value, fade_value);
-        glEnable(GL_TEXTURE_2D);
+        set_colour(fade_value, fade_value, fade_value, 1.0f);
     }
 
     // Display our guys' faces
@@ -1457,42 +2974,42 @@ void display_panel()
                 sid = PANEL_FACE_IN_PRISON;
         }
         display_sprite(PANEL_FACES_X+i*PANEL_FACES_W, PANEL_TOP_Y,
-            sprite[sid].w, sprite[sid].h, sprite_texid[sid]);
+            sprite[sid].w, sprite[sid].h, &sprite_atlas[sid]);
     }
 
     // Display the currently selected nation's flag
     display_sprite(PANEL_FLAGS_X, PANEL_TOP_Y, sprite[PANEL_FLAGS_BASE_SID+current_nation].w,
-        sprite[PANEL_FLAGS_BASE_SID+current_nation].h, sprite_texid[PANEL_FLAGS_BASE_SID+current_nation]);
+        sprite[PANEL_FLAGS_BASE_SID+current_nation].h, &sprite_atlas[PANEL_FLAGS_BASE_SID+current_nation]);
 
     // Display the clock
     // (Unlike the original game, I like having the zero displayed on hour tens, always)
     sid = PANEL_CLOCK_DIGITS_BASE + hours_digit_h;
     display_sprite(PANEL_CLOCK_HOURS_X, PANEL_TOP_Y,
-            sprite[sid].w, sprite[sid].h, sprite_texid[sid]);
+            sprite[sid].w, sprite[sid].h, &sprite_atlas[sid]);
 
     // Hours, units
     sid = PANEL_CLOCK_DIGITS_BASE + hours_digit_l;
     display_sprite(PANEL_CLOCK_HOURS_X + PANEL_CLOCK_DIGITS_W, PANEL_TOP_Y,
-            sprite[sid].w, sprite[sid].h, sprite_texid[sid]);
+            sprite[sid].w, sprite[sid].h, &sprite_atlas[sid]);
 
     // Minute, tens
     sid = PANEL_CLOCK_DIGITS_BASE + minutes_digit_h;
     display_sprite(PANEL_CLOCK_MINUTES_X, PANEL_TOP_Y,
-            sprite[sid].w, sprite[sid].h, sprite_texid[sid]);
+            sprite[sid].w, sprite[sid].h, &sprite_atlas[sid]);
 
     // Minutes, units
     sid = PANEL_CLOCK_DIGITS_BASE + minutes_digit_l;
     display_sprite(PANEL_CLOCK_MINUTES_X + PANEL_CLOCK_DIGITS_W, PANEL_TOP_Y,
-            sprite[sid].w, sprite[sid].h, sprite_texid[sid]);
+            sprite[sid].w, sprite[sid].h, &sprite_atlas[sid]);
 
     // Display the currently selected prop
     sid = selected_prop[current_nation] + PANEL_PROPS_BASE;
     display_sprite(PANEL_PROPS_X, PANEL_TOP_Y,
-            sprite[sid].w, sprite[sid].h, sprite_texid[sid]);
+            sprite[sid].w, sprite[sid].h, &sprite_atlas[sid]);
 
     // Display the fatigue bar
     display_sprite(PANEL_FATIGUE_X, PANEL_FATIGUE_Y,
-        (prisoner_fatigue>>0xB), sprite[PANEL_FATIGUE_SPRITE].h, sprite_texid[PANEL_FATIGUE_SPRITE]);
+        (prisoner_fatigue>>0xB), sprite[PANEL_FATIGUE_SPRITE].h, &sprite_atlas[PANEL_FATIGUE_SPRITE]);
 
     // Display close by prop or motion indicator
     if (over_prop_id)
@@ -1507,13 +3024,48 @@ void display_panel()
             sid = (prisoner_speed == 1)?STATE_WALK_SID:STATE_RUN_SID;
     }
     display_sprite(PANEL_STATE_X, PANEL_TOP_Y,
-        sprite[sid].w, sprite[sid].h, sprite_texid[sid]);
+        sprite[sid].w, sprite[sid].h, &sprite_atlas[sid]);
 
     // Display the current status message
     display_message(status_message);
 }
 
 
+#if defined(WIN32)
+// Scale the frame in render_texid into scaled_texid, with the CPU scaler. The rows stay
+// bottom first, which makes no difference to the scalers, as they are symmetrical
+static bool cpu_scale_frame()
+{
+    u8 n = scale_factor((u8)opt_scaler);
+
+    if (scaled_texid == 0)
+    {
+        scaler_src = (uint*) aligned_malloc(PSP_SCR_WIDTH*PSP_SCR_HEIGHT*sizeof(uint), 16);
+        scaler_dest = (uint*) aligned_malloc(SCALE_MAX_FACTOR*PSP_SCR_WIDTH*SCALE_MAX_FACTOR*PSP_SCR_HEIGHT*sizeof(uint), 16);
+        if ((scaler_src == NULL) || (scaler_dest == NULL))
+        {
+            perr("cpu_scale_frame: could not allocate frame buffers\n");
+            SAFREE(scaler_src);
+            SAFREE(scaler_dest);
+            opt_scaler = -1;
+            return false;
+        }
+        scaled_texid = renderer->gen_texture();
+    }
+
+    // 0xAARRGGBB, as the scalers want it
+    bind_texture(render_texid);
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, scaler_src);
+    if (!scale_frame((u8)opt_scaler, scaler_src, PSP_SCR_WIDTH, PSP_SCR_HEIGHT, scaler_dest,
+        (opt_nb_workers>=0)?(u32)opt_nb_workers:nb_cpus()-1))
+        return false;
+    bind_texture(scaled_texid);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, n*PSP_SCR_WIDTH, n*PSP_SCR_HEIGHT, 0, GL_BGRA,
+        GL_UNSIGNED_INT_8_8_8_8_REV, scaler_dest);
+    return true;
+}
+#endif
+
 // Here is the long sought after "zooming the ****ing 2D colour buffer" function.
 // What a $%^&*&^ing bore!!! And none of this crap works on PSP anyway unless you
 // waste space in power of two sizes
@@ -1525,70 +3077,129 @@ void rescale_buffer()
 // to figure out a bloody solution to zoom the lousy colour buffer, because
 // if you think, with all the GPU acceleration, there should be an easy way to
 // achieve that crap, you couldn't be more wrong! And if you want anything elaborate, you
-// have to write your own shader (coz even with PCI-X, tranferring image data back and
-// forth with OpenGL for software HQ2X for instance is WAY TOO DARN SLOW!!!!)
+// have to write your own shader, or read the frame back to scale it on the CPU, which
+// only our multithreaded scalers are fast enough for
 
 #if defined(WIN32)
 	GLint shaderSizeLocation;
 #endif
+    GLuint texid = render_texid;
+    bool in_fbo = false;
 
-    if ((gl_width != PSP_SCR_WIDTH) && (gl_height != PSP_SCR_HEIGHT))
-    {
-		glDisable(GL_BLEND);	// Better than having to use glClear()
-
-        // If we don't set full luminosity, our menu will fade too
-        glColor3f(1.0f, 1.0f, 1.0f);
+    batch_flush();
 #if defined(WIN32)
-		if (opt_gl_smoothing >= 2)
-		{	// Use one of the HQ2X-HQ4X GLSL shaders
-			glUseProgram(sp);	// Apply GLSL shader
-			shaderSizeLocation = glGetUniformLocation(sp, "OGL2Size");
-			glUniform4f(shaderSizeLocation, PSP_SCR_WIDTH, PSP_SCR_HEIGHT, 0.0, 0.0);
-		}
+    in_fbo = (scene_fbo != 0);
 #endif
+    if ((!in_fbo) && ((gl_width == PSP_SCR_WIDTH) && (gl_height == PSP_SCR_HEIGHT)))
+        return;
 
-		glBindTexture(GL_TEXTURE_2D, render_texid);
-		glCopyTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 0, 0, PSP_SCR_WIDTH, PSP_SCR_HEIGHT, 0);
-
-		// Then we change our viewport to the actual screen size
-        glViewport(0, 0, gl_width, gl_height);
+    glDisable(GL_BLEND);	// Better than having to use glClear()
 
-        // Now we change the projection, to the new dimensions
-        glMatrixMode(GL_PROJECTION);
-        glLoadIdentity();
-        glOrtho(0, gl_width, gl_height, 0, -1, 1);
+    // If we don't set full luminosity, our menu will fade too
+    set_colour(1.0f, 1.0f, 1.0f, 1.0f);
+#if defined(WIN32)
+    if (opt_gl_smoothing >= 2)
+    {	// Use one of the HQ2X-HQ4X GLSL shaders
+        glUseProgram(sp);	// Apply GLSL shader
+        shaderSizeLocation = glGetUniformLocation(sp, "OGL2Size");
+        glUniform4f(shaderSizeLocation, PSP_SCR_WIDTH, PSP_SCR_HEIGHT, 0.0, 0.0);
+    }
 
-        // OK, now we can display the whole texture
-        if (opt_gl_smoothing == 1)
-            display_sprite_linear(0, gl_height, gl_width, -gl_height, render_texid);
+    if (in_fbo)	// The frame is already in render_texid => just switch to the window
+        glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, offscreen_fbo);
+    else
+#endif
+    {
+        bind_texture(render_texid);
+        if (frame_partial)
+        {	// The rest of the texture still holds the previous frames
+            glCopyTexSubImage2D(GL_TEXTURE_2D, 0, damage_x1, PSP_SCR_HEIGHT-damage_y2,
+                damage_x1, PSP_SCR_HEIGHT-damage_y2, damage_x2-damage_x1, damage_y2-damage_y1);
+        }
         else
-            display_sprite(0, gl_height, gl_width, -gl_height, render_texid);
+            glCopyTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 0, 0, PSP_SCR_WIDTH, PSP_SCR_HEIGHT, 0);
+    }
+#if defined(WIN32)
+    // Without the GLSL zoom, one of the CPU scalers can do the job
+    if ((opt_scaler >= 0) && (opt_gl_smoothing < 2) && (cpu_scale_frame()))
+        texid = scaled_texid;
+#endif
+
+    // Then we change our viewport to the actual screen size
+    glViewport(0, 0, gl_width, gl_height);
+
+    // Now we change the projection, to the new dimensions
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    glOrtho(0, gl_width, gl_height, 0, -1, 1);
+
+    // OK, now we can display the whole texture, stretched to the window
+    if (opt_gl_smoothing == 1)
+        display_sprite_linear(0, gl_height, gl_width, -gl_height, texid);
+    else
+        display_texture(0, gl_height, gl_width, -gl_height, texid);
+    batch_flush();
 
 #if defined(WIN32)
-		if (opt_gl_smoothing >= 2)
-			glUseProgram(0);	// Stop applying shader
+    if (opt_gl_smoothing >= 2)
+        glUseProgram(0);	// Stop applying shader
+    if (in_fbo)
+        glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, scene_fbo);
 #endif
 
-        // Finally, we restore the parameters
-        glMatrixMode(GL_PROJECTION);
-        glLoadIdentity();
-        glOrtho(0, PSP_SCR_WIDTH, PSP_SCR_HEIGHT, 0, -1, 1);
-        glViewport(0, 0, PSP_SCR_WIDTH, PSP_SCR_HEIGHT);
+    // Finally, we restore the parameters
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    glOrtho(0, PSP_SCR_WIDTH, PSP_SCR_HEIGHT, 0, -1, 1);
+    glViewport(0, 0, PSP_SCR_WIDTH, PSP_SCR_HEIGHT);
 
-        // Restore colour
-        glColor3f(fade_value, fade_value, fade_value);
+    // Restore colour
+    set_colour(fade_value, fade_value, fade_value, 1.0f);
 
-        glEnable(GL_BLEND);	// We'll need blending for the sprites, etc.
+    glEnable(GL_BLEND);	// We'll need blending for the sprites, etc.
+}
 
+// Render into an FBO of the window size rather than into the window, so that
+// the window can be hidden. Must be called after init_shader()
+bool init_offscreen()
+{
+#if defined(WIN32)
+    if (!GLEW_EXT_framebuffer_object)
+    {
+        perr("Offscreen rendering requires GL_EXT_framebuffer_object\n");
+        return false;
+    }
+    glGenRenderbuffersEXT(1, &offscreen_rbo);
+    glBindRenderbufferEXT(GL_RENDERBUFFER_EXT, offscreen_rbo);
+    glRenderbufferStorageEXT(GL_RENDERBUFFER_EXT, GL_RGBA8, gl_width, gl_height);
+    glBindRenderbufferEXT(GL_RENDERBUFFER_EXT, 0);
+    glGenFramebuffersEXT(1, &offscreen_fbo);
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, offscreen_fbo);
+    glFramebufferRenderbufferEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_RENDERBUFFER_EXT, offscreen_rbo);
+    if (glCheckFramebufferStatusEXT(GL_FRAMEBUFFER_EXT) != GL_FRAMEBUFFER_COMPLETE_EXT)
+    {
+        perr("Could not create the offscreen framebuffer\n");
+        glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+        glDeleteFramebuffersEXT(1, &offscreen_fbo);
+        glDeleteRenderbuffersEXT(1, &offscreen_rbo);
+        offscreen_fbo = 0;
+        offscreen_rbo = 0;
+        return false;
     }
+    glClear(GL_COLOR_BUFFER_BIT);
+    printv("Rendering offscreen (%dx%d)\n", gl_width, gl_height);
+    return true;
+#else
+    perr("Offscreen rendering is not supported on this platform\n");
+    return false;
+#endif
 }
 
-
 // Knowing the current FPS is useful for troubleshooting
 void display_fps(u64 frames_duration, u64 nb_frames)
 {
     char c;
-    int	i;
+    int	i, j;
     char  s_fps[10];
     static u64 lf = 1000;
     static u64 li = 1;
@@ -1601,13 +3212,38 @@ void display_fps(u64 frames_duration, u64 nb_frames)
 
     sprintf(s_fps, "%3lldFPS", li*1000/lf);
 
-    glColor3f(0.3f, 0.4f, 1.0f);
+    set_colour(0.3f, 0.4f, 1.0f, 1.0f);
 
     for (i=0; (c = s_fps[i]); i++)
         display_sprite(PSP_SCR_WIDTH-50+8*i, 2,
-            PANEL_CHARS_W, PANEL_CHARS_CORRECTED_H, chars_texid[c-0x20]);
+            PANEL_CHARS_W, PANEL_CHARS_CORRECTED_H, &chars_atlas[c-0x20]);
+
+    // Texture binds, draw calls, vertices and overlay sort comparisons since the last
+    // call, i.e. for one frame, and the number of frames that didn't need to be drawn
+    // before that one
+    for (j=0; j<5; j++)
+    {
+        if (j == 0)
+            sprintf(s_fps, "%3dBND", (int)nb_texture_binds);
+        else if (j == 1)
+            sprintf(s_fps, "%3dDRW", (int)nb_draw_calls);
+        else if (j == 2)
+            sprintf(s_fps, "%4dVTX", (int)nb_vertices);
+        else if (j == 3)
+            sprintf(s_fps, "%4dCMP", (int)nb_overlay_compares);
+        else
+            sprintf(s_fps, "%3dSKP", (int)nb_frames_skipped);
+        for (i=0; (c = s_fps[i]); i++)
+            display_sprite(PSP_SCR_WIDTH-50+8*i, 12+10*j,
+                PANEL_CHARS_W, PANEL_CHARS_CORRECTED_H, &chars_atlas[c-0x20]);
+    }
+    nb_texture_binds = 0;
+    nb_draw_calls = 0;
+    nb_vertices = 0;
+    nb_overlay_compares = 0;
+    nb_frames_skipped = 0;
 
-    glColor3f(fade_value, fade_value, fade_value);
+    set_colour(fade_value, fade_value, fade_value, 1.0f);
 }
 
 
@@ -1671,14 +3307,14 @@ void display_menu_screen()
 
         // "grey-out" disabled menus
         if ((line>=FIRST_MENU_ITEM) && (!enabled_menus[selected_menu][line]))
-            glColor4f(0.7f, 0.4f, 0.3f, 1.0f-fade_value+MIN_MENU_FADE);
+            set_colour(0.7f, 0.4f, 0.3f, 1.0f-fade_value+MIN_MENU_FADE);
         else
-            glColor4f(1.0f, 1.0f, 1.0f, 1.0f-fade_value+MIN_MENU_FADE);
+            set_colour(1.0f, 1.0f, 1.0f, 1.0f-fade_value+MIN_MENU_FADE);
 
         for (i=0; (c = menus[selected_menu][line][i]); i++)
         {
             display_sprite(line_start+16*i, 32+16*line,
-                2*PANEL_CHARS_W, 2*PANEL_CHARS_CORRECTED_H, chars_texid[c-0x20]);
+                2*PANEL_CHARS_W, 2*PANEL_CHARS_CORRECTED_H, &chars_atlas[c-0x20]);
         }
 
         if (selected_menu == OPTIONS_MENU)
@@ -1687,7 +3323,7 @@ void display_menu_screen()
 			{	// This one has multiple values
 				for (j=0; (c = smoothing[opt_gl_smoothing][j]); i++,j++)
 					display_sprite(line_start+16*i, 32+16*line,
-						2*PANEL_CHARS_W, 2*PANEL_CHARS_CORRECTED_H, chars_texid[c-0x20]);
+						2*PANEL_CHARS_W, 2*PANEL_CHARS_CORRECTED_H, &chars_atlas[c-0x20]);
 			}
 			else
 			{
@@ -1715,17 +3351,17 @@ void display_menu_screen()
 				}
 				for (j=0; (c = on_off[on_off_index][j]); i++,j++)
 					display_sprite(line_start+16*i, 32+16*line,
-						2*PANEL_CHARS_W, 2*PANEL_CHARS_CORRECTED_H, chars_texid[c-0x20]);
+						2*PANEL_CHARS_W, 2*PANEL_CHARS_CORRECTED_H, &chars_atlas[c-0x20]);
 			}
 		}
 	}
     // Selection cursor
-    glColor4f(1.0f, 1.0f, 1.0f, 1.0f-fade_value+MIN_MENU_FADE);
+    set_colour(1.0f, 1.0f, 1.0f, 1.0f-fade_value+MIN_MENU_FADE);
     display_sprite(line_start-20, 32+16*selected_menu_item,
-        2*PANEL_CHARS_W, 2*PANEL_CHARS_CORRECTED_H, chars_texid[MENU_MARKER]);
+        2*PANEL_CHARS_W, 2*PANEL_CHARS_CORRECTED_H, &chars_atlas[MENU_MARKER]);
 
     // Display our blurb
-    glColor4f(0.3f, 0.4f, 1.0f, 1.0f-fade_value+MIN_MENU_FADE-0.2f);
+    set_colour(0.3f, 0.4f, 1.0f, 1.0f-fade_value+MIN_MENU_FADE-0.2f);
     for (line = 0; line < SIZE_A(aperblurb); line++)
     {
         if (aperblurb[line][0] == ' ')
@@ -1735,50 +3371,172 @@ void display_menu_screen()
         for (i=0; (c = aperblurb[line][i]); i++)
         {
             display_sprite(line_start+12*i, 212+10*line,
-                PANEL_CHARS_W, PANEL_CHARS_CORRECTED_H, chars_texid[c-0x20]);
+                PANEL_CHARS_W, PANEL_CHARS_CORRECTED_H, &chars_atlas[c-0x20]);
         }
     }
     line_start = ((PSP_SCR_WIDTH-(strlen(aperurl))*8)/2)&(~7);
     for (i=0; (c = aperurl[i]); i++)
         {
             display_sprite(line_start+8*i, 232,
-                PANEL_CHARS_W, PANEL_CHARS_CORRECTED_H, chars_texid[c-0x20]);
+                PANEL_CHARS_W, PANEL_CHARS_CORRECTED_H, &chars_atlas[c-0x20]);
         }
 
-    glColor4f(fade_value, fade_value, fade_value, 1.0f);
+    set_colour(fade_value, fade_value, fade_value, 1.0f);
 }
 
 
-// The couple of routines below handle the 4-way split pause screen
-void create_pause_screen()
-{
+// The routines below handle the 4-way split pause screen
+// Rather than drawing the four rooms on pause, each view is refreshed in turn while
+// playing, so that pausing only needs to update the views that aren't current
 #define SPACER	8
-    int i, restore_nation, restore_fade;
+static u8   paused_valid = 0;		// one bit per nation, set when its view is current
+static u8   paused_next = 0;		// last view refreshed
+static u64  paused_t = 0;			// game time of the last refresh
+// What each view was captured from
+static u16  paused_room[NB_NATIONS];
+static s16  paused_px[NB_NATIONS], paused_p2y[NB_NATIONS], paused_dir[NB_NATIONS];
+static u32  paused_bitmask[NB_NATIONS];
+static bool paused_as_guard[NB_NATIONS];
+
+// Render the room of a nation and copy its center into the relevant paused texture
+// The game state is preserved, as this is also called while playing. When we can,
+// the room is drawn in its own FBO, and without the room cache, so that the frame
+// on screen and the cached tiles of the current room are left alone
+static void capture_pause_view(u8 nation)
+{
+    bool own_target = false;
+#if defined(WIN32)
+    bool restore_cache = room_cache_enabled;
+#endif
+    u8   restore_nation, restore_over_prop, restore_over_prop_id;
+    s16  restore_p_x, restore_p_y;
+    char* restore_message;
+    int  restore_priority;
+    u64  restore_timeout;
+    float restore_fade;
     float x,y,w,h;
 
-    restore_fade = fade_value;
-    fade_value = 1.0f;
     restore_nation = current_nation;
+    restore_fade = fade_value;
+    restore_message = status_message;
+    restore_priority = status_message_priority;
+    restore_timeout = t_status_message_timeout;
+    restore_over_prop = over_prop;
+    restore_over_prop_id = over_prop_id;
+    restore_p_x = last_p_x;
+    restore_p_y = last_p_y;
+
     w = powerize(PSP_SCR_WIDTH/2 - 2*SPACER);
     h = powerize(PSP_SCR_HEIGHT/2 - 2*SPACER);
     x = PSP_SCR_WIDTH/4 + SPACER;
     y = PSP_SCR_HEIGHT/4 + NORTHWARD_HO + 16 + SPACER;
-    for (i=0; i<NB_NATIONS; i++)
+
+#if defined(WIN32)
+    if ((renderer->gl) && (pause_fbo != 0))
     {
-        current_nation = i;
-        prisoner_state &= ~(STATE_MOTION|STATE_ANIMATED);
-        prisoner_reset_ani = true;
-        t_status_message_timeout = 0;
-        status_message_priority = 0;
-        set_room_props();
-        glClear(GL_COLOR_BUFFER_BIT);
-        display_room();
-        // Copy the section of interest into one of our four paused textures
-        glBindTexture(GL_TEXTURE_2D, paused_texid[i]);
-        glCopyTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, x, y, w, h, 0);
+        own_target = true;
+        glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, pause_fbo);
+        room_cache_enabled = false;
     }
+#endif
+
+    fade_value = 1.0f;
+    current_nation = nation;
+    set_room_props();
+    // No motion, so that removable_walls() leaves rem_bitmask alone. As this is the
+    // ext_bitmask of that prisoner, we get the walls as they were the last time that
+    // prisoner was the one moving. This is only wrong outside, for a prisoner that
+    // was moved by the game since (e.g. when released from solitary)
+    last_p_x = prisoner_x;
+    last_p_y = prisoner_2y/2;
+    renderer->clear(0, 0, PSP_SCR_WIDTH, PSP_SCR_HEIGHT);
+    display_room();
+    batch_flush();
+    // Copy the section of interest into one of our four paused textures
+    renderer->capture(paused_texid[nation], (s16)x, (s16)y, (u16)w, (u16)h);
+    paused_valid |= 1<<nation;
+    paused_room[nation] = guy(nation).room;
+    paused_px[nation] = guy(nation).px;
+    paused_p2y[nation] = guy(nation).p2y;
+    paused_dir[nation] = guy(nation).direction;
+    paused_bitmask[nation] = guy(nation).ext_bitmask;
+    paused_as_guard[nation] = guy(nation).is_dressed_as_guard;
+
     current_nation = restore_nation;
+    set_room_props();
     fade_value = restore_fade;
+    status_message = restore_message;
+    status_message_priority = restore_priority;
+    t_status_message_timeout = restore_timeout;
+    over_prop = restore_over_prop;
+    over_prop_id = restore_over_prop_id;
+    last_p_x = restore_p_x;
+    last_p_y = restore_p_y;
+
+#if defined(WIN32)
+    room_cache_enabled = restore_cache;
+    if (own_target)
+        bind_scene_fbo();
+#endif
+    // What we drew over is not what's on screen
+    if (!own_target)
+        frame_invalidate();
+}
+
+// Whether a view needs to be captured again. Guards moving in that room
+// are only picked up once the prisoner moves
+static bool pause_view_changed(u8 nation)
+{
+    return (!(paused_valid & (1<<nation))) || (paused_room[nation] != guy(nation).room) ||
+        (paused_px[nation] != guy(nation).px) || (paused_p2y[nation] != guy(nation).p2y) ||
+        (paused_dir[nation] != guy(nation).direction) ||
+        (paused_bitmask[nation] != guy(nation).ext_bitmask) ||
+        (paused_as_guard[nation] != guy(nation).is_dressed_as_guard);
+}
+
+// Called before each game frame: refresh the next view that changed, if it's time to.
+// The current nation is always captured again on pause, so it is skipped here
+void update_pause_screen()
+{
+    u8 i;
+
+    // Let the game frame reset the animations first
+    if (init_animations)
+        return;
+    if ( (game_time >= paused_t) && (game_time - paused_t < PAUSE_VIEW_INTERVAL) )
+        return;
+    paused_t = game_time;
+    for (i=0; i<NB_NATIONS; i++)
+    {
+        paused_next = (paused_next+1) % NB_NATIONS;
+        if ((paused_next != current_nation) && (pause_view_changed(paused_next)))
+        {
+            capture_pause_view(paused_next);
+            return;
+        }
+    }
+}
+
+// The views are from a previous game after a new game or a load
+void invalidate_pause_screen()
+{
+    paused_valid = 0;
+}
+
+// Only the current nation, which may just have moved, and the views that changed
+// since they were last refreshed need to be drawn
+void create_pause_screen()
+{
+    int i;
+
+    for (i=0; i<NB_NATIONS; i++)
+    {
+        // Show everybody standing
+        guy(i).state &= ~(STATE_MOTION|STATE_ANIMATED);
+        guy(i).reset_animation = true;
+        if ( (i == current_nation) || (pause_view_changed((u8)i)) )
+            capture_pause_view((u8)i);
+    }
 }
 
 void display_pause_screen()
@@ -1792,66 +3550,41 @@ void display_pause_screen()
 
     for (i=0; i<NB_NATIONS; i++)
     {
-        glColor3f(fade_value, fade_value, fade_value);
+        set_colour(fade_value, fade_value, fade_value, 1.0f);
 
         j = (2*(i+1) + i/2)%4;	// we need to display in 2, 0, 3, 1 order because of texture
                                 // overlap correction due to having to use powerized ones on PSP
         x = (j%2)*(PSP_SCR_WIDTH/2) + SPACER + x_shift[j%2] + 0.5;
         y = (j/2)*(PSP_SCR_HEIGHT/2) + (PSP_SCR_HEIGHT/2) - SPACER + y_shift[j/2] + 0.5;
-        glDisable(GL_BLEND);	// textures won't appear on PSP without blend disabled (but works on Windows)
-        display_sprite(x, y, powerize(w), -powerize(h), paused_texid[j]);
-        glEnable(GL_BLEND);
-
-        // Draw the border
-        glDisable(GL_TEXTURE_2D);	// F...ing openGL a...oles!!! Why is it that as soon as you have textures
-                                    // enabled, you cannot draw plain COLOURED primitives any longer?!?
-                                    // took me days to figure this crap!!!
-        glColor3ub(pause_rgb[RED]*fade_value, pause_rgb[GREEN]*fade_value, pause_rgb[BLUE]*fade_value);
-        glBegin(GL_LINE_STRIP);		// doesn't look like pspGL handles LINE_LOOP
-            glVertex2f(x, y);
-            glVertex2f(x+w, y);
-            glVertex2f(x+w, y-h);
-            glVertex2f(x, y-h);
-            glVertex2f(x, y);
-        glEnd();
-        glEnable(GL_TEXTURE_2D);
+        display_texture(x, y, powerize(w), -powerize(h), paused_texid[j]);
+        batch_quad[nb_batch_quads-1].opaque = true;
+
+        // Draw the border, as 1 pixel wide rectangles
+        set_colour(pause_rgb[RED]*fade_value/255.0f, pause_rgb[GREEN]*fade_value/255.0f,
+            pause_rgb[BLUE]*fade_value/255.0f, 1.0f);
+        display_rectangle(x-0.5f, y-0.5f, w+1.0f, 1.0f);
+        display_rectangle(x-0.5f, y-h-0.5f, w+1.0f, 1.0f);
+        display_rectangle(x-0.5f, y-h-0.5f, 1.0f, h+1.0f);
+        display_rectangle(x+w-0.5f, y-h-0.5f, 1.0f, h+1.0f);
     }
 
     // now hide the overlap up and right, and between frames
-    glDisable(GL_TEXTURE_2D);
-    glColor3f(0.0f, 0.0f, 0.0f);
+    set_colour(0.0f, 0.0f, 0.0f, 1.0f);
 
     // A couple of lines for in between frames
-    glBegin(GL_LINES);
-        glVertex2f(x-1, 0);
-        glVertex2f(x-1, PSP_SCR_HEIGHT);
-        glVertex2f(0, y+1);
-        glVertex2f(PSP_SCR_WIDTH, y+1);
-    glEnd();
+    display_rectangle(x-1.5f, 0.0f, 1.0f, PSP_SCR_HEIGHT);
+    display_rectangle(0.0f, y+0.5f, PSP_SCR_WIDTH, 1.0f);
 
     // And 2 black rectangles for up and right
-    glBegin(GL_TRIANGLE_FAN);
-        glVertex2f(0, 0);
-        glVertex2f(PSP_SCR_WIDTH, 0);
-        glVertex2f(PSP_SCR_WIDTH, y-h);
-        glVertex2f(0, y-h);
-    glEnd();
-
-    glBegin(GL_TRIANGLE_FAN);
-        glVertex2f(PSP_SCR_WIDTH-2*SPACER+2, 0);
-        glVertex2f(PSP_SCR_WIDTH, 0);
-        glVertex2f(PSP_SCR_WIDTH, PSP_SCR_HEIGHT);
-        glVertex2f(PSP_SCR_WIDTH-2*SPACER+2, PSP_SCR_HEIGHT);
-    glEnd();
+    display_rectangle(0.0f, 0.0f, PSP_SCR_WIDTH, y-h);
+    display_rectangle(PSP_SCR_WIDTH-2*SPACER+2, 0.0f, 2*SPACER-2, PSP_SCR_HEIGHT);
 
-    // Restore colour and stuff
-    glColor3f(fade_value, fade_value, fade_value);
-    glEnable(GL_TEXTURE_2D);
+    // Restore colour
+    set_colour(fade_value, fade_value, fade_value, 1.0f);
 }
 
-
-// Open and texturize an IFF image file.
-bool load_iff(s_tex* tex)
+// Texturize an IFF image resource
+static bool load_iff(s_tex* tex, s_res* res)
 {
     bool got_cmap		= false;
     bool got_body		= false;
@@ -1868,120 +3601,104 @@ bool load_iff(s_tex* tex)
         return false;
     }
 
-    if ((fd = fopen (tex->filename, "rb")) == NULL)
-    {
-        perr("Can't find file '%s'\n", tex->filename);
-        return false;
-    }
-
     // Check the header
-    if (freadlong(fd) != IFF_FORM)
+    if (res_readlong(res) != IFF_FORM)
     {
-        fclose(fd);
         perr("load_iff: 'FORM' tag not found.\n");
         return false;
     }
-    freadlong(fd);	// Skip length
-    if (freadlong(fd) != IFF_ILBM)
+    res_readlong(res);	// Skip length
+    if (res_readlong(res) != IFF_ILBM)
     {
-        fclose(fd);
         printf("load_iff: 'ILBM' tag not found.\n");
         return false;
     }
-    if (freadlong(fd) != IFF_BMHD)
+    if (res_readlong(res) != IFF_BMHD)
     {
-        fclose(fd);
         perr("loadIFF: 'BMHD' tag not found.\n");
         return false;
     }
-    if (freadlong(fd) != 0x14)
+    if (res_readlong(res) != 0x14)
     {
-        fclose(fd);
         perr("load_iff: Bad header length.\n");
         return false;
     }
 
     // Read width and height
-    w = freadword(fd);
+    w = res_readword(res);
     if (w > 512)
     {
-        fclose(fd);
         perr("loadIFF: IFF width must be lower than 512\n");
         return false;
     }
     if (w & 0x7)
     {
-        fclose(fd);
         perr("load_iff: IFF width must be a multiple of 8\n");
         return false;
     }
-    h = freadword(fd);
-    if (h > PSP_SCR_HEIGHT)
+    h = res_readword(res);
+    if (h > powerize(tex->h))
     {
-        fclose(fd);
-        perr("load_iff: IFF height must be lower than %d\n", PSP_SCR_HEIGHT);
+        perr("load_iff: IFF height must be lower than %d\n", powerize(tex->h));
         return false;
     }
 
     // Discard offsets
-    freadword(fd);	// x offset
-    freadword(fd);	// y offset
+    res_readword(res);	// x offset
+    res_readword(res);	// y offset
 
     // Check number of planes (colour depth)
-    nplanes = freadbyte(fd);
+    nplanes = res_readbyte(res);
     if (nplanes > 5)
     {
-        fclose(fd);
         perr("load_iff: Color depth must be lower than 5\n");
         return false;
     }
 
     // Check masking
-    masking = freadbyte(fd);
+    masking = res_readbyte(res);
     if (masking != 0)
     {
-        fclose(fd);
         perr("loadIFF: Can't handle IFF masking\n");
         return false;
     }
 
     // Get compression type
-    compression = freadbyte(fd);
+    compression = res_readbyte(res);
     if (compression > IFF_CMP_BYTERUN1)
     {
-        fclose(fd);
         perr("load_iff: Unknown IFF compression method\n");
         return false;
     }
 
     // Discard some more stuff
-    freadbyte(fd);	// Padding
-    freadword(fd);	// Transparent colour
-    freadbyte(fd);	// X aspect ratio
-    freadbyte(fd);	// Y aspect ratio
-    freadword(fd);	// Page width
-    freadword(fd);	// Page height
+    res_readbyte(res);	// Padding
+    res_readword(res);	// Transparent colour
+    res_readbyte(res);	// X aspect ratio
+    res_readbyte(res);	// Y aspect ratio
+    res_readword(res);	// Page width
+    res_readword(res);	// Page height
 
     // Read CMAP (palette) and BODY
-    while (((!got_body) || (!got_cmap)) && (feof(fd) == 0))
+    while (((!got_body) || (!got_cmap)) && (!res_eof(res)))
     {
-        iff_tag = freadlong(fd);
+        iff_tag = res_readlong(res);
         switch(iff_tag)
         {
         case IFF_CMAP:
-            len = freadlong(fd)/3;
+            len = res_readlong(res)/3;
             for (i=0; i<len; i++)
             {
-                aPalette[i]  = ((u16)freadbyte(fd) & 0xF0) << 4;	// Red
-                aPalette[i] |= ((u16)freadbyte(fd) & 0xF0) << 8;	// Green
-                aPalette[i] |= ((u16)freadbyte(fd) & 0xF0) >> 4;	// Blue
+                aPalette[i]  = ((u16)res_readbyte(res) & 0xF0) << 4;	// Red
+                aPalette[i] |= ((u16)res_readbyte(res) & 0xF0) << 8;	// Green
+                aPalette[i] |= ((u16)res_readbyte(res) & 0xF0) >> 4;	// Blue
                 aPalette[i] |= 0x00F0;								// Alpha
             }
             got_cmap = true;
             break;
 
         case IFF_BODY:
-            freadlong(fd);	// Ignore BODY size
+            res_readlong(res);	// Ignore BODY size
 
             // Calculate bytes per line. (NB: our width is always a multiple of 8)
             bytes_per_line = w >> 3;
@@ -1995,17 +3712,17 @@ bool load_iff(s_tex* tex)
                         i = 0;
                         while (i < bytes_per_line)
                         {
-                            bytecount = freadbyte(fd);
+                            bytecount = res_readbyte(res);
                             if (bytecount < 128)
                             {
                                 bytecount++;
-                                fread(&lbuffer[plane][i], 1, bytecount, fd);
+                                res_read(&lbuffer[plane][i], bytecount, res);
                                 i += bytecount;
                             }
                             else if (bytecount > 128)
                             {
                                 bytecount = -bytecount + 1;
-                                bytedup = freadbyte(fd);
+                                bytedup = res_readbyte(res);
                                 memset(&lbuffer[plane][i], bytedup, bytecount);
                                 i += bytecount;
                             }
@@ -2016,48 +3733,40 @@ bool load_iff(s_tex* tex)
                     }
                     else
                         // Uncompressed
-                        fread(&lbuffer[plane][0], 1, bytes_per_line, fd);
+                        res_read(&lbuffer[plane][0], bytes_per_line, res);
                 }
 
                 // OK, now we have our <nplanes> line buffers
                 // Let's recombine those bits, and convert to GRAB from our palette
                 line_interleaved_to_wGRAB((u8*)lbuffer,
-                    tex->buffer+powerized_w*y*2, powerized_w, 1, nplanes);
+                    tex->buffer+powerized_w*y*2, powerized_w, 1, nplanes, aPalette);
             }
 
-            // We need to blank the extra padding we have, at least for
-            // the PSP Screen height
-            if (h < PSP_SCR_HEIGHT)
-                memset(tex->buffer+powerized_w*h*2, 0, (PSP_SCR_HEIGHT-h)*powerized_w*2);
+            // We need to blank the extra padding we have
+            if (h < powerize(tex->h))
+                memset(tex->buffer+powerized_w*h*2, 0, (powerize(tex->h)-h)*powerized_w*2);
 
             got_body = true;
             break;
 
         default:	// Skip Unused sections
-            len = freadlong(fd);
-            for (i=0; i<len; i++)
-                freadbyte(fd);
+            len = res_readlong(res);
+            res->pos = (len < res->size - res->pos)?res->pos+len:res->size;
         }
     }
 
-    fclose(fd);
-    fd = NULL;
-
     if (!(got_body && got_cmap))
         return false;
 
     // The iff is good => we can set our texture
-    glBindTexture(GL_TEXTURE_2D, tex->texid);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, powerized_w, powerize(tex->h),
-        0, GL_RGBA, GL_UNSIGNED_SHORT_4_4_4_4_REV, tex->buffer);
+    upload_texture(tex->texid, powerized_w, powerize(tex->h), TEX_FMT_GRAB, tex->buffer);
 
     return true;
 }
 
 
-// Open and texturize a 16, 24 or 32 bpp RGB(A) RAW image
-bool load_raw_rgb(s_tex* tex, u8 pixel_size)
+// Texturize a 16, 24 or 32 bpp RGB(A) RAW image resource
+static bool load_raw_rgb(s_tex* tex, u8 pixel_size, s_res* res)
 {
     u32 line_size, powerized_line_size;
     int i;
@@ -2066,16 +3775,10 @@ bool load_raw_rgb(s_tex* tex, u8 pixel_size)
     line_size = pixel_size*(tex->w);
     powerized_line_size = pixel_size*powerize(tex->w);
 
-    if ((fd = fopen (tex->filename, "rb")) == NULL)
-    {
-        printf("Can't find file '%s'\n", tex->filename);
-        return false;
-    }
-
     line_start = tex->buffer;
     for (i=0; i<(tex->h); i++)
     {
-        if (fread (line_start, 1, line_size, fd) != line_size)
+        if (res_read(line_start, line_size, res) != line_size)
         {
             printf("'%s': Read error while reading line %d\n", tex->filename, i);
             return false;
@@ -2085,23 +3788,16 @@ bool load_raw_rgb(s_tex* tex, u8 pixel_size)
         line_start += powerized_line_size;
     }
 
-    fclose(fd);
-
-    glBindTexture(GL_TEXTURE_2D, tex->texid);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     switch (pixel_size)
     {
     case 4:	// 8 bpp RGBA
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, powerize(tex->w), powerize(tex->h),
-            0, GL_RGBA, GL_UNSIGNED_BYTE, tex->buffer);
+        upload_texture(tex->texid, powerize(tex->w), powerize(tex->h), TEX_FMT_RGBA, tex->buffer);
         break;
     case 3:	// 8 bpp RGB
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, powerize(tex->w), powerize(tex->h),
-            0, GL_RGB, GL_UNSIGNED_BYTE, tex->buffer);
+        upload_texture(tex->texid, powerize(tex->w), powerize(tex->h), TEX_FMT_RGB, tex->buffer);
         break;
     case 2: // 4 bpp GRAB => BEST PERFORMANCE ON PSP!!
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, powerize(tex->w), powerize(tex->h),
-            0, GL_RGBA, GL_UNSIGNED_SHORT_4_4_4_4_REV, tex->buffer);
+        upload_texture(tex->texid, powerize(tex->w), powerize(tex->h), TEX_FMT_GRAB, tex->buffer);
         break;
     default:
         printf("load_raw_rgb: unexpected pixel size\n");
@@ -2113,7 +3809,52 @@ bool load_raw_rgb(s_tex* tex, u8 pixel_size)
 }
 
 
+// Get a buffer from the static pictures pool, or NULL if they're all in use
+static u8* get_picture_buffer()
+{
+    int i;
+    for (i=0; i<NB_PICTURE_BUFFERS; i++)
+        if ((!picture_buffer_used[i]) && (picture_buffer[i] != NULL))
+        {
+            picture_buffer_used[i] = true;
+            return picture_buffer[i];
+        }
+    return NULL;
+}
+
+static void release_picture_buffer(u8* buffer)
+{
+    int i;
+    for (i=0; i<NB_PICTURE_BUFFERS; i++)
+        if (picture_buffer[i] == buffer)
+            picture_buffer_used[i] = false;
+}
+
+// Evict the least recently used static pictures, until there's room for
+// size more bytes in the cache, or nothing left to evict
+static void make_picture_room(u32 size)
+{
+    u32 i, lru;
+
+    while (picture_cache_size + size > ((u32)opt_picture_cache)*1024)
+    {
+        lru = NB_IFFS;
+        for (i=0; i<NB_IFFS; i++)
+            if ( (picture_last_used[i] != 0) &&
+                 ((lru == NB_IFFS) || (picture_last_used[i] < picture_last_used[lru])) )
+                lru = i;
+        if (lru == NB_IFFS)
+            break;
+        printb("Evicting picture '%s' from cache\n", texture[lru].filename);
+        discard_texture(texture[lru].texid);
+        texture[lru].texid = 0;
+        picture_last_used[lru] = 0;
+        picture_cache_size -= PICTURE_TEX_SIZE(&texture[lru]);
+    }
+}
+
 // Load a texture from a file (RAW or IFF)
+// Static pictures are only loaded if they're not already in the cache
 bool load_texture(s_tex* tex)
 {
 bool iff_file = false;
@@ -2122,23 +3863,35 @@ bool is_rgb4 = false;
 u32  file_size = 0;
 u8   pixel_size = 0;	// in bytes
 u16  powerized_w;
+bool r;
+s_res res;
+u32  picture_id = (u32)(tex - texture);
+
+    // The texture might be reused by a different picture
+    frame_invalidate();
+
+    if ((picture_id < NB_IFFS) && (picture_last_used[picture_id] != 0))
+    {	// Cache hit
+        picture_last_used[picture_id] = ++picture_use_count;
+        return true;
+    }
 
     // closest greater power of 2
     powerized_w = powerize(tex->w);
 
     // Make sure we have a valid texture
     if (tex->texid == 0)
-        glGenTextures(1, &(tex->texid));
+        tex->texid = renderer->gen_texture();
 
-    // Does the file exist
-    if ((fd = fopen (tex->filename, "rb")) == NULL)
+    // Does the file exist (in the pack or as a loose file)
+    if (!res_open(tex->filename, &res))
     {
         printf("Can't find file '%s'\n", tex->filename);
         return false;
     }
 
     // Check if the file's an IFF
-    if (freadlong(fd) == IFF_FORM)
+    if (res_readlong(&res) == IFF_FORM)
     {	// IFF file
         iff_file = true;
     }
@@ -2146,8 +3899,7 @@ u16  powerized_w;
     {	// RAW file
 
         // Find out if there is an alpha channel to read by computing the size
-        fseek(fd, 0, SEEK_END);
-        file_size = ftell(fd);
+        file_size = res.size;
 
         pixel_size = file_size/((tex->w)*(tex->h));
         switch(pixel_size)
@@ -2166,6 +3918,7 @@ u16  powerized_w;
             break;
         default:
             printf("Improper RAW file size for %s\n", tex->filename);
+            res_close(&res);
             return false;
             break;
         }
@@ -2173,23 +3926,44 @@ u16  powerized_w;
         if (pixel_size*(tex->w)*(tex->h) != file_size)
         {
             printf("Improper RAW file size for %s\n", tex->filename);
+            res_close(&res);
             return false;
         }
     }
 
-    // We'll reopen the file in the load_iff/load_raw_rgb functions
-    fclose(fd);
+    // The load_iff/load_raw_rgb functions parse the resource from the start
+    res.pos = 0;
 
     // Let's fill our buffer and texturize then
     if (iff_file)
     {
-        if (tex->buffer == NULL)
+        if ( (picture_id >= NB_IFFS) || (PICTURE_TEX_SIZE(tex) > PICTURE_BUFFER_SIZE) ||
+             ((tex->buffer = get_picture_buffer()) == NULL) )
         {
-            printf("Texture buffer for IFF file %s has not been initialized\n", tex->filename);
+            printf("Can't get a texture buffer for IFF file %s\n", tex->filename);
+            res_close(&res);
             return false;
         }
-        if (!load_iff(tex))
-            return false;
+        if ((picture_uncached != NB_IFFS) && (picture_uncached != picture_id))
+        {	// We're leaving the picture that didn't fit in the cache
+            discard_texture(texture[picture_uncached].texid);
+            texture[picture_uncached].texid = 0;
+        }
+        picture_uncached = NB_IFFS;
+        make_picture_room(PICTURE_TEX_SIZE(tex));
+        r = load_iff(tex, &res);
+        release_picture_buffer(tex->buffer);
+        tex->buffer = NULL;
+        if (r)
+        {
+            if (PICTURE_TEX_SIZE(tex) > ((u32)opt_picture_cache)*1024)
+                picture_uncached = picture_id;
+            else
+            {
+                picture_last_used[picture_id] = ++picture_use_count;
+                picture_cache_size += PICTURE_TEX_SIZE(tex);
+            }
+        }
     }
     else
     {
@@ -2199,12 +3973,13 @@ u16  powerized_w;
             if (tex->buffer == NULL)
             {
                 printf("Could not allocate buffer for texture %s\n", tex->filename);
+                res_close(&res);
                 return false;
             }
         }
-        if (!load_raw_rgb(tex, pixel_size))
-            return false;
+        r = load_raw_rgb(tex, pixel_size, &res);
     }
-    return true;
+    res_close(&res);
+    return r;
 }
 
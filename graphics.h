@@ -38,6 +38,48 @@ extern "C" {
 #define IFF_CMP_NODE			0
 #define IFF_CMP_BYTERUN1		1
 
+// Converted graphics cache (one file per palette)
+#define GFX_CACHE_NAME			"gfx_cache_%d.bin"
+#define GFX_CACHE_MAGIC			MAKE_ID('G','F','X','C')
+// Increment this if the conversion ever changes
+#define GFX_CACHE_VERSION		1
+
+// Static pictures (IFF) buffers and texture cache
+#define NB_PICTURE_BUFFERS		2
+#define PICTURE_BUFFER_SIZE		(512*256*2)
+#define PICTURE_TEX_SIZE(tex)	(((u32)powerize((tex)->w))*powerize((tex)->h)*2)
+
+// Texture atlas for the cells, sprites and panel chars
+#define ATLAS_SIZE				512		// the largest texture the PSP can take
+#define MAX_ATLAS_PAGES			8
+#define ATLAS_HASH_SIZE			1024	// to look for identical cells
+#define NO_CELL					0xFFFF
+
+// Quad batching
+#define MAX_BATCH_QUADS			2048	// a whole frame, plus a room cache update
+#define FILTER_ATLAS			0		// atlas pages, which have their own parameters
+#define FILTER_NEAREST			1
+#define FILTER_LINEAR			2
+#define FILTER_NONE				3		// plain coloured, untextured
+
+// Texture formats, as handed over to the renderers
+#define TEX_FMT_GRAB			0		// 16 bit 0xGRAB words, i.e. GL_UNSIGNED_SHORT_4_4_4_4_REV
+#define TEX_FMT_INDEX			1		// palette indexes, C2P_TRANSPARENT for masked out pixels
+#define TEX_FMT_RGB				2
+#define TEX_FMT_RGBA			3
+
+// Room tile layer cache (FBO)
+#define ROOM_CACHE_W			1024
+#define ROOM_CACHE_H			512
+#define ROOM_CACHE_STEP			8		// outside, in tiles, for the origin of the cached area
+
+// What changed since the last game frame. Game frames are only built when one is set
+#define DIRTY_MOTION			0x01	// position, direction or state of a guy in the room
+#define DIRTY_ANIMATION			0x02	// animation frames
+#define DIRTY_PANEL				0x04	// panel content, status message, user input
+#define DIRTY_DISPLAY			0x08	// palette, textures, window
+#define DIRTY_ALL				0xFF
+
 // GFX Smoothing options for OpenGL
 #define SMOOTH_NONE		0
 #define SMOOTH_LINEAR	1
@@ -53,6 +95,68 @@ typedef struct
 	u8* buffer;
 } s_tex;
 
+// Location of a cell, sprite or panel char in the atlas
+typedef struct
+{
+	u8		page;
+	u16		x, y, w, h;				// in texels
+	float	u1, v1, u2, v2;
+} s_atlas_entry;
+
+typedef struct
+{
+	unsigned int texid;
+	u16		w, h;
+	bool	game_gfx;				// holds the (palette dependent) cells & standard sprites
+} s_atlas_page;
+
+// A queued textured quad
+typedef struct
+{
+	unsigned int texid;
+	u8		filter;
+	bool	indexed;				// needs the palette shader
+	u16		group;					// sortable section, or 0
+	u16		order;					// submission order
+	bool	half;					// only the (x1,y1) (x2,y1) (x1,y2) triangle
+	bool	opaque;					// drawn without blending
+	float	x1, y1, x2, y2;
+	float	u1, v1, u2, v2;
+	u8		colour[4];
+} s_quad;
+
+// Interleaved vertex, in GL_T2F_C4UB_V3F format
+typedef struct
+{
+	float	u, v;
+	u8		colour[4];
+	float	x, y, z;
+} s_vertex;
+
+
+// A rendering backend. Everything the game draws goes through the quads, textures
+// and palette handed over to one of these
+typedef struct
+{
+	const char*	name;
+	bool	gl;						// needs a GL context
+	bool	(*init)();
+	unsigned int (*gen_texture)();
+	void	(*upload)(unsigned int texid, u16 w, u16 h, u8 format, const u8* data);
+	// Copy part of the frame to a texture, with the origin at the bottom left, like GL
+	void	(*capture)(unsigned int texid, s16 x, s16 y, u16 w, u16 h);
+	void	(*discard)(unsigned int texid);
+	void	(*set_palette)(const u16* palette);
+	// Clear the frame. The quads drawn until the next clear are clipped to the area
+	void	(*clear)(s16 x1, s16 y1, s16 x2, s16 y2);
+	void	(*draw)(const s_quad* quad, u32 nb_quads);
+	// true if the last frame presented is still there to be partially redrawn
+	bool	(*keeps_frame)();
+	void	(*present)();
+	// The last frame presented, as malloc'ed RGB, top row first
+	u8*		(*read_frame)(u16* w, u16* h);
+} s_renderer;
+
 
 /*
  *	Graphics globals we export
@@ -61,34 +165,60 @@ extern s_tex		texture[NB_TEXTURES];
 extern s_sprite		*sprite;
 extern s_overlay	*overlay;
 extern u8			overlay_index;
+extern u16			nb_cells;
 extern s16			gl_off_x, gl_off_y;
 extern s16			last_p_x, last_p_y;
+extern u8			display_dirty;
 extern int			selected_menu_item, selected_menu;
 extern char*		menus[NB_MENUS][NB_MENU_ITEMS];
 extern bool			enabled_menus[NB_MENUS][NB_MENU_ITEMS];
+extern const s_renderer	gl_renderer, gl_immediate_renderer;
+#if defined(WIN32)
+extern const s_renderer	gl33_renderer;
+#endif
+extern const s_renderer	*renderer;
 
 /*
  *	Public prototypes
  */
 void free_gfx();
-void to_16bit_palette(u8 palette_index, u8 transparent_index, u8 io_file);
-void cells_to_wGRAB(u8* source, u8* dest);
+void to_16bit_palette(u16* palette, u8 palette_index, u8 transparent_index, u8 io_file);
+void cells_to_wGRAB(u32 first, u32 last);
 void display_sprite_linear(float x1, float y1, float w, float h, unsigned int texid) ;
+void batch_flush();
+void frame_begin();
+bool frame_end();
+void frame_invalidate();
+void update_cmp_grid();
+void reset_cmp_grid();
 void display_room();
 void display_picture();
 void display_panel();
 void rescale_buffer();
+bool init_offscreen();
+bool set_renderer(const char* name);
 void create_savegame_list();
 void display_menu_screen();
+void update_pause_screen();
+void invalidate_pause_screen();
 void create_pause_screen();
 void display_pause_screen();
 void set_textures();
 void init_sprites();
-void sprites_to_wGRAB();
+void sprites_to_wGRAB(u16 first, u16 last);
+void texturize_atlas(bool palette_only);
+bool load_palette(u8 pal_index);
+void write_gfx_cache(u8 pal_index);
+void set_palette(u8 pal_index);
 bool load_texture(s_tex *tex);
 void display_tunnel_area();
 void display_fps(u64 frames_duration, u64 nb_frames);
 bool init_shader();
+#if defined(DEBUG_ENABLED)
+bool c2p_check();
+bool set_mirror(const s_renderer* mirror_renderer);
+void renderer_benchmark(u32 nb_iterations);
+#endif
 
 #ifdef	__cplusplus
 }
@@ -30,17 +30,45 @@
 #include <string.h>
 #if defined(PSP)
 #include <psptypes.h>
+#include <pspiofilemgr.h>
 #include <psp/psp-printf.h>
 #endif
+#if !defined(WIN32) && !defined(PSP)
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 #include "data-types.h"
 
 #include "colditz.h"
 #include "low-level.h"
 
+// SIMD planar to chunky kernels. These are picked at compile time, from the
+// instruction sets the compiler is allowed to use
+#if defined(__AVX2__)
+#define C2P_AVX2
+#endif
+#if defined(C2P_AVX2) || defined(__SSSE3__) || defined(__AVX__)
+#define C2P_SSSE3
+#endif
+#if defined(C2P_SSSE3) || defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define C2P_SSE2
+#endif
+#if !defined(C2P_SSE2) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#define C2P_NEON
+#endif
+#if defined(C2P_AVX2)
+#include <immintrin.h>
+#elif defined(C2P_SSSE3)
+#include <tmmintrin.h>
+#elif defined(C2P_SSE2)
+#include <emmintrin.h>
+#elif defined(C2P_NEON)
+#include <arm_neon.h>
+#endif
 
-// Some global variables
-int  underflow_flag = 0;
-u32	compressed_size, checksum;
 
 // For ppdepack
 u32 pp_shift_in;
@@ -95,173 +123,210 @@ u16 powerize(u16 n)
 
 /*
  * Custom SKR_COLD compression functions (Bytekiller 1.3)
+ *
+ * The compressed data is a stream of longwords that is read backwards, with the bits
+ * of each longword consumed LSb first. Rather than going one bit at a time, we keep
+ * up to 64 bits of that stream in a reservoir, and use lookup tables for both the
+ * commands and the reversal of the bitstreams
  */
 
-// Get one bit and read ahead if needed
-u32 getbit(u32 *address, u32 *data)
+// Bit reservoir for the compressed stream
+typedef struct
+{
+    u64 bits;		// bits that have not been consumed yet, LSb first
+    int nb_bits;	// number of valid bits in the reservoir
+    u8* src;
+    u32 pos;		// offset of the next longword to read
+    u32 start;		// offset of the first longword of the compressed data
+    u32 checksum;
+    bool error;
+} s_bk_stream;
+
+// Bytekiller commands, indexed on the next 3 bits of the stream
+// (the bit patterns in the comments below are in reading order)
+typedef struct
+{
+    u8 cmd_bits;	// number of bits actually used by the command (2 or 3)
+    u8 copy;		// copy (1) nb_bytes from the stream, or duplicate (0) them
+    u8 nb_bits;		// number of bits to read for the # of bytes (0 = fixed)
+    u8 nb_add;		// value added to the # of bytes
+    u8 offset_bits;	// number of bits to read for the duplication offset
+} s_bk_command;
+
+static const s_bk_command bk_command[8] = {
+    { 2, 1, 3, 1, 0 },		// 000: copy 1-8 bytes
+    { 3, 0, 0, 3, 9 },		// 100: duplicate 3 bytes, 9 bit offset
+    { 2, 0, 0, 2, 8 },		// 010: duplicate 2 bytes, 8 bit offset
+    { 3, 0, 8, 1, 12 },		// 110: duplicate 1-256 bytes, 12 bit offset
+    { 2, 1, 3, 1, 0 },		// 001: copy 1-8 bytes
+    { 3, 0, 0, 4, 10 },		// 101: duplicate 4 bytes, 10 bit offset
+    { 2, 0, 0, 2, 8 },		// 011: duplicate 2 bytes, 8 bit offset
+    { 3, 1, 8, 9, 0 }		// 111: copy 9-264 bytes
+};
+
+// Bitstreams are read in reverse order
+static u8 bk_reverse[256];
+
+// Top up the reservoir with as many longwords as it can hold
+static __inline void bk_refill(s_bk_stream* s)
 {
-    // Read one bit and rotate data
-    u32 bit = (*data) & 1;
-    (*data) >>= 1;
-    if ((*data) == 0)
-    {	// End of current bitstream? => read another longword
-        (*data) = readlong(mbuffer, *address);
-        checksum ^= (*data);
-//        printb("(-%X).l = %08X\n",(uint)(compressed_size-*address+LOADER_DATA_START+8), (uint)*data);
-        (*address)-=4;
-        // Lose the 1 bit marker on read ahead
-        bit = (*data) & 1;
-        // Rotate data and introduce a 1 bit marker as MSb
-        // This to ensure that zeros in high order bits are processed too
-        (*data) = ((*data)>>1) | 0x80000000;
-    }
-    return bit;
+    u32 data;
+    while ((s->nb_bits <= 32) && (s->pos >= s->start))
+    {
+        data = readlong(s->src, s->pos);
+        s->pos -= 4;
+        s->checksum ^= data;
+        s->bits |= ((u64)data) << s->nb_bits;
+        s->nb_bits += 32;
+    }
 }
 
-// Get sequence of streamsize bits (in reverse order)
-u32 getbitstream(u32 *address, u32 *data, u32 streamsize)
+// Get sequence of nb bits (in reverse order), with nb <= 16
+static __inline u32 bk_getbits(s_bk_stream* s, int nb)
 {
-    u32 bitstream = 0;
-    u32 i;
-    for (i=0; i<streamsize; i++)
-        bitstream = (bitstream<<1) | getbit (address, data);
-    return bitstream;
+    u32 v;
+
+    if (s->nb_bits < nb)
+    {
+        bk_refill(s);
+        if (s->nb_bits < nb)
+        {	// Ran out of compressed data
+            s->error = true;
+            return 0;
+        }
+    }
+    v = (u32)s->bits & ((1<<nb)-1);
+    s->bits >>= nb;
+    s->nb_bits -= nb;
+    if (nb <= 8)
+        return bk_reverse[v] >> (8-nb);
+    return ((bk_reverse[v&0xFF]<<8) | bk_reverse[v>>8]) >> (16-nb);
 }
 
 // Decrement address by one byte and check for buffer underflow
-void decrement(u32 *address)
+static __inline void bk_decrement(u32 *address, int *underflow)
 {
-    if (underflow_flag)
+    if (*underflow)
         perr("uncompress(): Buffer underflow error.\n");
     if ((*address)!=0)
         (*address)--;
     else
-        underflow_flag = 1;
-}
-
-// Duplicate nb_bytes from address+offset to address
-void duplicate(u32 *address, u32 offset, u32 nb_bytes)
-{
-    u32 i;
-    if (offset == 0)
-        perr("uncompress(): WARNING - zero offset value found for duplication\n");
-    for (i=0; i<nb_bytes; i++)
-    {
-        writebyte(fbuffer[LOADER], (*address), readbyte(fbuffer[LOADER],(*address)+offset));
-        decrement(address);
-    }
+        *underflow = 1;
 }
 
 /*
  *	Colditz loader uncompression. Algorithm is Bytekiller 1.3
+ *  src is the content of SKR_COLD, and dest must be able to hold dest_len bytes
  */
-int uncompress(u32 expected_size)
+int uncompress(u8* src, u32 src_len, u8* dest, u32 dest_len)
 {
-    u32 source = LOADER_DATA_START;
-    u32 uncompressed_size, current;
-    u32 dest, offset;
-    u32 bit, nb_bits_to_process, nb_bytes_to_process;
-    u32 j;
-    compressed_size = readlong(mbuffer, source);
-    source +=4;
-    uncompressed_size = readlong(mbuffer, source);
-    source +=4;
-    if (uncompressed_size != expected_size)
+    s_bk_stream s;
+    const s_bk_command* c;
+    u32 compressed_size, uncompressed_size, current;
+    u32 address, offset, nb_bytes, i;
+    int h, underflow = 0;
+
+    if (bk_reverse[0x01] == 0)
+    {	// Initialize our bit reversal table
+        for (i=0; i<256; i++)
+            for (h=0; h<8; h++)
+                if (i & (1<<h))
+                    bk_reverse[i] |= 0x80>>h;
+    }
+
+    if (src_len < LOADER_DATA_START+16)
+    {
+        perr("uncompress(): source is too short\n");
+        return -1;
+    }
+    compressed_size = readlong(src, LOADER_DATA_START);
+    uncompressed_size = readlong(src, LOADER_DATA_START+4);
+    if (uncompressed_size != dest_len)
     {
         perr("uncompress(): uncompressed data size does not match expected size\n");
         return -1;
     }
-    checksum = readlong(mbuffer, source);	// There's a compression checksum
-    source +=4;	// Keeping this last +/- 4 on source for clarity
-
+    if ((compressed_size < 4) || (compressed_size > src_len - (LOADER_DATA_START+12)))
+    {
+        perr("uncompress(): compressed data size does not match source size\n");
+        return -1;
+    }
     perrv("  Compressed size=%X, uncompressed size=%X\n",
         (uint)compressed_size, (uint)uncompressed_size);
 
-    source += (compressed_size-4);	// We read compressed data (long) starting from the end
-    dest = uncompressed_size-1;		// We fill the uncompressed data (byte) from the end too
+    // There's a compression checksum
+    s.checksum = readlong(src, LOADER_DATA_START+8);
+    s.src = src;
+    s.start = LOADER_DATA_START+12;
+    s.error = false;
 
-    current = readlong(mbuffer, source);
-    source -= 4;
-    // Note that the longword above (last one) will not have the one bit marker
-    // => Unlike other longwords, we might read ahead BEFORE all 32 bits
-    // have been rotated out of the last longword of compressed data
-    // (i.e., as soon as rotated long is zero)
+    // We read compressed data (long) starting from the end
+    s.pos = LOADER_DATA_START+8+compressed_size;
+    current = readlong(src, s.pos);
+    s.pos -= 4;
+    s.checksum ^= current;
+    // Unlike other longwords, the last one does not have all of its 32 bits used:
+    // the most significant 1 is a marker for the end of the stream
+    for (h=31; (h>=0) && (!(current & ((u32)1<<h))); h--);
+    if (h < 0)
+        h = 0;
+    s.bits = current & (((u32)1<<h)-1);
+    s.nb_bits = h;
 
-    checksum ^= current;
-//    printb("(-%X).l = %08X\n", (uint)(compressed_size-source+LOADER_DATA_START+8), (uint)current);
-
-    while (dest != 0)
+    // We fill the uncompressed data (byte) from the end too
+    address = uncompressed_size-1;
+    while (address != 0)
     {
-        // Read bit 0 of multiplier
-        bit = getbit (&source, &current);
-        if (bit)
-        {	// bit0 = 1 => 3 bit multiplier
-            // Read bits 1 and 2
-            bit = getbitstream(&source, &current, 2);
-            // OK, this is no longer a bit, but who cares?
-            switch (bit)
+        // Decode the command from the first 3 bits
+        if (s.nb_bits < 3)
+            bk_refill(&s);
+        if (s.nb_bits < 3)
+            break;
+        c = &bk_command[s.bits & 7];
+        s.bits >>= c->cmd_bits;
+        s.nb_bits -= c->cmd_bits;
+        nb_bytes = (c->nb_bits?bk_getbits(&s, c->nb_bits):0) + c->nb_add;
+
+        if (c->copy)
+        {	// Read and copy nb_bytes from the stream
+            for (i=0; i<nb_bytes; i++)
             {
-            case 2:	// mult: 011 (01 reversed  = 10)
-                // Read # of bytes to duplicate (8 bit value)
-                nb_bytes_to_process = getbitstream(&source, &current, 8)+1;
-                // Read offset (12 bit value)
-                offset = getbitstream(&source, &current, 12);
-                duplicate(&dest, offset, nb_bytes_to_process);
-//                printb("  o mult=011: duplicated %d bytes at (start) offset %X to address %X\n",
-//                        (uint)nb_bytes_to_process, (int)offset, (uint)dest+1);
-                break;
-            case 3:	// mult: 111
-                // Read # of bytes to read and copy (8 bit value)
-                nb_bytes_to_process = getbitstream(&source, &current, 8) + 9;
-                // We add 8 above, because a [1-9] value
-                // would be taken care of by a 3 bit bitstream
-                for (j=0; j<nb_bytes_to_process; j++)
-                {	// Read and copy nb_bytes+1
-                    writebyte(fbuffer[LOADER], dest, (u8)getbitstream(&source, &current, 8));
-                    decrement(&dest);
-                }
-//                printb("  o mult=111: copied %d bytes to address %X\n", (int)nb_bytes_to_process, (uint)dest+1);
-                break;
-            default: // mult: x01
-                // Read offset (9 or 10 bit value)
-                nb_bits_to_process = bit+9;
-                offset = getbitstream(&source, &current, nb_bits_to_process);
-                // Duplicate 2 or 3 bytes
-                nb_bytes_to_process = bit+3;
-                duplicate(&dest, offset, nb_bytes_to_process);
-//                printb("  o mult=%d01: duplicated %d bytes at (start) offset %X to address %X\n",
-//                        (int)bit&1, (int)nb_bytes_to_process, (uint)offset, (uint)dest+1);
-                break;
+                dest[address] = (u8)bk_getbits(&s, 8);
+                bk_decrement(&address, &underflow);
             }
         }
         else
-        {	// bit0=0 => 2 bit multiplier
-            bit = getbit (&source, &current);
-            if (bit)
-            {	// mult: 10
-                // Read 8 bit offset
-                offset = getbitstream(&source, &current, 8);
-                // Duplicate 1 byte
-                duplicate(&dest, offset, 2);
-//                printb("  o mult=10: duplicated 2 bytes at (start) offset %X to address %X\n",
-//                        (uint)offset, (uint)dest+1);
+        {	// Duplicate nb_bytes from address+offset to address
+            offset = bk_getbits(&s, c->offset_bits);
+            if (offset == 0)
+                perr("uncompress(): WARNING - zero offset value found for duplication\n");
+            if (address + offset >= dest_len)
+                break;
+            if ((address >= nb_bytes) && (offset >= nb_bytes))
+            {	// No overlap and no underflow => copy the whole block at once
+                address -= nb_bytes;
+                memcpy(dest+address+1, dest+address+1+offset, nb_bytes);
             }
-            else
-            {	// mult: 00
-                // Read # of bytes to read and copy (3 bit value)
-                nb_bytes_to_process = getbitstream(&source, &current, 3) + 1;
-                for (j=0; j<nb_bytes_to_process; j++)
-                {	// Read and copy nb_bytes+1
-                    writebyte(fbuffer[LOADER], dest, (u8)getbitstream(&source, &current, 8));
-                    decrement(&dest);
-                }
-//                printb("  o mult=00: copied 2 bytes to address %X\n", (uint)dest+1);
-
+            else for (i=0; i<nb_bytes; i++)
+            {
+                dest[address] = dest[address+offset];
+                bk_decrement(&address, &underflow);
             }
         }
+        if (s.error)
+            break;
     }
 
-    if (checksum != 0)
+    if (address != 0)
+    {
+        perr("uncompress(): corrupted compressed data\n");
+        return -1;
+    }
+
+    // The longwords we read ahead in the reservoir must not be part of the checksum
+    for (i=1; i<=(u32)s.nb_bits/32; i++)
+        s.checksum ^= readlong(src, s.pos+4*i);
+    if (s.checksum != 0)
     {
         perr("uncompress(): checksum error\n");
         return -1;
@@ -270,6 +335,50 @@ int uncompress(u32 expected_size)
 }
 
 
+#if defined(DEBUG_ENABLED)
+// Decompression benchmark, for SKR_COLD or any of its variants
+void uncompress_benchmark(const char* filename, u32 nb_iterations)
+{
+    FILE* f;
+    u8  *src = NULL, *dest = NULL;
+    u32 src_len, dest_len, i;
+    u64 t;
+
+    if ((f = fopen(filename, "rb")) == NULL)
+    {
+        perr("Couldn't find file '%s'\n", filename);
+        return;
+    }
+    src = (u8*) aligned_malloc(ALT_LOADER_SIZE, 16);
+    src_len = (src == NULL)?0:fread(src, 1, ALT_LOADER_SIZE, f);
+    fclose(f);
+    if ((src_len != ALT_LOADER_SIZE) && (src_len != ALT_LOADER_SIZE2))
+    {
+        perr("'%s': Unexpected file size or read error\n", filename);
+        goto out;
+    }
+    dest_len = readlong(src, LOADER_DATA_START+4);
+    if ((dest = (u8*) aligned_malloc(dest_len, 16)) == NULL)
+        goto out;
+
+    t = mtime();
+    for (i=0; i<nb_iterations; i++)
+        if (uncompress(src, src_len, dest, dest_len))
+            goto out;
+    t = mtime() - t;
+    if (t == 0)
+        t = 1;
+    printf("'%s' (%s): %d iterations in %d ms => %.1f MB/s\n", filename,
+        (src_len == ALT_LOADER_SIZE)?"PAL":"NTSC", (int)nb_iterations, (int)t,
+        ((float)dest_len*nb_iterations)/(1048.576f*t));
+
+out:
+    aligned_free(src);
+    aligned_free(dest);
+}
+#endif
+
+
 /* Returns a piece of memory aligned to the given
  * alignment parameter. Alignment must be a power of
  * 2.
@@ -345,6 +454,171 @@ void aligned_free(void *ptr)
     free(malloc_ptr);
 }
 
+/*
+ * Memory mapped files
+ */
+
+#if defined(PSP)
+// Read the file into the buffer
+static bool mmap_read(s_mmap* map)
+{
+    FILE* f;
+    size_t read;
+    if ((f = fopen(map->filename, "rb")) == NULL)
+        return false;
+    read = fread(map->address, 1, map->size, f);
+    fclose(f);
+    return (read == map->size);
+}
+#endif
+
+// Map the first size bytes of a file. The mapping is private (copy-on-write), which
+// is what we want since a lot of the original files get patched at runtime: pages
+// that are never written remain shared with the OS file cache. The modified pages
+// are reverted from the pristine snapshot of restore_files(), not from the file
+bool mmap_open(const char* filename, size_t size, s_mmap* map)
+{
+#if defined(WIN32)
+    LARGE_INTEGER file_size;
+
+    map->address = NULL;
+    map->size = size;
+    map->mapping = NULL;
+    map->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (map->file == INVALID_HANDLE_VALUE)
+        return false;
+    if ( (!GetFileSizeEx(map->file, &file_size)) || (file_size.QuadPart < (LONGLONG)size) ||
+         ((map->mapping = CreateFileMappingA(map->file, NULL, PAGE_WRITECOPY, 0, 0, NULL)) == NULL) ||
+         ((map->address = (u8*) MapViewOfFile(map->mapping, FILE_MAP_COPY, 0, 0, size)) == NULL) )
+    {
+        if (map->mapping != NULL)
+            CloseHandle(map->mapping);
+        CloseHandle(map->file);
+        return false;
+    }
+    return true;
+#elif defined(PSP)
+    // No mmap => just read the file
+    map->filename = filename;
+    map->size = size;
+    if ((map->address = (u8*) aligned_malloc(size, 16)) == NULL)
+        return false;
+    if (!mmap_read(map))
+    {
+        SAFREE(map->address);
+        return false;
+    }
+    return true;
+#else
+    struct stat st;
+    void* address;
+
+    map->address = NULL;
+    map->size = size;
+    if ((map->fdesc = open(filename, O_RDONLY)) < 0)
+        return false;
+    if ( (fstat(map->fdesc, &st) != 0) || (st.st_size < (off_t)size) ||
+         ((address = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE, map->fdesc, 0)) == MAP_FAILED) )
+    {
+        close(map->fdesc);
+        return false;
+    }
+    map->address = (u8*) address;
+    return true;
+#endif
+}
+
+void mmap_close(s_mmap* map)
+{
+    if (map->address == NULL)
+        return;
+#if defined(WIN32)
+    UnmapViewOfFile(map->address);
+    CloseHandle(map->mapping);
+    CloseHandle(map->file);
+#elif defined(PSP)
+    aligned_free(map->address);
+#else
+    munmap(map->address, map->size);
+    close(map->fdesc);
+#endif
+    map->address = NULL;
+}
+
+// Get the size, times and inode of a file, so that we can tell if it changed
+// Whatever is not available on the platform is set to zero
+bool get_fstamp(const char* filename, s_fstamp* stamp)
+{
+#if defined(WIN32)
+    HANDLE file;
+    BY_HANDLE_FILE_INFORMATION info;
+    FILE_BASIC_INFO basic_info;
+    bool r;
+
+    memset(stamp, 0, sizeof(s_fstamp));
+    file = CreateFileA(filename, FILE_READ_ATTRIBUTES, FILE_SHARE_READ|FILE_SHARE_WRITE, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    r = GetFileInformationByHandle(file, &info);
+    if (r)
+    {
+        stamp->size = (((u64)info.nFileSizeHigh)<<32) | info.nFileSizeLow;
+        stamp->mtime = (((u64)info.ftLastWriteTime.dwHighDateTime)<<32) |
+            info.ftLastWriteTime.dwLowDateTime;
+        stamp->inode = (((u64)info.nFileIndexHigh)<<32) | info.nFileIndexLow;
+        // Unlike the last write time, the change time cannot be set through SetFileTime()
+        if (GetFileInformationByHandleEx(file, FileBasicInfo, &basic_info, sizeof(basic_info)))
+            stamp->ctime = (u64)basic_info.ChangeTime.QuadPart;
+    }
+    CloseHandle(file);
+    return r;
+#elif defined(PSP)
+    SceIoStat st;
+
+    memset(stamp, 0, sizeof(s_fstamp));
+    if (sceIoGetstat(filename, &st) < 0)
+        return false;
+    stamp->size = (u64)st.st_size;
+    sceRtcGetTick((pspTime*)&st.st_mtime, &stamp->mtime);
+    return true;
+#else
+    struct stat st;
+
+    memset(stamp, 0, sizeof(s_fstamp));
+    if (stat(filename, &st) != 0)
+        return false;
+    stamp->size = (u64)st.st_size;
+    stamp->mtime = (u64)st.st_mtime;
+    // The change time is updated by any write or utime(), and cannot be set back
+    stamp->ctime = (u64)st.st_ctime;
+    stamp->inode = (u64)st.st_ino;
+    return true;
+#endif
+}
+
+// Save a w x h RGB image as a binary PPM, top row first
+bool write_ppm(const char* filename, u16 w, u16 h, const u8* rgb)
+{
+    FILE* f;
+    bool r;
+
+    if ((f = fopen(filename, "wb")) == NULL)
+    {
+        perr("Can't create '%s'\n", filename);
+        return false;
+    }
+    fprintf(f, "P6\n%d %d\n255\n", w, h);
+    r = (fwrite(rgb, 3*w, h, f) == h);
+    if ((fclose(f) != 0) || (!r))
+    {
+        perr("Error writing '%s'\n", filename);
+        return false;
+    }
+    return true;
+}
+
 u32 get_bits(u32 n)
 {
     u32 result = 0;
@@ -365,13 +639,131 @@ u32 get_bits(u32 n)
 }
 
 /*
- * PowerPacker decruncher functions, from 'amigadepacker' by Heikki Orsila
+ * PowerPacker decruncher functions, based on 'amigadepacker' by Heikki Orsila
+ *
+ * Like Bytekiller, PP20 is read backwards with bitstreams in reverse order. We use a
+ * 64 bit buffer that we top up whenever it runs low, and a table to reverse the bits
  */
 
+static u8 pp_reverse[256];
+
+// Reverse the order of the nb (<= 32) lower bits of v
+static __inline u32 pp_reverse_bits(u32 v, u8 nb)
+{
+    if (nb == 0)
+        return 0;
+    if (nb <= 8)
+        return pp_reverse[v] >> (8-nb);
+    v = ((u32)pp_reverse[v&0xFF]<<24) | ((u32)pp_reverse[(v>>8)&0xFF]<<16) |
+        ((u32)pp_reverse[(v>>16)&0xFF]<<8) | (u32)pp_reverse[(v>>24)&0xFF];
+    return v >> (32-nb);
+}
+
+#define PP_FILL_BITS(nbits) do {                               \
+  if (bits_left < (nbits)) {                                   \
+    while ((bits_left <= 56) && (buf_src > src)) {             \
+      bit_buffer |= ((u64)*--buf_src) << bits_left;            \
+      bits_left += 8;                                          \
+    }                                                          \
+    if (bits_left < (nbits)) return 0; /* out of source bits */\
+  }                                                            \
+} while(0)
+
+#define PP_GET_BITS(nbits, var) do {                           \
+  PP_FILL_BITS(nbits);                                         \
+  (var) = pp_reverse_bits((u32)bit_buffer &                    \
+    (u32)((((u64)1)<<(nbits))-1), (nbits));                    \
+  bit_buffer >>= (nbits);                                      \
+  bits_left -= (nbits);                                        \
+} while(0)
+
+int ppDecrunch(u8 *src, u8 *dest, u8 *offset_lens, u32 src_len, u32 dest_len, u8 skip_bits)
+{
+    u8 *buf_src, *out, *dest_end;
+    u64 bit_buffer = 0;
+    u8 bits_left = 0, offbits;
+    u32 i, x, todo, offset;
+
+    if (src == NULL || dest == NULL || offset_lens == NULL) return 0;
+
+    if (pp_reverse[0x01] == 0)
+    {	// Initialize our bit reversal table
+        for (i=0; i<256; i++)
+            for (x=0; x<8; x++)
+                if (i & (1<<x))
+                    pp_reverse[i] |= 0x80>>x;
+    }
+
+    // set up input and output pointers
+    buf_src = src + src_len;
+    out = dest_end = dest + dest_len;
+
+    // skip the first few bits
+    PP_GET_BITS(skip_bits, x);
+
+    // while there are input bits left
+    while (out > dest)
+    {
+        PP_GET_BITS(1, x);
+        if (x == 0)
+        {	// 1bit==0: literal, then match. 1bit==1: just match
+            todo = 1;
+            do { PP_GET_BITS(2, x); todo += x; } while (x == 3);
+            for (; todo != 0; todo--)
+            {
+                PP_FILL_BITS(8);
+                if (out <= dest) return 0; // output overflow
+                *--out = pp_reverse[bit_buffer & 0xFF];
+                bit_buffer >>= 8;
+                bits_left -= 8;
+            }
+
+            // should we end decoding on a literal, break out of the main loop
+            if (out == dest) break;
+        }
+
+        // match: read 2 bits for initial offset bitlength / match length
+        PP_GET_BITS(2, x);
+        offbits = offset_lens[x];
+        if (offbits > 32) return 0; // invalid offset length
+        todo = x+2;
+        if (x == 3)
+        {
+            PP_GET_BITS(1, x);
+            if (x == 0) offbits = 7;
+            PP_GET_BITS(offbits, offset);
+            do { PP_GET_BITS(3, x); todo += x; } while (x == 7);
+        }
+        else
+            PP_GET_BITS(offbits, offset);
+        if (offset >= (u32)(dest_end - out)) return 0; // match overflow
+
+        if ((todo <= (u32)(out - dest)) && (offset+1 >= todo))
+        {	// No overlap, no overflow => bulk copy
+            out -= todo;
+            memcpy(out, out+offset+1, todo);
+        }
+        else for (; todo != 0; todo--)
+        {
+            if (out <= dest) return 0; // output overflow
+            x = out[offset];
+            *--out = (u8)x;
+        }
+    }
+
+    // all output bytes written without error
+    return 1;
+}
+
+
+#if defined(DEBUG_ENABLED)
+/*
+ * The original byte by byte PowerPacker decruncher, that we keep as a reference
+ */
 #define PP_READ_BITS(nbits, var) do {                          \
   bit_cnt = (nbits);                                           \
   while (bits_left < bit_cnt) {                                \
-    if (buf_src < src) return 0; /* out of source bits */      \
+    if (buf_src <= src) return 0; /* out of source bits */     \
     bit_buffer |= (*--buf_src << bits_left);                   \
     bits_left += 8;                                            \
   }                                                            \
@@ -390,7 +782,7 @@ u32 get_bits(u32 n)
 } while (0)
 
 
-int ppDecrunch(u8 *src, u8 *dest, u8 *offset_lens, u32 src_len, u32 dest_len, u8 skip_bits)
+static int ppDecrunch_reference(u8 *src, u8 *dest, u8 *offset_lens, u32 src_len, u32 dest_len, u8 skip_bits)
 {
   u8 *buf_src, *out, *dest_end, bits_left = 0, bit_cnt;
   u32 bit_buffer = 0, x, todo, offbits, offset, written=0;
@@ -437,3 +829,371 @@ int ppDecrunch(u8 *src, u8 *dest, u8 *offset_lens, u32 src_len, u32 dest_len, u8
   return 1;
   /* return (src == buf_src) ? 1 : 0; */
 }
+
+// Compare ppDecrunch() against the reference decruncher, on LOADTUNE.MUS
+// as well as nb_iterations fuzzed versions of it
+void ppDecrunch_stress_test(u32 nb_iterations)
+{
+    FILE* f;
+    u8  *ppbuffer = NULL, *fuzzed = NULL, *dest1 = NULL, *dest2 = NULL;
+    u8  offset_lens[4], skip_bits;
+    u32 length, src_len, dest_len, i, j, nb_failures = 0;
+    int r1, r2;
+    u64 t1, t2;
+
+    if ((f = fopen(PP_LOADTUNE_NAME, "rb")) == NULL)
+    {
+        perr("Couldn't find file '%s'\n", PP_LOADTUNE_NAME);
+        return;
+    }
+    ppbuffer = (u8*) malloc(PP_LOADTUNE_SIZE);
+    fuzzed = (u8*) malloc(PP_LOADTUNE_SIZE);
+    i = (ppbuffer == NULL)?0:fread(ppbuffer, 1, PP_LOADTUNE_SIZE, f);
+    fclose(f);
+    if ((fuzzed == NULL) || (i != PP_LOADTUNE_SIZE))
+    {
+        perr("'%s': Unexpected file size or read error\n", PP_LOADTUNE_NAME);
+        goto out;
+    }
+    length = read24(ppbuffer, PP_LOADTUNE_SIZE-4);
+    dest1 = (u8*) malloc(length);
+    dest2 = (u8*) malloc(length);
+    if ((dest1 == NULL) || (dest2 == NULL))
+        goto out;
+
+    // Straight decrunch
+    t1 = mtime();
+    r1 = ppDecrunch_reference(&ppbuffer[8], dest1, &ppbuffer[4], PP_LOADTUNE_SIZE-12, length,
+        ppbuffer[PP_LOADTUNE_SIZE-1]);
+    t1 = mtime() - t1;
+    t2 = mtime();
+    r2 = ppDecrunch(&ppbuffer[8], dest2, &ppbuffer[4], PP_LOADTUNE_SIZE-12, length,
+        ppbuffer[PP_LOADTUNE_SIZE-1]);
+    t2 = mtime() - t2;
+    printf("'%s': reference = %d (%d ms), ppDecrunch = %d (%d ms) => %s\n", PP_LOADTUNE_NAME,
+        r1, (int)t1, r2, (int)t2, ((r1 == r2) && (memcmp(dest1, dest2, length) == 0))?"OK":"MISMATCH");
+
+    // Now the fuzzed ones: random bits flipped in the stream, as well as random offset
+    // lengths, skip bits, and truncated source and destination
+    srand(0xC01D172);
+    for (i=0; i<nb_iterations; i++)
+    {
+        memcpy(fuzzed, ppbuffer, PP_LOADTUNE_SIZE);
+        for (j=rand()%16; j!=0; j--)
+            fuzzed[8+rand()%(PP_LOADTUNE_SIZE-12)] ^= 1<<(rand()%8);
+        memcpy(offset_lens, &ppbuffer[4], 4);
+        if ((rand()%4) == 0)
+            for (j=0; j<4; j++)
+                offset_lens[j] = 1+rand()%16;
+        skip_bits = ppbuffer[PP_LOADTUNE_SIZE-1];
+        if ((rand()%4) == 0)
+            skip_bits = rand()%8;
+        src_len = PP_LOADTUNE_SIZE-12;
+        if ((rand()%4) == 0)
+            src_len = rand()%src_len;
+        dest_len = length;
+        if ((rand()%4) == 0)
+            dest_len = rand()%dest_len;
+
+        memset(dest1, 0x55, length);
+        memset(dest2, 0x55, length);
+        r1 = ppDecrunch_reference(&fuzzed[8], dest1, offset_lens, src_len, dest_len, skip_bits);
+        r2 = ppDecrunch(&fuzzed[8], dest2, offset_lens, src_len, dest_len, skip_bits);
+        if ((r1 != r2) || (memcmp(dest1, dest2, length) != 0))
+        {
+            printf("  fuzzed input #%d: MISMATCH\n", (int)i);
+            nb_failures++;
+        }
+    }
+    printf("%d fuzzed inputs tested => %d mismatch(es)\n", (int)nb_iterations, (int)nb_failures);
+
+out:
+    SFREE(ppbuffer);
+    SFREE(fuzzed);
+    SFREE(dest1);
+    SFREE(dest2);
+}
+#endif
+
+
+/*
+ * Planar to chunky conversion of Amiga bitplanes to 16 bit palette values
+ * The SIMD kernels build the palette indexes of 16 (or 32) pixels at once, by
+ * testing each bit of the bitplane bytes broadcasted over the pixel lanes, and
+ * look the colours up with a byte shuffle. The scalar kernel is the fallback.
+ */
+
+// c2p_spread[b] has bit 7-k of b in the low bit of byte k, for pixel k
+#define C2P_S(b)	( ((u64)(((b)>>7)&1))     | ((u64)(((b)>>6)&1)<<8)  |	\
+					  ((u64)(((b)>>5)&1)<<16) | ((u64)(((b)>>4)&1)<<24) |	\
+					  ((u64)(((b)>>3)&1)<<32) | ((u64)(((b)>>2)&1)<<40) |	\
+					  ((u64)(((b)>>1)&1)<<48) | ((u64)((b)&1)<<56) )
+#define C2P_S4(b)	C2P_S(b), C2P_S((b)+1), C2P_S((b)+2), C2P_S((b)+3)
+#define C2P_S16(b)	C2P_S4(b), C2P_S4((b)+4), C2P_S4((b)+8), C2P_S4((b)+12)
+#define C2P_S64(b)	C2P_S16(b), C2P_S16((b)+16), C2P_S16((b)+32), C2P_S16((b)+48)
+static const u64 c2p_spread[256] = { C2P_S64(0), C2P_S64(64), C2P_S64(128), C2P_S64(192) };
+
+// Convert nb_bytes*8 pixels from bpp bitplanes (plane[0] being the least significant)
+// to big endian 16 bit palette values. If mask is not NULL, the pixels with a clear
+// mask bit get a zero alpha (GRAB)
+void c2p_wGRAB_scalar(const u8* const* plane, u8 bpp, const u8* mask, u32 nb_bytes,
+                      const u16* palette, u8* dest)
+{
+    u32 i, k;
+    u64 index;
+    u16 colour;
+
+    for (i=0; i<nb_bytes; i++)
+    {
+        index = 0;
+        for (k=0; k<bpp; k++)
+            index |= c2p_spread[plane[k][i]] << k;
+        for (k=0; k<8; k++)
+        {
+            colour = palette[(u8)(index >> (8*k))];
+            if ((mask != NULL) && (!(mask[i] & (0x80>>k))))
+                colour &= 0xFF0F;
+            dest[0] = (u8)(colour>>8);
+            dest[1] = (u8)colour;
+            dest += 2;
+        }
+    }
+}
+
+#if defined(C2P_SSE2)
+// Pixel lane k tests bit 7-(k%8)
+#define C2P_BIT_SELECT	0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01
+
+// Broadcast byte 0 of v over lanes 0-7 and byte 1 over lanes 8-15
+static __inline __m128i c2p_broadcast_sse2(__m128i v)
+{
+    v = _mm_unpacklo_epi8(v, v);
+    v = _mm_unpacklo_epi16(v, v);
+    return _mm_unpacklo_epi32(v, v);
+}
+
+// Palette indexes of the 16 pixels from bytes i and i+1 of the planes
+static __inline __m128i c2p_index_sse2(const u8* const* plane, u8 bpp, u32 i)
+{
+    const __m128i select = _mm_setr_epi8(C2P_BIT_SELECT, C2P_BIT_SELECT);
+    __m128i index = _mm_setzero_si128();
+    __m128i bits;
+    u32 k;
+
+    for (k=0; k<bpp; k++)
+    {
+        bits = c2p_broadcast_sse2(_mm_cvtsi32_si128(plane[k][i] | (plane[k][i+1]<<8)));
+        bits = _mm_cmpeq_epi8(_mm_and_si128(bits, select), select);
+        index = _mm_or_si128(index, _mm_and_si128(bits, _mm_set1_epi8((char)(1<<k))));
+    }
+    return index;
+}
+
+// 0xFF for the pixels with a set mask bit, from bytes i and i+1 of the mask
+static __inline __m128i c2p_mask_sse2(const u8* mask, u32 i)
+{
+    const __m128i select = _mm_setr_epi8(C2P_BIT_SELECT, C2P_BIT_SELECT);
+    __m128i bits = c2p_broadcast_sse2(_mm_cvtsi32_si128(mask[i] | (mask[i+1]<<8)));
+    return _mm_cmpeq_epi8(_mm_and_si128(bits, select), select);
+}
+#endif
+
+// SIMD kernel, for up to 16 colours. Returns the number of bytes (of each plane) it
+// processed, the rest being left to the scalar kernel
+static u32 c2p_wGRAB_simd(const u8* const* plane, u8 bpp, const u8* mask, u32 nb_bytes,
+                          const u16* palette, u8* dest)
+{
+    u32 i = 0;
+#if defined(C2P_SSE2)
+    __m128i index;
+#if defined(C2P_SSSE3)
+    u8  pal_lo[16], pal_hi[16];
+    __m128i palette_lo, palette_hi, lo, hi;
+#else
+    u8  idx[16];
+    u16 colour;
+    u32 k;
+#endif
+#if defined(C2P_AVX2)
+    const __m256i select = _mm256_setr_epi8(C2P_BIT_SELECT, C2P_BIT_SELECT, C2P_BIT_SELECT, C2P_BIT_SELECT);
+    // Lane 0 broadcasts bytes 0 and 1, lane 1 bytes 2 and 3
+    const __m256i spread = _mm256_setr_epi8(0,0,0,0,0,0,0,0, 1,1,1,1,1,1,1,1,
+                                            2,2,2,2,2,2,2,2, 3,3,3,3,3,3,3,3);
+    __m256i index256, bits256, lo256, hi256, palette_lo256, palette_hi256;
+    u32 k256;
+#endif
+
+#if defined(C2P_SSSE3)
+    for (i=0; i<16; i++)
+    {
+        pal_lo[i] = (i < (1u<<bpp))?(u8)palette[i]:0;
+        pal_hi[i] = (i < (1u<<bpp))?(u8)(palette[i]>>8):0;
+    }
+    i = 0;
+    palette_lo = _mm_loadu_si128((const __m128i*)pal_lo);
+    palette_hi = _mm_loadu_si128((const __m128i*)pal_hi);
+#endif
+
+#if defined(C2P_AVX2)
+    // 32 pixels at once, which is a whole cell line
+    palette_lo256 = _mm256_broadcastsi128_si256(palette_lo);
+    palette_hi256 = _mm256_broadcastsi128_si256(palette_hi);
+    for (; i+4<=nb_bytes; i+=4)
+    {
+        index256 = _mm256_setzero_si256();
+        for (k256=0; k256<bpp; k256++)
+        {
+            bits256 = _mm256_set1_epi32((int)(plane[k256][i] | (plane[k256][i+1]<<8) |
+                (plane[k256][i+2]<<16) | ((u32)plane[k256][i+3]<<24)));
+            bits256 = _mm256_shuffle_epi8(bits256, spread);
+            bits256 = _mm256_cmpeq_epi8(_mm256_and_si256(bits256, select), select);
+            index256 = _mm256_or_si256(index256, _mm256_and_si256(bits256, _mm256_set1_epi8((char)(1<<k256))));
+        }
+        lo256 = _mm256_shuffle_epi8(palette_lo256, index256);
+        hi256 = _mm256_shuffle_epi8(palette_hi256, index256);
+        if (mask != NULL)
+        {
+            bits256 = _mm256_set1_epi32((int)(mask[i] | (mask[i+1]<<8) | (mask[i+2]<<16) | ((u32)mask[i+3]<<24)));
+            bits256 = _mm256_shuffle_epi8(bits256, spread);
+            bits256 = _mm256_cmpeq_epi8(_mm256_and_si256(bits256, select), select);
+            lo256 = _mm256_and_si256(lo256, _mm256_or_si256(bits256, _mm256_set1_epi8(0x0F)));
+        }
+        // Interleaving is done per 128 bit lane, so we need to swap the middle quarters
+        index256 = _mm256_unpacklo_epi8(hi256, lo256);	// pixels 0-7 and 16-23
+        bits256  = _mm256_unpackhi_epi8(hi256, lo256);	// pixels 8-15 and 24-31
+        _mm256_storeu_si256((__m256i*)(dest+16*i),    _mm256_permute2x128_si256(index256, bits256, 0x20));
+        _mm256_storeu_si256((__m256i*)(dest+16*i+32), _mm256_permute2x128_si256(index256, bits256, 0x31));
+    }
+#endif
+
+    for (; i+2<=nb_bytes; i+=2)
+    {
+        index = c2p_index_sse2(plane, bpp, i);
+#if defined(C2P_SSSE3)
+        lo = _mm_shuffle_epi8(palette_lo, index);
+        hi = _mm_shuffle_epi8(palette_hi, index);
+        if (mask != NULL)
+            lo = _mm_and_si128(lo, _mm_or_si128(c2p_mask_sse2(mask, i), _mm_set1_epi8(0x0F)));
+        // Interleave => big endian 16 bit values
+        _mm_storeu_si128((__m128i*)(dest+16*i),    _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i*)(dest+16*i+16), _mm_unpackhi_epi8(hi, lo));
+#else
+        // No byte shuffle in SSE2 => look the colours up one by one
+        _mm_storeu_si128((__m128i*)idx, index);
+        for (k=0; k<16; k++)
+        {
+            colour = palette[idx[k]];
+            if ((mask != NULL) && (!(mask[i+k/8] & (0x80>>(k%8)))))
+                colour &= 0xFF0F;
+            dest[16*i+2*k]   = (u8)(colour>>8);
+            dest[16*i+2*k+1] = (u8)colour;
+        }
+#endif
+    }
+
+#elif defined(C2P_NEON)
+    static const u8 bit_select[16] = { 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+                                       0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01 };
+    u8  pal_lo[16], pal_hi[16];
+    u32 k;
+    uint8x16_t select = vld1q_u8(bit_select);
+    uint8x16_t index, bits;
+    uint8x16x2_t colour;
+#if defined(__aarch64__)
+    uint8x16_t palette_lo, palette_hi;
+#else
+    uint8x8x2_t palette_lo, palette_hi;
+#endif
+
+    for (i=0; i<16; i++)
+    {
+        pal_lo[i] = (i < (1u<<bpp))?(u8)palette[i]:0;
+        pal_hi[i] = (i < (1u<<bpp))?(u8)(palette[i]>>8):0;
+    }
+#if defined(__aarch64__)
+    palette_lo = vld1q_u8(pal_lo);
+    palette_hi = vld1q_u8(pal_hi);
+#else
+    palette_lo.val[0] = vld1_u8(pal_lo);
+    palette_lo.val[1] = vld1_u8(pal_lo+8);
+    palette_hi.val[0] = vld1_u8(pal_hi);
+    palette_hi.val[1] = vld1_u8(pal_hi+8);
+#endif
+
+    for (i=0; i+2<=nb_bytes; i+=2)
+    {
+        index = vdupq_n_u8(0);
+        for (k=0; k<bpp; k++)
+        {
+            bits = vcombine_u8(vdup_n_u8(plane[k][i]), vdup_n_u8(plane[k][i+1]));
+            index = vorrq_u8(index, vandq_u8(vtstq_u8(bits, select), vdupq_n_u8((u8)(1<<k))));
+        }
+#if defined(__aarch64__)
+        colour.val[0] = vqtbl1q_u8(palette_hi, index);
+        colour.val[1] = vqtbl1q_u8(palette_lo, index);
+#else
+        colour.val[0] = vcombine_u8(vtbl2_u8(palette_hi, vget_low_u8(index)), vtbl2_u8(palette_hi, vget_high_u8(index)));
+        colour.val[1] = vcombine_u8(vtbl2_u8(palette_lo, vget_low_u8(index)), vtbl2_u8(palette_lo, vget_high_u8(index)));
+#endif
+        if (mask != NULL)
+        {
+            bits = vtstq_u8(vcombine_u8(vdup_n_u8(mask[i]), vdup_n_u8(mask[i+1])), select);
+            colour.val[1] = vandq_u8(colour.val[1], vorrq_u8(bits, vdupq_n_u8(0x0F)));
+        }
+        // Interleaved store => big endian 16 bit values
+        vst2q_u8(dest+16*i, colour);
+    }
+#endif
+    return i;
+}
+
+// Planar to chunky, with the best kernel we have
+void c2p_wGRAB(const u8* const* plane, u8 bpp, const u8* mask, u32 nb_bytes,
+               const u16* palette, u8* dest)
+{
+    const u8* p[8];
+    u32 i = 0, k;
+
+    if (bpp <= 4)
+        i = c2p_wGRAB_simd(plane, bpp, mask, nb_bytes, palette, dest);
+    if (i == nb_bytes)
+        return;
+    for (k=0; k<bpp; k++)
+        p[k] = plane[k] + i;
+    c2p_wGRAB_scalar(p, bpp, (mask != NULL)?mask+i:NULL, nb_bytes-i, palette, dest+16*i);
+}
+
+// Planar to chunky, to 8 bit palette indexes, for when the palette is applied by the GPU
+// If mask is not NULL, C2P_TRANSPARENT is added to the pixels with a clear mask bit
+void c2p_index(const u8* const* plane, u8 bpp, const u8* mask, u32 nb_bytes, u8* dest)
+{
+    u32 i, k;
+    u64 index;
+
+    for (i=0; i<nb_bytes; i++)
+    {
+        index = 0;
+        for (k=0; k<bpp; k++)
+            index |= c2p_spread[plane[k][i]] << k;
+        if (mask != NULL)
+            index |= c2p_spread[(u8)~mask[i]] << 4;
+        for (k=0; k<8; k++)
+            *dest++ = (u8)(index >> (8*k));
+    }
+}
+
+// Name of the kernel used by c2p_wGRAB
+const char* c2p_kernel_name()
+{
+#if defined(C2P_AVX2)
+    return "AVX2";
+#elif defined(C2P_SSSE3)
+    return "SSSE3";
+#elif defined(C2P_SSE2)
+    return "SSE2";
+#elif defined(C2P_NEON)
+    return "NEON";
+#else
+    return "scalar";
+#endif
+}
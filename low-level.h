@@ -59,6 +59,31 @@ static __inline u64 mtime(void)
 #define NULL_FD fopen("/dev/null", "w")
 #endif
 
+// Memory mapped (copy-on-write) file
+// On PSP, where there's no such thing, this is a plain old buffer
+typedef struct
+{
+	u8*			address;
+	size_t		size;
+#if defined(WIN32)
+	HANDLE		file;
+	HANDLE		mapping;
+#elif defined(PSP)
+	const char*	filename;
+#else
+	int			fdesc;
+#endif
+} s_mmap;
+
+// What we use to tell if a file was modified, without having to read it
+typedef struct
+{
+	u64			size;
+	u64			mtime;
+	u64			ctime;		// status change time, where available
+	u64			inode;		// or file index on Windows
+} s_fstamp;
+
 // On Windows and PSP, exiting the application will automatically free allocated memory blocks
 // so we don't bother freeing any buffers here
 #if defined(WIN32)
@@ -105,6 +130,9 @@ static __inline void psp_any_key()
 #define printb(...)		if(opt_debug) print(__VA_ARGS__)
 #define perrb(...)		if(opt_debug) perr(__VA_ARGS__)
 
+// Flag added by c2p_index() to the palette index of masked out pixels
+#define C2P_TRANSPARENT	0x10
+
 // size of an array
 #define SIZE_A(ar)		(sizeof(ar)/sizeof(ar[0]))
 
@@ -211,11 +239,25 @@ static __inline int count_bits(u32 n)
 
 // Prototypes
 u16 powerize(u16 n);
-int uncompress(u32 expected_size);
+int uncompress(u8* src, u32 src_len, u8* dest, u32 dest_len);
 void *aligned_malloc(size_t bytes, size_t alignment);
 void aligned_free(void *ptr);
+bool mmap_open(const char* filename, size_t size, s_mmap* map);
+void mmap_close(s_mmap* map);
+bool get_fstamp(const char* filename, s_fstamp* stamp);
+bool write_ppm(const char* filename, u16 w, u16 h, const u8* rgb);
 const char *to_binary(u32 x);
 int ppDecrunch(u8 *src, u8 *dest, u8 *offset_lens, u32 src_len, u32 dest_len, u8 skip_bits);
+void c2p_wGRAB(const u8* const* plane, u8 bpp, const u8* mask, u32 nb_bytes,
+               const u16* palette, u8* dest);
+void c2p_wGRAB_scalar(const u8* const* plane, u8 bpp, const u8* mask, u32 nb_bytes,
+                      const u16* palette, u8* dest);
+const char* c2p_kernel_name();
+void c2p_index(const u8* const* plane, u8 bpp, const u8* mask, u32 nb_bytes, u8* dest);
+#if defined(DEBUG_ENABLED)
+void uncompress_benchmark(const char* filename, u32 nb_iterations);
+void ppDecrunch_stress_test(u32 nb_iterations);
+#endif
 
 #ifdef	__cplusplus
 }
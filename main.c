@@ -73,6 +73,10 @@
 #include "eschew/eschew.h"
 #include "conf.h"
 #include "anti-tampering.h"
+#include "tasks.h"
+#include "pack.h"
+#include "soft-render.h"
+#include "scaler.h"
 
 // Global variables
 
@@ -99,6 +103,8 @@ bool opt_play_as_the_safe[NB_NATIONS]
 bool opt_meh					= false;
 // Use half size (i.e. original) resolution on Windows
 bool opt_halfsize				= false;
+// Number of worker threads for startup (-1 => one per extra CPU)
+int opt_nb_workers				= -1;
 // Who needs keys?
 bool opt_keymaster				= false;
 // "'coz this is triller!..."
@@ -125,6 +131,18 @@ float fade_value				= 1.0f;
 bool fade_out					= false;
 // Save config.xml?
 bool config_save				= false;
+// Render to an FBO, with the window hidden
+static bool opt_offscreen		= false;
+// Save the frames as <prefix>#####.ppm, as read back from the renderer
+static char* opt_frame_prefix	= NULL;
+static u32 nb_frames_saved		= 0;
+// CPU scaler for the displayed frames on Windows, when the GLSL zoom is not used,
+// or for the saved frames, with the software renderer
+int opt_scaler					= -1;
+#if defined(DEBUG_ENABLED)
+// Renderers benchmark, on the first game frame
+static u32 opt_render_benchmark	= 0;
+#endif
 // Is the GPU recent enough to support GLSL shaders (for HQ2X)
 bool opt_glsl_enabled			= false;
 // Prevents double consumption of keys while opening a door
@@ -133,19 +151,26 @@ bool can_consume_key			= true;
 
 // We'll need this to retrieve our glutIdle function after a suspended state
 // (but make sure we don't change idle if already suspended, which can happen on PSP printf)
-#define glutIdleFunc_save(f) {if (!game_suspended) glutIdleFunc(f); restore_idle = f;}
+#define glutIdleFunc_save(f) {if (!game_suspended) set_idle(f); restore_idle = f;}
+// Without GL, there's no GLUT main loop to call it for us
+static void (*idle_func)(void) = NULL;
+// Only set if we have a GLUT window, and thus the GLUT event loop
+static bool windowed = false;
 
 // File stuff
 FILE* fd					= NULL;
 char* fname[NB_FILES]		= FNAMES;			// file name(s)
 u32   fsize[NB_FILES]		= FSIZES;
 u8*   fbuffer[NB_FILES];
+u8    fhash[NB_FILES][16];						// MD5 of the loaded files
 u8*	  rbuffer				= NULL;
 u8*   mbuffer				= NULL;
 u8*	  rgbCells				= NULL;
 u8*   static_image_buffer   = NULL;
 s_tex texture[NB_TEXTURES]	= TEXTURES;
 char* mod_name[NB_MODS]		= MOD_NAMES;
+u8*   loadtune_buffer		= NULL;				// In-memory LOADTUNE, when depacked
+size_t loadtune_size		= 0;
 const char confname[]		= "config.xml";
 #if defined(ANTI_TAMPERING_ENABLED)
 const u8 fmd5hash[NB_FILES][16] = FMD5HASHES;
@@ -282,12 +307,12 @@ void update_timers()
     delta_t = t - t_last;
     t_last = t;
 
-    if (delta_t > 1000)
+    if (delta_t > MAX_CATCHUP_TIME)
     {
         // We probably gone out of a suspended state from the PSP or PC
-        // Don't screw up our game timers then
-        delta_t = 0;
-        printv("update_timers: more than one second elapsed since last time update\n");
+        // Don't have the simulation race to catch up then
+        printv("update_timers: %d ms elapsed since last time update\n", (int)delta_t);
+        delta_t = MAX_CATCHUP_TIME;
     }
 
     program_time += delta_t;
@@ -300,14 +325,18 @@ void update_timers()
 /*
  *	GLUT event handlers
  */
-static void glut_init()
+static void set_idle(void (*func)(void))
 {
-    // Use Glut to create a window
-    glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_ALPHA);
-    glutInitWindowSize(gl_width, gl_height);
-    glutInitWindowPosition(0, 0);
-    glutCreateWindow(APPNAME);
+    idle_func = func;
+    // We don't know what was displayed before
+    display_dirty = DIRTY_ALL;
+    if (windowed)
+        glutIdleFunc(func);
+}
 
+// The GL states we rely on, whatever created the context
+static void gl_init_state()
+{
     glShadeModel(GL_SMOOTH);		// set by default
 
     glMatrixMode(GL_PROJECTION);
@@ -326,6 +355,23 @@ static void glut_init()
     // Disable depth
     glDisable(GL_DEPTH_TEST);
     glEnable(GL_TEXTURE_2D);
+}
+
+static void glut_init()
+{
+    // Use Glut to create a window
+    glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_ALPHA);
+    glutInitWindowSize(gl_width, gl_height);
+    glutInitWindowPosition(0, 0);
+    glutCreateWindow(APPNAME);
+#if !defined(PSP)
+    // Offscreen rendering still needs a window for its GL context
+    if (opt_offscreen)
+        glutHideWindow();
+#endif
+    windowed = true;
+
+    gl_init_state();
 
     // Clear both buffers (this is needed on PSP)
     glClear(GL_COLOR_BUFFER_BIT);
@@ -351,14 +397,24 @@ static void glut_display(void)
     static u64  nb_frames = 0;
     static u64	lptime = 0;
     static u64	ptime = 0;
+    char frame_name[256];
+    u8*  rgb;
+    u16  w, h;
 
     // Don't mess with our video buffer if we're suspended and diplay()
     // is called, as we may have debug printf (PSP) or video onscreen
     if (game_suspended)
         return;
 
-    // Always start with a clear to black
-    glClear(GL_COLOR_BUFFER_BIT);
+    // What we're about to build is up to date
+    display_dirty = 0;
+
+    // Keep the pause screen views up to date while playing
+    if ( (!(game_state & GAME_STATE_STATIC_PIC)) && (!menu) )
+        update_pause_screen();
+
+    // Queue the whole frame, so that we can tell if it changed
+    frame_begin();
 
     // Display either the current game frame or a static picture
     if ((game_state & GAME_STATE_STATIC_PIC) && (!menu))
@@ -401,12 +457,46 @@ static void glut_display(void)
         }
     }
 
-#if defined (WIN32)
-    // Rescale the screen on Windows
-    rescale_buffer();
+    // Nothing changed => no need to draw or swap anything
+    if (!frame_end())
+        return;
+
+    renderer->present();
+
+    if (opt_frame_prefix != NULL)
+    {
+        if (opt_scaler >= 0)
+            rgb = scale_read_frame((u8)opt_scaler, soft_framebuffer(), PSP_SCR_WIDTH, PSP_SCR_HEIGHT,
+                (opt_nb_workers>=0)?(u32)opt_nb_workers:nb_cpus()-1, &w, &h);
+        else
+            rgb = renderer->read_frame(&w, &h);
+        if (rgb != NULL)
+        {
+            sprintf(frame_name, "%s%05d.ppm", opt_frame_prefix, (int)nb_frames_saved++);
+            write_ppm(frame_name, w, h, rgb);
+            free(rgb);
+        }
+    }
+#if defined(DEBUG_ENABLED)
+    if ((opt_render_benchmark) && (!(game_state & GAME_STATE_STATIC_PIC)))
+    {
+        renderer_benchmark(opt_render_benchmark);
+        // The software renderer always gets the frame, either as the renderer or the mirror
+        scale_benchmark(soft_framebuffer(), PSP_SCR_WIDTH, PSP_SCR_HEIGHT, opt_render_benchmark,
+            (opt_nb_workers>=0)?(u32)opt_nb_workers:nb_cpus()-1);
+        LEAVE;
+    }
 #endif
+}
 
-    glutSwapBuffers();
+// Hidden windows don't get their display callback called, and without GL there's
+// no window at all, so we do it ourselves
+static void redisplay()
+{
+    if ((opt_offscreen) || (!windowed))
+        glut_display();
+    else
+        glutPostRedisplay();
 }
 
 //
@@ -414,8 +504,12 @@ static void glut_reshape (int w, int h)
 {
 //	u32 gl_crop_width, gl_crop_height;
 
+    // The offscreen FBO keeps its size
+    if (opt_offscreen)
+        return;
     gl_width=w;
     gl_height=h;
+    frame_invalidate();
 
 //	gl_crop_width = (32.0f * gl_width/PSP_SCR_WIDTH);
 //	gl_crop_height = (16.0f * gl_height/PSP_SCR_HEIGHT);
@@ -798,7 +892,7 @@ void user_input()
                     prop_offset = room_props[over_prop-1];
                     room_props[over_prop-1] = 0;
                     // change the room index to an invalid one
-                    writeword(fbuffer[OBJECTS],prop_offset,ROOM_NO_PROP);
+                    writeword_dirty(OBJECTS,prop_offset,ROOM_NO_PROP);
                     props[current_nation][over_prop_id]++;
                     selected_prop[current_nation] = over_prop_id;
                     show_prop_count();
@@ -821,12 +915,12 @@ void user_input()
                             nb_room_props++;
                             // Write down the relevant value in obs.bin
                             // 1. Room number
-                            writeword(fbuffer[OBJECTS],prop_offset,current_room_index);
+                            writeword_dirty(OBJECTS,prop_offset,current_room_index);
                             // 2. x & y pos
-                            writeword(fbuffer[OBJECTS],prop_offset+4, prisoner_x + 16);
-                            writeword(fbuffer[OBJECTS],prop_offset+2, prisoner_2y/2 + 4);
+                            writeword_dirty(OBJECTS,prop_offset+4, prisoner_x + 16);
+                            writeword_dirty(OBJECTS,prop_offset+2, prisoner_2y/2 + 4);
                             // 3. object id
-                            writeword(fbuffer[OBJECTS],prop_offset+6, over_prop_id);
+                            writeword_dirty(OBJECTS,prop_offset+6, over_prop_id);
                             found = true;
                             break;
                         }
@@ -881,7 +975,8 @@ void user_input()
     // Hey, GLUT, where's my bleeping callback on Windows?
     // NB: The routine is not called if there's no joystick
     //     and the force func does not exist on PSP
-    glutForceJoystickFunc();
+    if (windowed)
+        glutForceJoystickFunc();
 #endif
 
     // Joystick motion overrides keys
@@ -901,9 +996,6 @@ static void glut_idle_game(void)
     dx = 0;
     d2y = 0;
 
-    // They say it's good practice to poke the sleeping GL monster a bit
-    glFlush();
-
     // We'll need the current time value for a bunch of stuff
     update_timers();
 
@@ -913,29 +1005,36 @@ static void glut_idle_game(void)
     // No need to push it further if paused
     if (game_state & GAME_STATE_PAUSED)
     {
-        glutPostRedisplay();
+        redisplay();
         // We should be able to sleep for a while
         msleep(PAUSE_DELAY);
         return;
     }
 
+    // Run all the ticks that are due. The deadlines are absolute, so that we don't
+    // lose time on each tick, and update_timers() bounds how far behind we can get
+
     // Handle timed events (including animations)
-    if ((game_time - last_atime) > ANIMATION_INTERVAL)
+    while ((game_time - last_atime) >= ANIMATION_INTERVAL)
     {
-//		last_atime += ANIMATION_INTERVAL;	// closer to ideal rate but leads
-                                            // to catchup effect when moving window
-        last_atime = game_time;
+        last_atime += ANIMATION_INTERVAL;
 
         for (i = 0; i < nb_animations; i++)
             animations[i].framecount++;
         for (i = 0; i < NB_GUYBRUSHES; i++)
             guy(i).animation.framecount++;
+        if (room_animated())
+            display_dirty |= DIRTY_ANIMATION;
+        // The faces of the prisoners in pursuit blink on the panel
+        for (i = 0; i < NB_NATIONS; i++)
+            if (guy(i).state & STATE_IN_PURSUIT)
+                display_dirty |= DIRTY_PANEL;
 
         // Panel clock minute tick?
-        if ((game_time - last_ctime) > TIME_MARKER)
+        if ((last_atime - last_ctime) >= TIME_MARKER)
         {
-//			last_ctime += TIME_MARKER;
-            last_ctime = game_time;
+            last_ctime += TIME_MARKER;
+            display_dirty |= DIRTY_PANEL;
             minutes_digit_l++;
             if (minutes_digit_l == 10)
             {
@@ -977,6 +1076,7 @@ static void glut_idle_game(void)
                 continue;
             if (game_time > events[i].expiration_time)
             {	// Execute the timeout function
+                display_dirty = DIRTY_ALL;
                 events[i].function(events[i].parameter);
                 // Make the event available again
                 events[i].function = NULL;
@@ -984,14 +1084,18 @@ static void glut_idle_game(void)
         }
 
         // Take care of message display
-        if (game_time > t_status_message_timeout)
+        if ((game_time > t_status_message_timeout) && (status_message_priority != 0))
+        {
             status_message_priority = 0;
+            display_dirty |= DIRTY_PANEL;
+        }
     }
 
     // This ensures that all the motions are in sync
-    if ((game_time - last_ptime) > REPOSITION_INTERVAL)
+    while ((game_time - last_ptime) >= REPOSITION_TICK)
     {
-        last_ptime = game_time;
+        last_ptime += REPOSITION_TICK;
+        set_tick_positions();
 
         // Update the guards positions (if not playing with guards disabled)
         if (!opt_no_guards && move_guards())
@@ -1009,12 +1113,27 @@ static void glut_idle_game(void)
         check_on_prisoners();
         // Only reset the fire action AFTER we processed motion
         is_fire_pressed = false;
-        // Redisplay, as there might be a guard moving
-        glutPostRedisplay();
+        if (tick_motion())
+            display_dirty |= DIRTY_MOTION;
+        // No point in catching up if we're now displaying a static picture
+        if (game_state & GAME_STATE_STATIC_PIC)
+            break;
     }
 
+    // Somebody in between positions
+    if (tick_motion())
+        display_dirty |= DIRTY_MOTION;
+    // The onscreen counters change on every frame
+    if ((opt_display_fps) || (opt_onscreen_debug))
+        display_dirty = DIRTY_ALL;
+
+    // Only build a frame if something we display changed
+    if (display_dirty)
+        redisplay();
+
     // Don't hammer down the CPU
-    else if (game_time - last_ptime - REPOSITION_INTERVAL > QUANTUM_OF_SOLACE)
+    // (NB: these are u64, so we can't subtract game_time, which may be past the deadline)
+    if (game_time + QUANTUM_OF_SOLACE < last_ptime + REPOSITION_TICK)
         msleep(QUANTUM_OF_SOLACE);
 }
 
@@ -1101,6 +1220,8 @@ void process_menu()
                 break;
             case MENU_FULLSCREEN:
                 TOG(opt_fullscreen);
+                if ((!windowed) || (opt_offscreen))
+                    break;
                 if (opt_fullscreen)
                 {
                     old_w = gl_width;
@@ -1175,6 +1296,20 @@ void process_menu()
 }
 
 
+// Initialize a MOD from the depacked LOADTUNE we may have in memory, the pack,
+// or a loose file, in that order
+static bool init_mod(u8 i)
+{
+    u8* data;
+    u32 size;
+
+    if ((i == MOD_LOADTUNE) && (loadtune_buffer != NULL))
+        return mod_init_from_memory(loadtune_buffer, loadtune_size);
+    if ((data = pack_find(mod_name[i], &size)) != NULL)
+        return mod_init_from_memory(data, size);
+    return mod_init(mod_name[i]);
+}
+
 // We'll use a different idle function for static picture
 static void glut_idle_static_pic(void)
 {
@@ -1246,21 +1381,21 @@ static void glut_idle_static_pic(void)
             {
                 if (intro)
                 {
-                    if (mod_init(mod_name[MOD_LOADTUNE]))
+                    if (init_mod(MOD_LOADTUNE))
                         mod_play();
                     else
                         printf("Failed to load Intro tune\n");
                 }
                 else if (game_over)
                 {
-                    if (mod_init(mod_name[MOD_GAMEOVER]))
+                    if (init_mod(MOD_GAMEOVER))
                         mod_play();
                     else
                         printf("Failed to load Game Over tune\n");
                 }
                 else if (game_won)
                 {
-                    if (mod_init(mod_name[MOD_WHENWIN]))
+                    if (init_mod(MOD_WHENWIN))
                         mod_play();
                     else
                         printf("Failed to load winning tune\n");
@@ -1369,7 +1504,7 @@ static void glut_idle_static_pic(void)
     }
 
     // Don't forget to display the image
-    glutPostRedisplay();
+    redisplay();
 
     // We should be able to sleep for a while
     // Except if we're in a picture transition on the PSP, as it's too slow otherwise
@@ -1389,13 +1524,14 @@ static bool video_initialized = false;
     if (game_state & GAME_STATE_CUTSCENE)
     {
         if (!video_initialized)
-        {	// Start playing a video
-
-            // Clear our window background first (prevents transaparency)
-            glClear(GL_COLOR_BUFFER_BIT);
-            glutSwapBuffers();
+        {	// Start playing a video, which we can only do in a window
+            if (windowed)
+            {	// Clear our window background first (prevents transaparency)
+                glClear(GL_COLOR_BUFFER_BIT);
+                glutSwapBuffers();
+            }
 
-            if ((!video_init()) || (!video_play(APERTURE_VIDEO)))
+            if ((!windowed) || (!video_init()) || (!video_play(APERTURE_VIDEO)))
                 // Don't bother the world if our video doesn't play
                 game_suspended = false;
             else
@@ -1414,15 +1550,20 @@ static bool video_initialized = false;
         {
             // Prevents unwanted transitions to transparent!
             fade_value = 0.0f;
-            glClear(GL_COLOR_BUFFER_BIT);
-            glutSwapBuffers();
+            if (windowed)
+            {
+                glClear(GL_COLOR_BUFFER_BIT);
+                glutSwapBuffers();
+            }
             video_stop();
             video_initialized = false;
             game_state &= ~GAME_STATE_CUTSCENE;
         }
         t_last = mtime();
-        glutIdleFunc(restore_idle);
+        set_idle(restore_idle);
         game_suspended = false;
+        // Whatever was displayed meanwhile is not what we have in store
+        frame_invalidate();
     }
 
     msleep(PAUSE_DELAY);
@@ -1508,6 +1649,7 @@ static void glut_joystick(uint buttonMask, int x, int y, int z)
 
 static void glut_keyboard(u8 key, int x, int y)
 {
+    display_dirty |= DIRTY_PANEL;
     key_down[key] = true;
     last_key_used = key;
     SET_MODS;
@@ -1527,6 +1669,7 @@ static void glut_special_keys(int key, int x, int y)
 {
     int converted_key;
     converted_key = (key < GLUT_KEY_LEFT)?key-GLUT_KEY_F1+SPECIAL_KEY_OFFSET1:key-GLUT_KEY_LEFT+SPECIAL_KEY_OFFSET2;
+    display_dirty |= DIRTY_PANEL;
     key_down[converted_key] = true;
     last_key_used = converted_key;
     SET_MODS;
@@ -1550,6 +1693,7 @@ static void glut_mouse_buttons(int button, int state, int x, int y)
     converted_key = SPECIAL_MOUSE_BUTTON_BASE + button - GLUT_LEFT_BUTTON;
     if (state == GLUT_DOWN)
     {
+        display_dirty |= DIRTY_PANEL;
         key_down[converted_key] = true;
         last_key_used = converted_key;
     }
@@ -1565,6 +1709,208 @@ static void glut_mouse_buttons(int button, int state, int x, int y)
 }
 
 
+/*
+ * Startup tasks: loading the files, checking them, patching them and converting the
+ * graphics are mostly independent, so we run them as a task graph on worker threads.
+ * Anything GL must run on the main thread, which is the one that owns the context.
+ */
+
+// We convert the cells & sprites in slices, so that they can be spread over the workers
+#define NB_STARTUP_SLICES	8
+
+static s_task	startup_task[MAX_TASKS];
+static u32		nb_startup_tasks = 0;
+static bool		gfx_cached;
+
+static u32 add_task(const char* name, bool (*run)(u32), u32 param, u64 deps, bool main_thread)
+{
+    startup_task[nb_startup_tasks].name = name;
+    startup_task[nb_startup_tasks].run = run;
+    startup_task[nb_startup_tasks].param = param;
+    startup_task[nb_startup_tasks].deps = deps;
+    startup_task[nb_startup_tasks].main_thread = main_thread;
+    return nb_startup_tasks++;
+}
+
+static bool task_load(u32 i)
+{
+    return load_file((u16)i);
+}
+
+static bool task_read_hash_cache(u32 unused)
+{
+    read_hash_cache();
+    return true;
+}
+
+// The hashes are also used to key the graphics cache, so we always need them
+static bool task_hash(u32 i)
+{
+    get_file_hash((u16)i);
+#if defined(ANTI_TAMPERING_ENABLED)
+    if (!integrity_check((u16)i))
+    {
+        perr("Integrity check failure on file '%s'\n", fname[i]);
+        return false;
+    }
+#endif
+    return true;
+}
+
+static bool task_write_hash_cache(u32 unused)
+{
+    write_hash_cache();
+    return true;
+}
+
+static bool task_depack_loadtune(u32 unused)
+{
+    depack_loadtune();
+    return true;
+}
+
+// Some of the files need patching (this was done too in the original game!)
+static bool task_fix_files(u32 unused)
+{
+    fix_files();
+    return true;
+}
+
+// Keep a patched copy of the files we revert on a new game
+static bool task_snapshot_files(u32 unused)
+{
+    return snapshot_files();
+}
+
+static bool task_set_sfxs(u32 unused)
+{
+    set_sfxs();
+    return true;
+}
+
+// We might want some sound
+static bool task_audio_init(u32 unused)
+{
+    if (!audio_init())
+        perr("Could not Initialize audio\n");
+    return true;
+}
+
+static bool task_set_textures(u32 unused)
+{
+    set_textures();
+    return true;
+}
+
+static bool task_init_sprites(u32 unused)
+{
+    init_sprites();
+    return true;
+}
+
+// Get a palette we can work with, and check if we have the converted gfx cached
+static bool task_load_palette(u32 pal_index)
+{
+    gfx_cached = load_palette((u8)pal_index);
+    return true;
+}
+
+static bool task_convert_cells(u32 slice)
+{
+    if (!gfx_cached)
+        cells_to_wGRAB(nb_cells*slice/NB_STARTUP_SLICES, nb_cells*(slice+1)/NB_STARTUP_SLICES);
+    return true;
+}
+
+static bool task_convert_sprites(u32 slice)
+{
+    u16 n = NB_SPRITES-NB_EXTRA_SPRITES;
+    if (!gfx_cached)
+        sprites_to_wGRAB((u16)(n*slice/NB_STARTUP_SLICES), (u16)(n*(slice+1)/NB_STARTUP_SLICES));
+    return true;
+}
+
+static bool task_write_gfx_cache(u32 pal_index)
+{
+    if (!gfx_cached)
+        write_gfx_cache((u8)pal_index);
+    return true;
+}
+
+static bool task_texturize(u32 unused)
+{
+    texturize_atlas(false);
+    return true;
+}
+
+// Set up the startup task graph
+static void set_startup_tasks()
+{
+    u32 i, load[NB_FILES], hash[NB_FILES];
+    u32 fix, textures, sprites, palette, hash_cache;
+    u64 converted = 0, hashed = 0;
+
+    for (i=0; i<NB_FILES; i++)
+        load[i] = add_task("load_file", task_load, i, 0, false);
+    hash_cache = add_task("read_hash_cache", task_read_hash_cache, 0, 0, false);
+    for (i=0; i<NB_FILES; i++)
+    {
+        hash[i] = add_task("hash_file", task_hash, i, TASK_BIT(load[i]) | TASK_BIT(hash_cache), false);
+        hashed |= TASK_BIT(hash[i]);
+    }
+    add_task("write_hash_cache", task_write_hash_cache, 0, hashed, false);
+    add_task("depack_loadtune", task_depack_loadtune, 0, 0, false);
+    // The files must be hashed before they are patched
+    fix = add_task("fix_files", task_fix_files, 0, TASK_BIT(hash[ROOMS]) | TASK_BIT(hash[LOADER]), false);
+    add_task("set_sfxs", task_set_sfxs, 0, TASK_BIT(fix), false);
+    add_task("snapshot_files", task_snapshot_files, 0, TASK_BIT(fix) | TASK_BIT(load[ROOMS]) |
+        TASK_BIT(load[COMPRESSED_MAP]) | TASK_BIT(load[OBJECTS]) | TASK_BIT(load[TUNNEL_IO]), false);
+    add_task("audio_init", task_audio_init, 0, 0, true);
+    textures = add_task("set_textures", task_set_textures, 0, TASK_BIT(load[SPRITES]), true);
+    sprites = add_task("init_sprites", task_init_sprites, 0, TASK_BIT(textures) |
+        TASK_BIT(hash[SPRITES]) | TASK_BIT(load[SPRITES_PANEL]), true);
+    // The gfx cache is keyed on the hashes of the files used in the conversion
+    palette = add_task("load_palette", task_load_palette, palette_index, TASK_BIT(sprites) |
+        TASK_BIT(hash[CELLS]) | TASK_BIT(hash[SPRITES_PANEL]) | TASK_BIT(hash[PALETTES]), false);
+    for (i=0; i<NB_STARTUP_SLICES; i++)
+        converted |= TASK_BIT(add_task("cells_to_wGRAB", task_convert_cells, i, TASK_BIT(palette), false));
+    for (i=0; i<NB_STARTUP_SLICES; i++)
+        converted |= TASK_BIT(add_task("sprites_to_wGRAB", task_convert_sprites, i, TASK_BIT(palette), false));
+    add_task("write_gfx_cache", task_write_gfx_cache, palette_index, converted, false);
+    add_task("texturize", task_texturize, 0, converted, true);
+}
+
+
+// Pack all the game resources we can find into a single file
+// The videos stay out, as the players need a real file, and so do the config,
+// savegames and caches, which are meant to be written
+static bool build_pack(const char* filename)
+{
+    const char* name[NB_FILES+NB_TEXTURES+NB_MODS+8];
+    u32 i, n = 0;
+
+    for (i=0; i<NB_FILES; i++)
+        name[n++] = fname[i];
+    name[n++] = ALT_LOADER;
+    for (i=0; i<NB_TEXTURES; i++)
+        if (texture[i].filename != NULL)
+            name[n++] = texture[i].filename;
+    // So that the same pack can be used on all platforms
+    name[n++] = "STARTSCREEN2";
+    name[n++] = "STARTSCREEN2-PSP";
+    for (i=0; i<NB_MODS; i++)
+        name[n++] = mod_name[i];
+    name[n++] = PP_LOADTUNE_NAME;
+    name[n++] = "shader-hq2x.vert";
+    name[n++] = "shader-hq2x.frag";
+    name[n++] = "shader-hq3x.vert";
+    name[n++] = "shader-hq3x.frag";
+
+    print("Building pack '%s':\n", filename);
+    return pack_build(filename, name, n);
+}
+
+
 /* Here we go! */
 #if (defined(WIN32) && !defined(_DEBUG))
 // If we don't use WinMain, the latest DX will create a console
@@ -1581,6 +1927,12 @@ int main (int argc, char *argv[])
     int opt_error 			= 0;	// getopt
     // General purpose
     u32  i;
+    char* pack_name			= NULL;	// pack to build
+#if defined(DEBUG_ENABLED)
+    u32  nb_iterations		= 0;	// benchmarks
+    u32  nb_fuzz			= 0;
+    bool opt_c2p_check		= false;
+#endif
 
 #if defined(PSP)
     setup_callbacks();
@@ -1592,7 +1944,7 @@ int main (int argc, char *argv[])
         fbuffer[i] = NULL;
 
     // Process commandline options (works for PSP too with psplink)
-    while ((i = getopt (argc, argv, "hvbs:")) != -1)
+    while ((i = getopt (argc, argv, "hvbxca:j:s:k:p:r:o:g:z:")) != -1)
         switch (i)
     {
         case 'v':		// Print verbose messages
@@ -1605,10 +1957,45 @@ int main (int argc, char *argv[])
         case 's':		// debug SID (sprite) test
             sscanf(optarg, ("%x"), &opt_sid);
             break;
+        case 'k':		// Bytekiller decompression benchmark
+            nb_iterations = atoi(optarg);
+            break;
+        case 'p':		// PowerPacker decruncher stress test
+            nb_fuzz = atoi(optarg);
+            break;
+        case 'c':		// Check the SIMD planar to chunky against the scalar one
+            opt_c2p_check = true;
+            break;
+        case 'r':		// Renderers benchmark
+            opt_render_benchmark = atoi(optarg);
+            break;
 #endif
         case 'h':		// Half size on Windows
             opt_halfsize = true;
             break;
+        case 'j':		// Number of worker threads for startup
+            opt_nb_workers = atoi(optarg);
+            break;
+        case 'a':		// Build an asset pack from the loose files
+            pack_name = optarg;
+            break;
+        case 'o':		// Save the frames
+            opt_frame_prefix = optarg;
+            break;
+        case 'x':		// Render offscreen
+            opt_offscreen = true;
+            break;
+        case 'g':		// Renderer
+            if (!set_renderer(optarg))
+                opt_error++;
+            break;
+        case 'z':		// Scale the saved frames
+            if ((opt_scaler = scale_mode(optarg)) < 0)
+            {
+                perr("Unknown scaler '%s'\n", optarg);
+                opt_error++;
+            }
+            break;
         default:		// Unknown option
             opt_error++;
             break;
@@ -1616,6 +2003,13 @@ int main (int argc, char *argv[])
 #if !defined(PSP)
 	printf("\nColditz Escape! %s\n", VERSION);
 	printf("by Aperture Software - 2009-2010\n\n");
+#endif
+#if !defined(WIN32)
+    if ((opt_scaler >= 0) && (renderer->gl))
+    {
+        perr("The CPU scalers need the software renderer (-g soft)\n");
+        opt_error++;
+    }
 #endif
     if ( ((argc-optind) > 3) || opt_error)
     {
@@ -1623,6 +2017,28 @@ int main (int argc, char *argv[])
         ERR_EXIT;
     }
 
+#if defined(DEBUG_ENABLED)
+    if (nb_iterations)
+    {	// Benchmark SKR_COLD as well as any of its variants provided on the command line
+        uncompress_benchmark(ALT_LOADER, nb_iterations);
+        for (i=optind; i<(u32)argc; i++)
+            uncompress_benchmark(argv[i], nb_iterations);
+        LEAVE;
+    }
+    if (nb_fuzz)
+    {
+        ppDecrunch_stress_test(nb_fuzz);
+        LEAVE;
+    }
+#endif
+
+    if (pack_name != NULL)
+    {
+        if (!build_pack(pack_name))
+            ERR_EXIT;
+        LEAVE;
+    }
+
 #if defined(PSP)
     gl_width = PSP_SCR_WIDTH;
     gl_height = PSP_SCR_HEIGHT;
@@ -1631,14 +2047,26 @@ int main (int argc, char *argv[])
     gl_height = (opt_halfsize?1:2)*PSP_SCR_HEIGHT;
 #endif
 
-    // Well, we're supposed to call that blurb
-    glutInit(&argc, argv);
+    if (renderer->gl)
+    {
+        // Well, we're supposed to call that blurb
+        glutInit(&argc, argv);
 
-    // Need to have a working GL before we proceed. This is our own init() function
-    glut_init();
+        // Need to have a working GL before we proceed. This is our own init() function
+        glut_init();
 
 #if defined(WIN32)
-	init_shader();
+        init_shader();
+#endif
+        if ((opt_offscreen) && (!init_offscreen()))
+            ERR_EXIT;
+    }
+    if (!renderer->init())
+        ERR_EXIT;
+#if defined(DEBUG_ENABLED)
+    // The software renderer gets a copy of the textures, to be benchmarked too
+    if ((opt_render_benchmark) && (renderer->gl))
+        set_mirror(&soft_renderer);
 #endif
 
 //	remove(confname);
@@ -1660,7 +2088,7 @@ int main (int argc, char *argv[])
     }
 
 #if !defined(PSP)
-    if (opt_fullscreen)
+    if ((opt_fullscreen) && (windowed) && (!opt_offscreen))
         glutFullScreen();
 #endif
 
@@ -1672,35 +2100,6 @@ int main (int argc, char *argv[])
     key_nation[4] = KEY_PRISONERS_LEFT;
     key_nation[5] = KEY_PRISONERS_RIGHT;
 
-    // Load the data. If it's the first time the game is ran, we might have
-    // to uncompress LOADTUNE.MUS (PowerPack) and SKR_COLD (custom compression)
-    load_all_files();
-#if defined(ANTI_TAMPERING_ENABLED)
-    for (i=0; i<NB_FILES; i++)
-        if (!integrity_check(i))
-        {
-            perr("Integrity check failure on file '%s'\n", fname[i]);
-            ERR_EXIT;
-        }
-#endif
-    depack_loadtune();
-
-    // Some of the files need patching (this was done too in the original game!)
-    fix_files(false);
-
-	set_textures();
-	set_sfxs();
-
-    // Set global variables
-    t_last = mtime();
-    srand(t_last);
-    program_time = 0;
-    game_time = 0;
-
-    // We might want some sound
-    if (!audio_init())
-        perr("Could not Initialize audio\n");
-
     // We're going to convert the cells array, from 2 pixels per byte (paletted)
     // to on RGB(A) word per pixel
     rgbCells = (u8*) aligned_malloc(fsize[CELLS]*2*RGBA_SIZE, 16);
@@ -1710,20 +2109,35 @@ int main (int argc, char *argv[])
         ERR_EXIT;
     }
 
-    // Get a palette we can work with
-    to_16bit_palette(palette_index, 0xFF, PALETTES);
-
-    // Convert the cells to RGBA data
-    cells_to_wGRAB(fbuffer[CELLS],rgbCells);
+    // Load the data, set the sound & sprites, and convert the cells and sprites to
+    // RGBA data. If it's the first time the game is ran, we might have to uncompress
+    // LOADTUNE.MUS (PowerPack) and SKR_COLD (custom compression)
+    // Resources are taken from the pack if there's one, and from loose files otherwise
+    pack_open(PACK_NAME);
+    set_startup_tasks();
+    if (!run_tasks(startup_task, nb_startup_tasks,
+        (opt_nb_workers>=0)?(u32)opt_nb_workers:nb_cpus()-1))
+        ERR_EXIT;
+    if (opt_verbose)
+        print_task_report(startup_task, nb_startup_tasks);
+#if defined(DEBUG_ENABLED)
+    if (opt_c2p_check)
+    {
+        if (!c2p_check())
+            ERR_EXIT;
+        LEAVE;
+    }
+#endif
 
-    // Do the same for overlay sprites
-    init_sprites();
-    sprites_to_wGRAB();	// Must be called after init sprite
+    // Set global variables
+    t_last = mtime();
+    srand(t_last);
+    program_time = 0;
+    game_time = 0;
 
     if (opt_skip_intro)
     {
         fade_value = 1.0f;
-        glColor3f(fade_value, fade_value, fade_value);
         game_state = GAME_STATE_ACTION;
         glutIdleFunc_save(glut_idle_game);
         newgame_init();
@@ -1740,12 +2154,18 @@ int main (int argc, char *argv[])
             perr("Could not load INTRO screen\n");
             ERR_EXIT;
         }
-        glutIdleFunc(glut_idle_suspended);
+        set_idle(glut_idle_suspended);
         restore_idle = glut_idle_static_pic;
         game_suspended = true;
         last_key_used = 0;
     }
 
+    if (!windowed)
+    {	// No window, no events: just keep the game going
+        for(;;)
+            idle_func();
+    }
+
     // Now we can proceed with setting up our display
     glutDisplayFunc(glut_display);
     glutReshapeFunc(glut_reshape);
@@ -0,0 +1,339 @@
+/*
+ *  Colditz Escape! - Rewritten Engine for "Escape From Colditz"
+ *  copyright (C) 2008-2009 Aperture Software
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ *  ---------------------------------------------------------------------------
+ *  pack.c: single file asset pack, with a fallback to loose files
+ *  The pack is mapped once at startup. As the mapping is copy-on-write, the
+ *  game files can be pointed to and patched in place, like with loose files.
+ *  ---------------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(PSP)
+#include <psptypes.h>
+#include <psp/psp-printf.h>
+#endif
+#include "data-types.h"
+
+#include "colditz.h"
+#include "low-level.h"
+#include "pack.h"
+
+extern void md5( unsigned char *input, int ilen, unsigned char output[16] );
+
+// The currently opened pack, if any
+static s_mmap	pack_map;
+static bool		pack_opened = false;
+static u32		pack_nb_entries;
+static s_fstamp	pack_stamp;
+
+
+// Map a pack and check its index and data. Returns false if there's no usable pack
+// in which case all resources are read from loose files
+bool pack_open(const char* filename)
+{
+    u32 i, offset, size, index_size;
+    u8  md5sum[16];
+    u8* entry;
+
+    pack_close();
+    if ( (!get_fstamp(filename, &pack_stamp)) || (pack_stamp.size < PACK_HEADER_SIZE) ||
+         (pack_stamp.size > 0x7FFFFFFF) )
+        return false;
+    if (!mmap_open(filename, (size_t)pack_stamp.size, &pack_map))
+    {
+        perr("'%s': could not map pack\n", filename);
+        return false;
+    }
+
+    if ( (readlong(pack_map.address, 0) != PACK_MAGIC) ||
+         (readlong(pack_map.address, 4) != PACK_VERSION) )
+    {
+        perr("'%s': not a version %d pack\n", filename, PACK_VERSION);
+        goto error;
+    }
+    pack_nb_entries = readlong(pack_map.address, 8);
+    index_size = pack_nb_entries * PACK_ENTRY_SIZE;
+    if ( (pack_nb_entries > PACK_MAX_ENTRIES) || (PACK_HEADER_SIZE + index_size > pack_map.size) )
+    {
+        perr("'%s': invalid index\n", filename);
+        goto error;
+    }
+    md5(pack_map.address + PACK_HEADER_SIZE, index_size, md5sum);
+    if (memcmp(md5sum, pack_map.address + 16, 16) != 0)
+    {
+        perr("'%s': index checksum mismatch\n", filename);
+        goto error;
+    }
+    for (i=0; i<pack_nb_entries; i++)
+    {
+        entry = pack_map.address + PACK_HEADER_SIZE + i*PACK_ENTRY_SIZE;
+        offset = readlong(entry, PACK_NAME_SIZE);
+        size = readlong(entry, PACK_NAME_SIZE+4);
+        if ( (entry[PACK_NAME_SIZE-1] != 0) || (offset > pack_map.size) ||
+             (size > pack_map.size - offset) )
+        {
+            perr("'%s': invalid entry %d\n", filename, (int)i);
+            goto error;
+        }
+    }
+    pack_opened = true;
+    if (!pack_verify())
+    {
+        perr("'%s': corrupted pack - using the loose files instead\n", filename);
+        pack_close();
+        return false;
+    }
+    printv("Using pack '%s' (%d entries)\n", filename, (int)pack_nb_entries);
+    return true;
+
+error:
+    mmap_close(&pack_map);
+    return false;
+}
+
+void pack_close()
+{
+    if (!pack_opened)
+        return;
+    mmap_close(&pack_map);
+    pack_opened = false;
+}
+
+// Return the index entry for name, or NULL
+static u8* pack_entry(const char* name)
+{
+    u32 i;
+    u8* entry;
+
+    if (!pack_opened)
+        return NULL;
+    for (i=0; i<pack_nb_entries; i++)
+    {
+        entry = pack_map.address + PACK_HEADER_SIZE + i*PACK_ENTRY_SIZE;
+        if (strcmp((char*)entry, name) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+// Return a pointer to the data of a pack entry, or NULL if not in the pack
+// The data is writeable (copy-on-write), and aligned to PACK_ALIGN
+// Only reads the index, so it's safe to call from any thread
+u8* pack_find(const char* name, u32* size)
+{
+    u8* entry = pack_entry(name);
+
+    if (entry == NULL)
+        return NULL;
+    if (size != NULL)
+        *size = readlong(entry, PACK_NAME_SIZE+4);
+    return pack_map.address + readlong(entry, PACK_NAME_SIZE);
+}
+
+// Check the data of all the entries against their MD5
+bool pack_verify()
+{
+    u32 i;
+    u8  md5sum[16];
+    u8* entry;
+
+    if (!pack_opened)
+        return false;
+    for (i=0; i<pack_nb_entries; i++)
+    {
+        entry = pack_map.address + PACK_HEADER_SIZE + i*PACK_ENTRY_SIZE;
+        md5(pack_map.address + readlong(entry, PACK_NAME_SIZE), readlong(entry, PACK_NAME_SIZE+4), md5sum);
+        if (memcmp(md5sum, entry+PACK_NAME_SIZE+8, 16) != 0)
+        {
+            perr("Pack entry '%s': checksum mismatch\n", (char*)entry);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Open a resource, from the pack if it's there, or from a loose file otherwise
+// res->data must not be modified, and the resource released with res_close()
+bool res_open(const char* name, s_res* res)
+{
+    FILE* f;
+    long size;
+
+    res->pos = 0;
+    res->allocated = false;
+    if ((res->data = pack_find(name, &res->size)) != NULL)
+        return true;
+
+    if ((f = fopen(name, "rb")) == NULL)
+        return false;
+    if ( (fseek(f, 0, SEEK_END) != 0) || ((size = ftell(f)) < 0) || (fseek(f, 0, SEEK_SET) != 0) )
+    {
+        fclose(f);
+        return false;
+    }
+    res->size = (u32)size;
+    // The extra byte allows text resources to be NUL terminated
+    if ((res->data = (u8*) malloc(res->size+1)) == NULL)
+    {
+        fclose(f);
+        return false;
+    }
+    if (fread(res->data, 1, res->size, f) != res->size)
+    {
+        fclose(f);
+        SFREE(res->data);
+        return false;
+    }
+    fclose(f);
+    res->data[res->size] = 0;
+    res->allocated = true;
+    return true;
+}
+
+void res_close(s_res* res)
+{
+    if (res->allocated)
+        SFREE(res->data);
+    res->data = NULL;
+    res->size = 0;
+    res->allocated = false;
+}
+
+// Is the resource available, in the pack or as a loose file?
+bool res_exists(const char* name)
+{
+    FILE* f;
+
+    if (pack_entry(name) != NULL)
+        return true;
+    if ((f = fopen(name, "rb")) == NULL)
+        return false;
+    fclose(f);
+    return true;
+}
+
+// Stamp of a resource. For pack entries, this is the stamp of the pack itself
+// with the entry offset folded in, so that the MD5 cache still does its job
+bool res_fstamp(const char* name, s_fstamp* stamp)
+{
+    u8* entry = pack_entry(name);
+
+    if (entry == NULL)
+        return get_fstamp(name, stamp);
+    *stamp = pack_stamp;
+    stamp->size = ((u64)readlong(entry, PACK_NAME_SIZE)<<32) | readlong(entry, PACK_NAME_SIZE+4);
+    return true;
+}
+
+// Build a pack from a list of loose files. Missing files are skipped, duplicates ignored
+// The pack is then reopened, and thus checked, so this also closes any currently opened pack
+bool pack_build(const char* filename, const char** names, u32 nb_names)
+{
+    FILE* f = NULL;
+    u8  header[PACK_HEADER_SIZE];
+    u8  index[PACK_MAX_ENTRIES*PACK_ENTRY_SIZE];
+    u8  padding[PACK_ALIGN];
+    s_res res;
+    u32 i, j, nb_entries = 0, offset;
+
+    memset(index, 0, sizeof(index));
+    memset(padding, 0, sizeof(padding));
+    // The loose files must take precedence over the pack we're rebuilding
+    pack_close();
+    if ((f = fopen(filename, "wb")) == NULL)
+    {
+        perr("Can't create pack '%s'\n", filename);
+        return false;
+    }
+    // Data starts right after the (maximum size) index
+    offset = PACK_HEADER_SIZE + PACK_MAX_ENTRIES*PACK_ENTRY_SIZE;
+    if (fseek(f, offset, SEEK_SET) != 0)
+        goto error;
+
+    for (i=0; i<nb_names; i++)
+    {
+        for (j=0; j<i; j++)
+            if (strcmp(names[j], names[i]) == 0)
+                break;
+        if (j != i)
+            continue;
+        if (strlen(names[i]) >= PACK_NAME_SIZE)
+        {
+            perr("'%s': name too long for a pack entry\n", names[i]);
+            goto error;
+        }
+        if (!res_open(names[i], &res))
+        {
+            printv("'%s' not found - skipped\n", names[i]);
+            continue;
+        }
+        if (nb_entries >= PACK_MAX_ENTRIES)
+        {
+            perr("Too many pack entries\n");
+            res_close(&res);
+            goto error;
+        }
+        print("  %-32s %8d bytes\n", names[i], (int)res.size);
+        strcpy((char*)index + nb_entries*PACK_ENTRY_SIZE, names[i]);
+        writelong(index, nb_entries*PACK_ENTRY_SIZE + PACK_NAME_SIZE, offset);
+        writelong(index, nb_entries*PACK_ENTRY_SIZE + PACK_NAME_SIZE+4, res.size);
+        md5(res.data, res.size, index + nb_entries*PACK_ENTRY_SIZE + PACK_NAME_SIZE+8);
+        nb_entries++;
+        j = (PACK_ALIGN - (res.size % PACK_ALIGN)) % PACK_ALIGN;
+        if ( (fwrite(res.data, 1, res.size, f) != res.size) || (fwrite(padding, 1, j, f) != j) )
+        {
+            res_close(&res);
+            goto error;
+        }
+        offset += res.size + j;
+        res_close(&res);
+    }
+
+    // Now that we know what's in it, write the header and index
+    memset(header, 0, sizeof(header));
+    writelong(header, 0, PACK_MAGIC);
+    writelong(header, 4, PACK_VERSION);
+    writelong(header, 8, nb_entries);
+    md5(index, nb_entries*PACK_ENTRY_SIZE, header+16);
+    if ( (fseek(f, 0, SEEK_SET) != 0) || (fwrite(header, 1, PACK_HEADER_SIZE, f) != PACK_HEADER_SIZE) ||
+         (fwrite(index, 1, sizeof(index), f) != sizeof(index)) )
+        goto error;
+    if (fclose(f) != 0)
+    {
+        f = NULL;
+        goto error;
+    }
+
+    if (!pack_open(filename))
+    {
+        perr("Pack '%s' failed verification\n", filename);
+        return false;
+    }
+    print("Wrote pack '%s': %d entries, %d bytes\n", filename, (int)nb_entries, (int)offset);
+    return true;
+
+error:
+    perr("Error writing pack '%s'\n", filename);
+    if (f != NULL)
+        fclose(f);
+    remove(filename);
+    return false;
+}
@@ -0,0 +1,102 @@
+/*
+ *  Colditz Escape! - Rewritten Engine for "Escape From Colditz"
+ *  copyright (C) 2008-2009 Aperture Software
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ *  ---------------------------------------------------------------------------
+ *  pack.h: asset pack and resource access definitions
+ *  ---------------------------------------------------------------------------
+ */
+
+#pragma once
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ *	Pack format (big endian):
+ *	header:	magic, version, nb_entries, reserved, MD5 of the index
+ *	index:	nb_entries * { name (NUL padded), offset, size, MD5 of the data }
+ *	data:	each entry aligned to PACK_ALIGN bytes
+ */
+#define PACK_NAME				"colditz.pak"
+#define PACK_MAGIC				0x4350414B	// 'CPAK'
+#define PACK_VERSION			1
+#define PACK_HEADER_SIZE		32
+#define PACK_NAME_SIZE			40
+#define PACK_ENTRY_SIZE			(PACK_NAME_SIZE + 24)
+#define PACK_MAX_ENTRIES		64
+#define PACK_ALIGN				16
+
+// A resource, either pointing into the pack, or read from a loose file
+typedef struct
+{
+	u8*			data;
+	u32			size;
+	u32			pos;		// for the res_read functions
+	bool		allocated;	// true for loose files, which we read into memory
+} s_res;
+
+// Sequential reads, fread style. Reading past the end returns zeroes
+static __inline u8 res_readbyte(s_res* res)
+{
+	return (res->pos < res->size)?res->data[res->pos++]:0;
+}
+
+static __inline u16 res_readword(s_res* res)
+{
+	u16 r = res_readbyte(res);
+	r <<= 8;
+	return r | res_readbyte(res);
+}
+
+static __inline u32 res_readlong(s_res* res)
+{
+	u32 r = res_readword(res);
+	r <<= 16;
+	return r | res_readword(res);
+}
+
+static __inline u32 res_read(void* dest, u32 len, s_res* res)
+{
+	if (res->pos >= res->size)
+		return 0;
+	if (len > res->size - res->pos)
+		len = res->size - res->pos;
+	memcpy(dest, res->data + res->pos, len);
+	res->pos += len;
+	return len;
+}
+
+#define res_eof(res)			((res)->pos >= (res)->size)
+
+/*
+ *	Public prototypes
+ */
+bool pack_open(const char* filename);
+void pack_close();
+u8*  pack_find(const char* name, u32* size);
+bool pack_verify();
+bool pack_build(const char* filename, const char** names, u32 nb_names);
+bool res_open(const char* name, s_res* res);
+void res_close(s_res* res);
+bool res_exists(const char* name);
+bool res_fstamp(const char* name, s_fstamp* stamp);
+
+#ifdef	__cplusplus
+}
+#endif
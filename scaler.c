@@ -0,0 +1,755 @@
+/*
+ *  Colditz Escape! - Rewritten Engine for "Escape From Colditz"
+ *  copyright (C) 2008-2009 Aperture Software
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ *  ---------------------------------------------------------------------------
+ *  scaler.c: CPU pixel art scalers (edge2x, edge3x, edge4x and 2xBR to 4xBR), for the
+ *  0xAARRGGBB frames of the software renderer. The frame is split into
+ *  horizontal bands, run as tasks on the worker threads.
+ *  ---------------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(PSP)
+#include <psptypes.h>
+#include <psp/psp-printf.h>
+#endif
+#include "data-types.h"
+
+#include "colditz.h"
+#include "low-level.h"
+#include "tasks.h"
+#include "scaler.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define SCALE_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define SCALE_NEON
+#include <arm_neon.h>
+#endif
+
+// The planes have a 2 pixel border, for the 5x5 neighbourhood of xBR
+#define BORDER				2
+// The edge LUT weights add up to this
+#define WEIGHT_SHIFT		6
+#define WEIGHT_ONE			(1<<WEIGHT_SHIFT)
+
+/*
+ * edge: the pixels are classified as in hqx, but the blending is our own, and much
+ * simpler than the hqx tables. Each pixel gets a 12 bit code, with one bit for each of
+ * its 8 neighbours that differs from it, and one bit per corner if the 2 neighbours on
+ * the sides of that corner differ from each other. The bits are in hqx order:
+ *    w1 w2 w3
+ *    w4 w5 w6
+ *    w7 w8 w9
+ * Each output pixel only depends on the quadrant it's in, i.e. on the centre, the 2
+ * side neighbours (A horizontal, B vertical) and the corner one (C) of that quadrant.
+ * So the LUT is indexed by output pixel and 4 bit quadrant case, and gives the weights
+ * of the centre, A, B and C, as computed by edge_weights().
+ */
+#define CASE_A				1		// A differs from the centre
+#define CASE_B				2		// B differs from the centre
+#define CASE_C				4		// C differs from the centre
+#define CASE_AB				8		// A and B are alike
+#define NB_CASES			16
+
+// w1, w2, w3, w4, w6, w7, w8, w9, as (dx, dy)
+static const s8 neighbour[8][2] = { {-1,-1}, {0,-1}, {1,-1}, {-1,0}, {1,0}, {-1,1}, {0,1}, {1,1} };
+// A, B, C neighbour index, and the bit of the A/B pair, for the TL, TR, BL and BR quadrants
+static const u8 quadrant[4][4] = { {3, 1, 0, 8}, {4, 1, 2, 9}, {3, 6, 5, 11}, {4, 6, 7, 10} };
+// The sides pairs: w4/w2, w2/w6, w6/w8, w8/w4
+static const u8 side_pair[4][2] = { {3, 1}, {1, 4}, {4, 6}, {6, 3} };
+
+static const char* scaler_name[NB_SCALERS] = { "edge2x", "edge3x", "edge4x", "xbr2x", "xbr3x", "xbr4x" };
+static const u8 scaler_factor[NB_SCALERS] = { 2, 3, 4, 2, 3, 4 };
+
+static bool  lut_ready = false;
+// Centre, A, B and C weights, as bytes, for each output pixel and quadrant case
+static uint  edge_lut[SCALE_EDGE4X+1][SCALE_MAX_FACTOR*SCALE_MAX_FACTOR][NB_CASES];
+// Quadrant of each output pixel
+static u8    edge_quadrant[SCALE_EDGE4X+1][SCALE_MAX_FACTOR*SCALE_MAX_FACTOR];
+// Quadrant case of each of the 4096 codes
+static u8    edge_case[4][4096];
+
+// The frame being scaled
+static u8          scale_cur_mode;
+static const uint* scale_src;
+static uint*       scale_dest;
+static u16         scale_w, scale_h;
+static u32         nb_bands;
+// The padded planes, (re)allocated when the frame size changes
+static u32         stride, plane_h, plane_size = 0;
+static uint*       rgb_plane = NULL;
+static s16         *y_plane = NULL, *u_plane = NULL, *v_plane = NULL;
+static u16*        code_plane = NULL;
+static s_task      scale_task[2*SCALE_MAX_BANDS];
+
+
+// The weights of one output pixel, at (fx, fy) from the centre of the source one,
+// for a quadrant case
+static uint edge_weights(float fx, float fy, u8 c)
+{
+    float ax = (fx<0.0f)?-fx:fx, ay = (fy<0.0f)?-fy:fy;
+    float wa = 0.0f, wb = 0.0f, wc = 0.0f, e;
+    uint  a, b, d;
+
+    if ((c & CASE_A) && (c & CASE_B) && (c & CASE_AB))
+    {	// An edge runs across the corner => the closer to the corner, the more of it
+        e = ((ax == 0.0f) || (ay == 0.0f))?0.0f:(2.0f*(ax+ay) - 0.5f);
+        e = (e<0.0f)?0.0f:((e>1.0f)?1.0f:e);
+        // Unless the corner is like the centre, in which case it's a thin line
+        if (!(c & CASE_C))
+            e *= 0.5f;
+        wa = e/2.0f;
+        wb = e/2.0f;
+    }
+    else if ((c & CASE_A) && (c & CASE_B))
+    {	// Two different things on the sides => just soften the very corner
+        if ((ax >= 0.25f) && (ay >= 0.25f))
+        {
+            wa = 0.125f;
+            wb = 0.125f;
+        }
+    }
+    else if (c & CASE_A)
+    {	// Vertical edge
+        if (ax >= 0.25f)
+            wa = 0.25f;
+    }
+    else if (c & CASE_B)
+    {	// Horizontal edge
+        if (ay >= 0.25f)
+            wb = 0.25f;
+    }
+    else if ((c & CASE_C) && (ax >= 0.25f) && (ay >= 0.25f))
+        wc = 0.25f;
+
+    a = (uint)(wa*WEIGHT_ONE + 0.5f);
+    b = (uint)(wb*WEIGHT_ONE + 0.5f);
+    d = (uint)(wc*WEIGHT_ONE + 0.5f);
+    return (WEIGHT_ONE - a - b - d) | (a<<8) | (b<<16) | (d<<24);
+}
+
+static void init_lut()
+{
+    u32 code;
+    u8  m, n, sx, sy, q, c;
+    float fx, fy;
+
+    for (m=SCALE_EDGE2X; m<=SCALE_EDGE4X; m++)
+    {
+        n = scaler_factor[m];
+        for (sy=0; sy<n; sy++)
+            for (sx=0; sx<n; sx++)
+            {
+                fx = (sx+0.5f)/n - 0.5f;
+                fy = (sy+0.5f)/n - 0.5f;
+                // The middle row and column of edge3x can go either way: neither has an A
+                // or B weight, and both have the same C
+                q = ((fy>0.0f)?2:0) + ((fx>0.0f)?1:0);
+                edge_quadrant[m][sy*n+sx] = q;
+                for (c=0; c<NB_CASES; c++)
+                    edge_lut[m][sy*n+sx][c] = edge_weights(fx, fy, c);
+            }
+    }
+    for (q=0; q<4; q++)
+        for (code=0; code<4096; code++)
+            edge_case[q][code] = ((code & (1<<quadrant[q][0]))?CASE_A:0) |
+                ((code & (1<<quadrant[q][1]))?CASE_B:0) | ((code & (1<<quadrant[q][2]))?CASE_C:0) |
+                ((code & (1<<quadrant[q][3]))?0:CASE_AB);
+    lut_ready = true;
+}
+
+// Convert one row to the padded planes
+static void convert_row(u16 y)
+{
+    const uint* s = &scale_src[y*scale_w];
+    uint* d = &rgb_plane[(y+BORDER)*stride];
+    s16 *py = &y_plane[(y+BORDER)*stride], *pu = &u_plane[(y+BORDER)*stride];
+    s16 *pv = &v_plane[(y+BORDER)*stride];
+    int r, g, b;
+    u32 x;
+
+    for (x=0; x<stride; x++)
+    {
+        d[x] = s[(x<BORDER)?0:((x-BORDER >= scale_w)?scale_w-1:x-BORDER)];
+        r = (d[x]>>16) & 0xFF;
+        g = (d[x]>>8) & 0xFF;
+        b = d[x] & 0xFF;
+        py[x] = (s16)((77*r + 150*g + 29*b)>>8);
+        // The 32768 bias keeps the shifted values positive, and adds 128
+        pu[x] = (s16)((-43*r - 85*g + 128*b + 32768)>>8);
+        pv[x] = (s16)((128*r - 107*g - 21*b + 32768)>>8);
+    }
+}
+
+// Copy a padded row over another, for the top and bottom borders
+static void copy_row(u32 dest, u32 src)
+{
+    memcpy(&rgb_plane[dest*stride], &rgb_plane[src*stride], stride*sizeof(uint));
+    memcpy(&y_plane[dest*stride], &y_plane[src*stride], stride*sizeof(s16));
+    memcpy(&u_plane[dest*stride], &u_plane[src*stride], stride*sizeof(s16));
+    memcpy(&v_plane[dest*stride], &v_plane[src*stride], stride*sizeof(s16));
+}
+
+static __inline u16 band_start(u32 band)
+{
+    return (u16)((band*scale_h)/nb_bands);
+}
+
+static bool convert_band(u32 band)
+{
+    u16 y;
+    u32 i;
+
+    for (y=band_start(band); y<band_start(band+1); y++)
+        convert_row(y);
+    if (band == 0)
+        for (i=0; i<BORDER; i++)
+            copy_row(i, BORDER);
+    if (band == nb_bands-1)
+        for (i=0; i<BORDER; i++)
+            copy_row(plane_h-1-i, plane_h-1-BORDER);
+    return true;
+}
+
+// Scalar version of the classification. o1 and o2 are offsets in the planes
+static __inline bool differ(u32 o1, u32 o2)
+{
+    return (abs(y_plane[o1]-y_plane[o2]) > SCALE_THRESHOLD_Y) ||
+        (abs(u_plane[o1]-u_plane[o2]) > SCALE_THRESHOLD_U) ||
+        (abs(v_plane[o1]-v_plane[o2]) > SCALE_THRESHOLD_V);
+}
+
+#if defined(SCALE_SSE2)
+static __inline __m128i differ8(u32 o1, u32 o2)
+{
+    __m128i a, b, d, m;
+
+    a = _mm_loadu_si128((const __m128i*)&y_plane[o1]);
+    b = _mm_loadu_si128((const __m128i*)&y_plane[o2]);
+    d = _mm_sub_epi16(_mm_max_epi16(a, b), _mm_min_epi16(a, b));
+    m = _mm_cmpgt_epi16(d, _mm_set1_epi16(SCALE_THRESHOLD_Y));
+    a = _mm_loadu_si128((const __m128i*)&u_plane[o1]);
+    b = _mm_loadu_si128((const __m128i*)&u_plane[o2]);
+    d = _mm_sub_epi16(_mm_max_epi16(a, b), _mm_min_epi16(a, b));
+    m = _mm_or_si128(m, _mm_cmpgt_epi16(d, _mm_set1_epi16(SCALE_THRESHOLD_U)));
+    a = _mm_loadu_si128((const __m128i*)&v_plane[o1]);
+    b = _mm_loadu_si128((const __m128i*)&v_plane[o2]);
+    d = _mm_sub_epi16(_mm_max_epi16(a, b), _mm_min_epi16(a, b));
+    return _mm_or_si128(m, _mm_cmpgt_epi16(d, _mm_set1_epi16(SCALE_THRESHOLD_V)));
+}
+#elif defined(SCALE_NEON)
+static __inline uint16x8_t differ8(u32 o1, u32 o2)
+{
+    uint16x8_t m;
+
+    m = vcgtq_s16(vabdq_s16(vld1q_s16(&y_plane[o1]), vld1q_s16(&y_plane[o2])),
+        vdupq_n_s16(SCALE_THRESHOLD_Y));
+    m = vorrq_u16(m, vcgtq_s16(vabdq_s16(vld1q_s16(&u_plane[o1]), vld1q_s16(&u_plane[o2])),
+        vdupq_n_s16(SCALE_THRESHOLD_U)));
+    return vorrq_u16(m, vcgtq_s16(vabdq_s16(vld1q_s16(&v_plane[o1]), vld1q_s16(&v_plane[o2])),
+        vdupq_n_s16(SCALE_THRESHOLD_V)));
+}
+#endif
+
+// Compute the edge codes of a row, 8 pixels at a time with SIMD. The planes are wide
+// enough for the last 8 to go over the frame width
+static void classify_row(u16 y)
+{
+    u32 c0 = (y+BORDER)*stride + BORDER;
+    u16* code = &code_plane[y*stride];
+    s32 off[8];
+    u32 x, i;
+#if defined(SCALE_SSE2)
+    __m128i acc;
+#elif defined(SCALE_NEON)
+    uint16x8_t acc;
+#else
+    u32 s;
+    u16 c;
+#endif
+
+    for (i=0; i<8; i++)
+        off[i] = neighbour[i][1]*(s32)stride + neighbour[i][0];
+    for (x=0; x<scale_w; x+=8)
+    {
+#if defined(SCALE_SSE2)
+        acc = _mm_setzero_si128();
+        for (i=0; i<8; i++)
+            acc = _mm_or_si128(acc, _mm_and_si128(differ8(c0+x, c0+x+off[i]), _mm_set1_epi16(1<<i)));
+        for (i=0; i<4; i++)
+            acc = _mm_or_si128(acc, _mm_and_si128(differ8(c0+x+off[side_pair[i][0]],
+                c0+x+off[side_pair[i][1]]), _mm_set1_epi16(0x100<<i)));
+        _mm_storeu_si128((__m128i*)&code[x], acc);
+#elif defined(SCALE_NEON)
+        acc = vdupq_n_u16(0);
+        for (i=0; i<8; i++)
+            acc = vorrq_u16(acc, vandq_u16(differ8(c0+x, c0+x+off[i]), vdupq_n_u16(1<<i)));
+        for (i=0; i<4; i++)
+            acc = vorrq_u16(acc, vandq_u16(differ8(c0+x+off[side_pair[i][0]],
+                c0+x+off[side_pair[i][1]]), vdupq_n_u16(0x100<<i)));
+        vst1q_u16(&code[x], acc);
+#else
+        for (i=0; (i<8) && (x+i<scale_w); i++)
+        {
+            for (c=0, s=0; s<8; s++)
+                if (differ(c0+x+i, c0+x+i+off[s]))
+                    c |= 1<<s;
+            for (s=0; s<4; s++)
+                if (differ(c0+x+i+off[side_pair[s][0]], c0+x+i+off[side_pair[s][1]]))
+                    c |= 0x100<<s;
+            code[x+i] = c;
+        }
+#endif
+    }
+}
+
+// Weighted sum of 4 pixels, with the weights (as bytes) adding up to WEIGHT_ONE
+static __inline uint blend4(uint c, uint a, uint b, uint d, uint w)
+{
+    uint wc = w & 0xFF, wa = (w>>8) & 0xFF, wb = (w>>16) & 0xFF, wd = w>>24;
+    uint rb = (c & 0xFF00FF)*wc + (a & 0xFF00FF)*wa + (b & 0xFF00FF)*wb + (d & 0xFF00FF)*wd;
+    uint ag = ((c>>8) & 0xFF00FF)*wc + ((a>>8) & 0xFF00FF)*wa +
+        ((b>>8) & 0xFF00FF)*wb + ((d>>8) & 0xFF00FF)*wd;
+
+    rb = ((rb + (WEIGHT_ONE/2)*0x10001) >> WEIGHT_SHIFT) & 0xFF00FF;
+    ag = ((ag + (WEIGHT_ONE/2)*0x10001) >> WEIGHT_SHIFT) & 0xFF00FF;
+    return rb | (ag<<8);
+}
+
+static void edge_band(u32 band)
+{
+    const u8 n = scaler_factor[scale_cur_mode];
+    const u8* quad = edge_quadrant[scale_cur_mode];
+    u32 dw = n*scale_w;
+    u32 p, i;
+    s32 off[8];
+    uint w[8], c, q_case[4], *d;
+    u16 y, x, code;
+    u8  sx, sy, s, q;
+
+    for (i=0; i<8; i++)
+        off[i] = neighbour[i][1]*(s32)stride + neighbour[i][0];
+    for (y=band_start(band); y<band_start(band+1); y++)
+    {
+        classify_row(y);
+        p = (y+BORDER)*stride + BORDER;
+        d = &scale_dest[n*y*dw];
+        for (x=0; x<scale_w; x++, p++, d+=n)
+        {
+            c = rgb_plane[p];
+            code = code_plane[y*stride+x];
+            if ((code & 0xFF) == 0)
+            {	// Flat area
+                for (sy=0; sy<n; sy++)
+                    for (sx=0; sx<n; sx++)
+                        d[sy*dw+sx] = c;
+                continue;
+            }
+            for (i=0; i<8; i++)
+                w[i] = rgb_plane[p+off[i]];
+            for (q=0; q<4; q++)
+                q_case[q] = edge_case[q][code];
+            for (sy=0, s=0; sy<n; sy++)
+                for (sx=0; sx<n; sx++, s++)
+                {
+                    q = quad[s];
+                    d[sy*dw+sx] = blend4(c, w[quadrant[q][0]], w[quadrant[q][1]],
+                        w[quadrant[q][2]], edge_lut[scale_cur_mode][s][q_case[q]]);
+                }
+        }
+    }
+}
+
+/*
+ * xBR: for each corner, the edge running across it is found by comparing the
+ * differences along both diagonals, over a 5x5 neighbourhood. For the bottom
+ * right corner of E:
+ *       A1 B1 C1
+ *    A0 A  B  C  C4
+ *    D0 D  E  F  F4
+ *    G0 G  H  I  I4
+ *       G5 H5 I5
+ * the other corners are mirrors of it. The edge is then either a diagonal, or a
+ * shallower ("left") or steeper ("up") line, which covers more of the output block.
+ */
+// C, G, I, F4, H5, H, F, D, I5, I4, B as (dx, dy)
+static const s8 xbr_offset[11][2] = { {1,-1}, {-1,1}, {1,1}, {2,0}, {0,2}, {0,1}, {1,0},
+    {-1,0}, {1,2}, {2,1}, {0,-1} };
+#define XBR_C	0
+#define XBR_G	1
+#define XBR_I	2
+#define XBR_F4	3
+#define XBR_H5	4
+#define XBR_H	5
+#define XBR_F	6
+#define XBR_D	7
+#define XBR_I5	8
+#define XBR_I4	9
+#define XBR_B	10
+// Two pixels are alike below this distance
+#define XBR_EQ	155
+
+static __inline int dist(u32 o1, u32 o2)
+{
+    return abs(y_plane[o1]-y_plane[o2]) + abs(u_plane[o1]-u_plane[o2]) +
+        abs(v_plane[o1]-v_plane[o2]);
+}
+
+#define eq(o1, o2)		(dist(o1, o2) < XBR_EQ)
+// Blend k/WEIGHT_ONE of px into the pixel at (x, y) of the block, as seen from
+// the bottom right corner
+#define BLEND(x, y, k)	E[map[(y)*n+(x)]] = blend4(E[map[(y)*n+(x)]], px, 0, 0, \
+                            (WEIGHT_ONE-(k)) | ((k)<<8))
+#define SET(x, y, v)	E[map[(y)*n+(x)]] = (v)
+#define GET(x, y)		E[map[(y)*n+(x)]]
+
+// Apply the edge found across the bottom right corner (as seen through map) to the block
+static void xbr_edge(uint* E, const u8* map, u8 n, bool left, bool up, uint px)
+{
+    switch (n)
+    {
+    case 2:
+        if (left && up)
+        {
+            BLEND(1, 1, 56);
+            BLEND(0, 1, 16);
+            SET(1, 0, GET(0, 1));
+        }
+        else if (left)
+        {
+            BLEND(1, 1, 48);
+            BLEND(0, 1, 16);
+        }
+        else if (up)
+        {
+            BLEND(1, 1, 48);
+            BLEND(1, 0, 16);
+        }
+        else
+            BLEND(1, 1, 32);
+        break;
+    case 3:
+        if (left && up)
+        {
+            BLEND(1, 2, 48);
+            BLEND(0, 2, 16);
+            SET(2, 1, GET(1, 2));
+            SET(2, 0, GET(0, 2));
+            SET(2, 2, px);
+        }
+        else if (left)
+        {
+            BLEND(1, 2, 48);
+            BLEND(2, 1, 16);
+            BLEND(0, 2, 16);
+            SET(2, 2, px);
+        }
+        else if (up)
+        {
+            BLEND(2, 1, 48);
+            BLEND(1, 2, 16);
+            BLEND(2, 0, 16);
+            SET(2, 2, px);
+        }
+        else
+        {
+            BLEND(2, 2, 56);
+            BLEND(2, 1, 8);
+            BLEND(1, 2, 8);
+        }
+        break;
+    default:
+        if (left && up)
+        {
+            BLEND(1, 3, 48);
+            BLEND(0, 3, 16);
+            SET(3, 3, px);
+            SET(2, 3, px);
+            SET(3, 2, px);
+            SET(2, 2, GET(0, 3));
+            SET(3, 0, GET(0, 3));
+            SET(3, 1, GET(1, 3));
+        }
+        else if (left)
+        {
+            BLEND(3, 2, 48);
+            BLEND(1, 3, 48);
+            BLEND(2, 2, 16);
+            BLEND(0, 3, 16);
+            SET(2, 3, px);
+            SET(3, 3, px);
+        }
+        else if (up)
+        {
+            BLEND(2, 3, 48);
+            BLEND(3, 1, 48);
+            BLEND(2, 2, 16);
+            BLEND(3, 0, 16);
+            SET(3, 2, px);
+            SET(3, 3, px);
+        }
+        else
+        {
+            BLEND(3, 2, 32);
+            BLEND(2, 3, 32);
+            SET(3, 3, px);
+        }
+        break;
+    }
+}
+
+static void xbr_band(u32 band)
+{
+    const u8 n = scaler_factor[scale_cur_mode];
+    u32 dw = n*scale_w;
+    u32 p, i;
+    s32 off[4][11];
+    const s32* o;
+    int we, wi, ke, ki;
+    bool left, up;
+    uint c, px, *d, E[SCALE_MAX_FACTOR*SCALE_MAX_FACTOR];
+    u8  map[4][SCALE_MAX_FACTOR*SCALE_MAX_FACTOR];
+    u16 y, x;
+    u8  corner, sx, sy;
+
+    // BR, BL, TR, TL
+    for (corner=0; corner<4; corner++)
+    {
+        for (i=0; i<11; i++)
+            off[corner][i] = ((corner<2)?1:-1)*xbr_offset[i][1]*(s32)stride +
+                ((corner&1)?-1:1)*xbr_offset[i][0];
+        // Where each pixel of the block, as seen from the bottom right, really is
+        for (sy=0; sy<n; sy++)
+            for (sx=0; sx<n; sx++)
+                map[corner][sy*n+sx] = ((corner<2)?sy:n-1-sy)*n + ((corner&1)?n-1-sx:sx);
+    }
+    for (y=band_start(band); y<band_start(band+1); y++)
+    {
+        p = (y+BORDER)*stride + BORDER;
+        d = &scale_dest[n*y*dw];
+        for (x=0; x<scale_w; x++, p++, d+=n)
+        {
+            c = rgb_plane[p];
+            for (i=0; i<(u32)n*n; i++)
+                E[i] = c;
+            for (corner=0; corner<4; corner++)
+            {
+                o = off[corner];
+                if ( (rgb_plane[p+o[XBR_F]] == c) || (rgb_plane[p+o[XBR_H]] == c) )
+                    continue;
+                we = dist(p, p+o[XBR_C]) + dist(p, p+o[XBR_G]) + dist(p+o[XBR_I], p+o[XBR_F4]) +
+                    dist(p+o[XBR_I], p+o[XBR_H5]) + 4*dist(p+o[XBR_H], p+o[XBR_F]);
+                wi = dist(p+o[XBR_H], p+o[XBR_D]) + dist(p+o[XBR_H], p+o[XBR_I5]) +
+                    dist(p+o[XBR_F], p+o[XBR_I4]) + dist(p+o[XBR_F], p+o[XBR_B]) +
+                    4*dist(p, p+o[XBR_I]);
+                if (we > wi)
+                    continue;
+                // Whichever side is closest
+                px = rgb_plane[p+o[(dist(p, p+o[XBR_F]) <= dist(p, p+o[XBR_H]))?XBR_F:XBR_H]];
+                if ( (we < wi) && (
+                     ((!eq(p+o[XBR_F], p+o[XBR_B])) && (!eq(p+o[XBR_H], p+o[XBR_D]))) ||
+                     ((eq(p, p+o[XBR_I])) && (!eq(p+o[XBR_F], p+o[XBR_I4])) &&
+                      (!eq(p+o[XBR_H], p+o[XBR_I5]))) ||
+                     (eq(p, p+o[XBR_G])) || (eq(p, p+o[XBR_C])) ) )
+                {
+                    ke = dist(p+o[XBR_F], p+o[XBR_G]);
+                    ki = dist(p+o[XBR_H], p+o[XBR_C]);
+                    left = (2*ke <= ki) && (c != rgb_plane[p+o[XBR_G]]) &&
+                        (rgb_plane[p+o[XBR_D]] != rgb_plane[p+o[XBR_G]]);
+                    up = (ke >= 2*ki) && (c != rgb_plane[p+o[XBR_C]]) &&
+                        (rgb_plane[p+o[XBR_B]] != rgb_plane[p+o[XBR_C]]);
+                    xbr_edge(E, map[corner], n, left, up, px);
+                }
+                else
+                {	// Not much of an edge => just soften the very corner
+                    E[map[corner][n*n-1]] = blend4(E[map[corner][n*n-1]], px, 0, 0,
+                        (WEIGHT_ONE/2) | ((WEIGHT_ONE/2)<<8));
+                }
+            }
+            for (sy=0; sy<n; sy++)
+                for (sx=0; sx<n; sx++)
+                    d[sy*dw+sx] = E[sy*n+sx];
+        }
+    }
+}
+
+#undef eq
+#undef BLEND
+#undef SET
+#undef GET
+
+static bool scale_band(u32 band)
+{
+    if (scale_cur_mode >= SCALE_XBR2X)
+        xbr_band(band);
+    else
+        edge_band(band);
+    return true;
+}
+
+// Mode from its name, or -1
+int scale_mode(const char* name)
+{
+    int i;
+
+    for (i=0; i<NB_SCALERS; i++)
+        if (strcmp(scaler_name[i], name) == 0)
+            return i;
+    return -1;
+}
+
+const char* scale_name(u8 mode)
+{
+    return (mode<NB_SCALERS)?scaler_name[mode]:"?";
+}
+
+u8 scale_factor(u8 mode)
+{
+    return (mode<NB_SCALERS)?scaler_factor[mode]:1;
+}
+
+// Scale a w x h frame into dest, which must be scale_factor() times as wide and high.
+// The bands are converted, then scaled as soon as the bands around them are converted
+bool scale_frame(u8 mode, const uint* src, u16 w, u16 h, uint* dest, u32 nb_workers)
+{
+    u32 i, size;
+
+    if ((mode >= NB_SCALERS) || (w == 0) || (h < 2))
+        return false;
+    if (!lut_ready)
+        init_lut();
+
+    // Room for the 2 pixel border, and for the last 8 pixels read by the SIMD classification
+    stride = ((w + 2*BORDER + 7) & ~7) + 8;
+    plane_h = h + 2*BORDER;
+    size = stride*plane_h;
+    if (size > plane_size)
+    {
+        SAFREE(rgb_plane);
+        SAFREE(y_plane);
+        SAFREE(u_plane);
+        SAFREE(v_plane);
+        SAFREE(code_plane);
+        rgb_plane = (uint*) aligned_malloc(size*sizeof(uint), 16);
+        y_plane = (s16*) aligned_malloc(size*sizeof(s16), 16);
+        u_plane = (s16*) aligned_malloc(size*sizeof(s16), 16);
+        v_plane = (s16*) aligned_malloc(size*sizeof(s16), 16);
+        code_plane = (u16*) aligned_malloc(stride*h*sizeof(u16), 16);
+        if ((rgb_plane == NULL) || (y_plane == NULL) || (u_plane == NULL) || (v_plane == NULL) ||
+            (code_plane == NULL))
+        {
+            perr("scale_frame: could not allocate planes\n");
+            plane_size = 0;
+            return false;
+        }
+        plane_size = size;
+    }
+
+    scale_cur_mode = mode;
+    scale_src = src;
+    scale_dest = dest;
+    scale_w = w;
+    scale_h = h;
+    // Bands of at least 2 rows, so that xBR only needs the ones next to it
+    nb_bands = min(nb_workers+1, min(SCALE_MAX_BANDS, (u32)h/2));
+    for (i=0; i<nb_bands; i++)
+    {
+        scale_task[i].name = "convert";
+        scale_task[i].run = convert_band;
+        scale_task[i].param = i;
+        scale_task[i].deps = 0;
+        scale_task[i].main_thread = false;
+        scale_task[nb_bands+i].name = "scale";
+        scale_task[nb_bands+i].run = scale_band;
+        scale_task[nb_bands+i].param = i;
+        scale_task[nb_bands+i].deps = TASK_BIT(i) | ((i>0)?TASK_BIT(i-1):0) |
+            ((i<nb_bands-1)?TASK_BIT(i+1):0);
+        scale_task[nb_bands+i].main_thread = false;
+    }
+    return run_tasks(scale_task, 2*nb_bands, nb_workers);
+}
+
+// Same as a renderer's read_frame(): malloc'ed RGB, top row first
+u8* scale_read_frame(u8 mode, const uint* src, u16 w, u16 h, u32 nb_workers, u16* dest_w, u16* dest_h)
+{
+    u8  n = scale_factor(mode);
+    u32 i;
+    uint* dest;
+    u8* rgb;
+
+    dest = (uint*) aligned_malloc(n*w*n*h*sizeof(uint), 16);
+    rgb = (u8*) malloc(3*n*w*n*h);
+    if ((dest == NULL) || (rgb == NULL) || (!scale_frame(mode, src, w, h, dest, nb_workers)))
+    {
+        aligned_free(dest);
+        SFREE(rgb);
+        return NULL;
+    }
+    for (i=0; i<(u32)n*w*n*h; i++)
+    {
+        rgb[3*i] = (u8)(dest[i]>>16);
+        rgb[3*i+1] = (u8)(dest[i]>>8);
+        rgb[3*i+2] = (u8)dest[i];
+    }
+    aligned_free(dest);
+    *dest_w = n*w;
+    *dest_h = n*h;
+    return rgb;
+}
+
+#if defined(DEBUG_ENABLED)
+// Time each of the scalers on a frame, on the main thread alone, then with the workers
+void scale_benchmark(const uint* src, u16 w, u16 h, u32 nb_iterations, u32 nb_workers)
+{
+    uint* dest;
+    u64 t[2];
+    u32 i, j;
+    u8  mode;
+
+    dest = (uint*) aligned_malloc(SCALE_MAX_FACTOR*w*SCALE_MAX_FACTOR*h*sizeof(uint), 16);
+    if (dest == NULL)
+        return;
+    for (mode=0; mode<NB_SCALERS; mode++)
+    {
+        for (j=0; j<2; j++)
+        {
+            t[j] = mtime();
+            for (i=0; i<nb_iterations; i++)
+                if (!scale_frame(mode, src, w, h, dest, (j==0)?0:nb_workers))
+                    goto out;
+            t[j] = mtime() - t[j];
+        }
+        // run_tasks() uses no more workers than there are tasks left for them
+        printf("%-6s %dx%d => %dx%d: %.2f ms/frame (1 thread), %.2f ms/frame (%d threads, %d bands)\n",
+            scaler_name[mode], w, h, scaler_factor[mode]*w, scaler_factor[mode]*h,
+            (float)t[0]/nb_iterations, (float)t[1]/nb_iterations,
+#if defined(PSP)
+            1,
+#else
+            (int)min(nb_workers, 2*nb_bands-1)+1,
+#endif
+            (int)nb_bands);
+    }
+out:
+    aligned_free(dest);
+}
+#endif
@@ -0,0 +1,61 @@
+/*
+ *  Colditz Escape! - Rewritten Engine for "Escape From Colditz"
+ *  copyright (C) 2008-2009 Aperture Software
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ *  ---------------------------------------------------------------------------
+ *  scaler.h: CPU pixel art scalers definitions
+ *  ---------------------------------------------------------------------------
+ */
+
+#pragma once
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#define SCALE_EDGE2X				0
+#define SCALE_EDGE3X				1
+#define SCALE_EDGE4X				2
+#define SCALE_XBR2X				3
+#define SCALE_XBR3X				4
+#define SCALE_XBR4X				5
+#define NB_SCALERS				6
+#define SCALE_MAX_FACTOR		4
+
+// Each band is a convert and a scale task
+#define SCALE_MAX_BANDS			(MAX_TASKS/2)
+
+// Thresholds above which two pixels are different (same as hqx)
+#define SCALE_THRESHOLD_Y		48
+#define SCALE_THRESHOLD_U		7
+#define SCALE_THRESHOLD_V		6
+
+/*
+ *	Public prototypes
+ */
+int  scale_mode(const char* name);
+const char* scale_name(u8 mode);
+u8   scale_factor(u8 mode);
+bool scale_frame(u8 mode, const uint* src, u16 w, u16 h, uint* dest, u32 nb_workers);
+u8*  scale_read_frame(u8 mode, const uint* src, u16 w, u16 h, u32 nb_workers, u16* dest_w, u16* dest_h);
+#if defined(DEBUG_ENABLED)
+void scale_benchmark(const uint* src, u16 w, u16 h, u32 nb_iterations, u32 nb_workers);
+#endif
+
+#ifdef	__cplusplus
+}
+#endif
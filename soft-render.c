@@ -0,0 +1,486 @@
+/*
+ *  Colditz Escape! - Rewritten Engine for "Escape From Colditz"
+ *  copyright (C) 2008-2009 Aperture Software
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ *  ---------------------------------------------------------------------------
+ *  soft-render.c: software renderer, for when there's no GL to be had
+ *  The textures are converted to 32 bit, and the quads drawn with nearest
+ *  sampling into a 0xFFRRGGBB framebuffer of the PSP screen size.
+ *  ---------------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#if defined(PSP)
+#include <psptypes.h>
+#include <psp/psp-printf.h>
+#endif
+#include "data-types.h"
+
+#include "colditz.h"
+#include "low-level.h"
+#include "graphics.h"
+#include "soft-render.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define SOFT_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define SOFT_NEON
+#include <arm_neon.h>
+#endif
+
+#define SOFT_OPAQUE			0xFF000000
+
+
+// A texture. Indexed ones keep their indexes, and go through the palette
+typedef struct
+{
+    unsigned int texid;			// 0 for a free slot
+    u16     w, h;
+    bool    indexed;
+    bool    keyed;				// all the alphas are either 0 or 0xFF
+    uint*   pixel;
+    u8*     index;
+} s_soft_tex;
+
+static s_soft_tex soft_tex[SOFT_MAX_TEXTURES];
+static s_soft_tex* last_tex = NULL;
+static unsigned int last_texid = 0;
+static uint*  soft_fb = NULL;
+// The quads are clipped to the area that was last cleared
+static s16    clip_x1, clip_y1, clip_x2, clip_y2;
+// Palette index to pixel. The indexes >= 16 are transparent
+static uint   soft_palette[256];
+static bool   soft_palette_keyed = true;
+// Texel column and row of each pixel of the quad being drawn, and gathered texels
+static s16    soft_col[PSP_SCR_WIDTH];
+static s16    soft_row[PSP_SCR_HEIGHT];
+static uint   soft_texels[PSP_SCR_WIDTH];
+
+
+// x*y/255, exact for 8 bit values
+static __inline uint mul8(uint x, uint y)
+{
+    uint t = x*y + 0x80;
+    return (t + (t>>8)) >> 8;
+}
+
+static __inline uint expand4(uint v)
+{
+    return (v<<4) | v;
+}
+
+static void soft_discard(unsigned int texid);
+static void soft_clear(s16 x1, s16 y1, s16 x2, s16 y2);
+
+static bool soft_init()
+{
+    if (soft_fb != NULL)
+        return true;
+    soft_fb = (uint*) aligned_malloc(PSP_SCR_WIDTH*PSP_SCR_HEIGHT*sizeof(uint), 16);
+    if (soft_fb == NULL)
+    {
+        perr("soft_init: could not allocate framebuffer\n");
+        return false;
+    }
+    memset(soft_tex, 0, sizeof(soft_tex));
+    soft_clear(0, 0, PSP_SCR_WIDTH, PSP_SCR_HEIGHT);
+    return true;
+}
+
+static s_soft_tex* find_tex(unsigned int texid)
+{
+    u32 i;
+
+    if ((last_tex != NULL) && (last_tex->texid == texid))
+        return last_tex;
+    for (i=0; i<SOFT_MAX_TEXTURES; i++)
+        if (soft_tex[i].texid == texid)
+            return (last_tex = &soft_tex[i]);
+    return NULL;
+}
+
+// The names only need to be unique, as the texture is allocated on upload
+static unsigned int soft_gen_texture()
+{
+    return ++last_texid;
+}
+
+// Get a texture, with room for w x h texels
+static s_soft_tex* alloc_tex(unsigned int texid, u16 w, u16 h, bool indexed)
+{
+    s_soft_tex* tex = find_tex(texid);
+
+    if ((tex != NULL) && ((tex->w != w) || (tex->h != h) || (tex->indexed != indexed)))
+    {
+        soft_discard(texid);
+        tex = NULL;
+    }
+    if (tex == NULL)
+    {
+        if ((tex = find_tex(0)) == NULL)
+        {
+            perr("soft_upload: too many textures\n");
+            return NULL;
+        }
+        if (indexed)
+            tex->index = (u8*) malloc(w*h);
+        else
+            tex->pixel = (uint*) aligned_malloc(w*h*sizeof(uint), 16);
+        if ((tex->index == NULL) && (tex->pixel == NULL))
+        {
+            perr("soft_upload: could not allocate texture\n");
+            return NULL;
+        }
+        tex->texid = texid;
+        tex->w = w;
+        tex->h = h;
+        tex->indexed = indexed;
+    }
+    return tex;
+}
+
+static void soft_upload(unsigned int texid, u16 w, u16 h, u8 format, const u8* data)
+{
+    s_soft_tex* tex;
+    u32 i, a, s;
+
+    if ((texid == 0) || ((tex = alloc_tex(texid, w, h, format == TEX_FMT_INDEX)) == NULL))
+        return;
+
+    tex->keyed = true;
+    if (format == TEX_FMT_INDEX)
+    {
+        memcpy(tex->index, data, w*h);
+        return;
+    }
+    for (i=0; i<(u32)w*h; i++)
+    {
+        switch (format)
+        {
+        case TEX_FMT_GRAB:
+            // Little endian 4444 REV => R in bits 0-3, G 4-7, B 8-11 and A 12-15
+            s = data[2*i] | (data[2*i+1]<<8);
+            a = expand4(s>>12);
+            tex->pixel[i] = (a<<24) | (expand4(s&0xF)<<16) | (expand4((s>>4)&0xF)<<8) | expand4((s>>8)&0xF);
+            break;
+        case TEX_FMT_RGB:
+            a = 0xFF;
+            tex->pixel[i] = SOFT_OPAQUE | (data[3*i]<<16) | (data[3*i+1]<<8) | data[3*i+2];
+            break;
+        default:
+            a = data[4*i+3];
+            tex->pixel[i] = (a<<24) | (data[4*i]<<16) | (data[4*i+1]<<8) | data[4*i+2];
+            break;
+        }
+        if ((a != 0) && (a != 0xFF))
+            tex->keyed = false;
+    }
+}
+
+static void soft_capture(unsigned int texid, s16 x, s16 y, u16 w, u16 h)
+{
+    s_soft_tex* tex;
+    s16 sx, sy;
+    u32 i, j;
+
+    if ((tex = alloc_tex(texid, w, h, false)) == NULL)
+        return;
+    tex->keyed = true;
+    for (j=0; j<h; j++)
+    {
+        sy = PSP_SCR_HEIGHT - 1 - (y + (s16)j);
+        for (i=0; i<w; i++)
+        {
+            sx = x + (s16)i;
+            tex->pixel[j*w+i] = ((sx >= 0) && (sx < PSP_SCR_WIDTH) && (sy >= 0) && (sy < PSP_SCR_HEIGHT))?
+                soft_fb[sy*PSP_SCR_WIDTH + sx]:SOFT_OPAQUE;
+        }
+    }
+}
+
+static void soft_discard(unsigned int texid)
+{
+    s_soft_tex* tex;
+
+    if ((texid == 0) || ((tex = find_tex(texid)) == NULL))
+        return;
+    if (tex->pixel != NULL)
+        SAFREE(tex->pixel);
+    SFREE(tex->index);
+    tex->texid = 0;
+}
+
+// Palette for the indexed textures, as 0xGRAB words
+static void soft_set_palette(const u16* palette)
+{
+    u32 i, a;
+
+    soft_palette_keyed = true;
+    for (i=0; i<256; i++)
+    {
+        if (i >= 16)
+        {	// C2P_TRANSPARENT
+            soft_palette[i] = 0;
+            continue;
+        }
+        a = expand4((palette[i]>>4)&0xF);
+        soft_palette[i] = (a<<24) | (expand4((palette[i]>>8)&0xF)<<16) |
+            (expand4(palette[i]>>12)<<8) | expand4(palette[i]&0xF);
+        if ((a != 0) && (a != 0xFF))
+            soft_palette_keyed = false;
+    }
+}
+
+static void soft_clear(s16 x1, s16 y1, s16 x2, s16 y2)
+{
+    s16 x, y;
+
+    clip_x1 = max(x1, 0);
+    clip_y1 = max(y1, 0);
+    clip_x2 = min(x2, PSP_SCR_WIDTH);
+    clip_y2 = min(y2, PSP_SCR_HEIGHT);
+    for (y=clip_y1; y<clip_y2; y++)
+        for (x=clip_x1; x<clip_x2; x++)
+            soft_fb[y*PSP_SCR_WIDTH + x] = SOFT_OPAQUE;
+}
+
+// Copy the texels that aren't transparent. That's the cells and sprites, unfaded
+static __inline void blit_keyed(uint* dst, const uint* src, u32 n)
+{
+    u32 i = 0;
+#if defined(SOFT_SSE2)
+    const __m128i alpha = _mm_set1_epi32((int)SOFT_OPAQUE);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i s, d, m;
+
+    for (; i+4<=n; i+=4)
+    {
+        s = _mm_loadu_si128((const __m128i*)(src+i));
+        d = _mm_loadu_si128((const __m128i*)(dst+i));
+        m = _mm_cmpeq_epi32(_mm_and_si128(s, alpha), zero);
+        _mm_storeu_si128((__m128i*)(dst+i), _mm_or_si128(_mm_and_si128(m, d), _mm_andnot_si128(m, s)));
+    }
+#elif defined(SOFT_NEON)
+    const uint32x4_t alpha = vdupq_n_u32(SOFT_OPAQUE);
+    uint32x4_t s, m;
+
+    for (; i+4<=n; i+=4)
+    {
+        s = vld1q_u32(src+i);
+        m = vtstq_u32(s, alpha);
+        vst1q_u32(dst+i, vbslq_u32(m, s, vld1q_u32(dst+i)));
+    }
+#endif
+    for (; i<n; i++)
+        if (src[i] & SOFT_OPAQUE)
+            dst[i] = src[i];
+}
+
+// Blend a pixel of colour (r,g,b) and alpha a over dst
+static __inline uint blend(uint d, uint r, uint g, uint b, uint a)
+{
+    uint t = 0xFF - a;
+
+    r = r*a + ((d>>16)&0xFF)*t + 0x80;
+    g = g*a + ((d>>8)&0xFF)*t + 0x80;
+    b = b*a + (d&0xFF)*t + 0x80;
+    return SOFT_OPAQUE | (((r + (r>>8))>>8)<<16) | (((g + (g>>8))>>8)<<8) | ((b + (b>>8))>>8);
+}
+
+// Modulate the texels by colour, and blend them, unless opaque
+static void blit_modulate(uint* dst, const uint* src, u32 n, const u8* colour, bool opaque)
+{
+    u32 i;
+    uint s, a;
+
+    for (i=0; i<n; i++)
+    {
+        s = src[i];
+        a = opaque?0xFF:mul8(s>>24, colour[3]);
+        if (a == 0)
+            continue;
+        dst[i] = blend(dst[i], mul8((s>>16)&0xFF, colour[0]), mul8((s>>8)&0xFF, colour[1]),
+            mul8(s&0xFF, colour[2]), a);
+    }
+}
+
+static void fill(uint* dst, u32 n, const u8* colour, bool opaque)
+{
+    u32 i;
+    uint c = SOFT_OPAQUE | (colour[0]<<16) | (colour[1]<<8) | colour[2];
+
+    if ((opaque) || (colour[3] == 0xFF))
+    {
+        for (i=0; i<n; i++)
+            dst[i] = c;
+        return;
+    }
+    for (i=0; i<n; i++)
+        dst[i] = blend(dst[i], colour[0], colour[1], colour[2], colour[3]);
+}
+
+// Texel (clamped) of each pixel, from the coordinate of its centre
+// Returns true if the texels are consecutive, i.e. the row can be read directly
+static bool map_texels(s16* texel, s16 p1, s16 p2, float x1, float x2, float u1, float u2, u16 size)
+{
+    s16 p;
+    int t;
+    bool consecutive = true;
+    float du = (u2-u1)/(x2-x1);
+
+    for (p=p1; p<p2; p++)
+    {
+        t = (int)floorf((u1 + ((float)p + 0.5f - x1)*du) * size);
+        if (t < 0)
+            t = 0;
+        else if (t >= size)
+            t = size-1;
+        texel[p-p1] = (s16)t;
+        if ((p != p1) && (t != texel[p-p1-1]+1))
+            consecutive = false;
+    }
+    return consecutive;
+}
+
+// First pixel whose centre is at or after x, within [lo, hi]
+static __inline s16 first_pixel(float x, s16 lo, s16 hi)
+{
+    int p = (int)ceilf(x - 0.5f);
+    return (s16)((p<lo)?lo:((p>hi)?hi:p));
+}
+
+static void draw_quad(const s_quad* q)
+{
+    s_soft_tex* tex = NULL;
+    s16 x1, x2, y1, y2, y, xs, xe;
+    const uint* src;
+    const u8* index;
+    uint* dst;
+    float t, xl;
+    u32 i;
+    bool consecutive = false, keyed;
+
+    x1 = first_pixel(min(q->x1, q->x2), clip_x1, clip_x2);
+    x2 = first_pixel(max(q->x1, q->x2), clip_x1, clip_x2);
+    y1 = first_pixel(min(q->y1, q->y2), clip_y1, clip_y2);
+    y2 = first_pixel(max(q->y1, q->y2), clip_y1, clip_y2);
+    if ((x1 >= x2) || (y1 >= y2))
+        return;
+
+    keyed = ((q->colour[0] & q->colour[1] & q->colour[2] & q->colour[3]) == 0xFF) && (!q->opaque);
+    if (q->filter != FILTER_NONE)
+    {	// Textures we don't have, such as the GL render targets, aren't drawn
+        if ((tex = find_tex(q->texid)) == NULL)
+            return;
+        keyed = keyed && (tex->indexed?soft_palette_keyed:tex->keyed);
+        // LINEAR is only used for the static pictures, which aren't zoomed => nearest
+        consecutive = map_texels(soft_col, x1, x2, q->x1, q->x2, q->u1, q->u2, tex->w) && (!tex->indexed);
+        map_texels(soft_row, y1, y2, q->y1, q->y2, q->v1, q->v2, tex->h);
+    }
+
+    for (y=y1; y<y2; y++)
+    {
+        xs = x1;
+        xe = x2;
+        if (q->half)
+        {	// Only keep the part of the row that's inside the (x1,y1) (x2,y1) (x1,y2) triangle
+            t = ((float)y + 0.5f - q->y1) / (q->y2 - q->y1);
+            xl = q->x1 + (1.0f - t)*(q->x2 - q->x1);
+            xs = max(xs, first_pixel(min(q->x1, xl), clip_x1, clip_x2));
+            xe = min(xe, first_pixel(max(q->x1, xl), clip_x1, clip_x2));
+            if (xs >= xe)
+                continue;
+        }
+        dst = &soft_fb[y*PSP_SCR_WIDTH + xs];
+        if (tex == NULL)
+        {
+            fill(dst, xe-xs, q->colour, q->opaque);
+            continue;
+        }
+        if (consecutive)
+            src = &tex->pixel[soft_row[y-y1]*tex->w + soft_col[xs-x1]];
+        else if (tex->indexed)
+        {
+            index = &tex->index[soft_row[y-y1]*tex->w];
+            for (i=xs-x1; i<(u32)(xe-x1); i++)
+                soft_texels[i] = soft_palette[index[soft_col[i]]];
+            src = &soft_texels[xs-x1];
+        }
+        else
+        {
+            src = &tex->pixel[soft_row[y-y1]*tex->w];
+            for (i=xs-x1; i<(u32)(xe-x1); i++)
+                soft_texels[i] = src[soft_col[i]];
+            src = &soft_texels[xs-x1];
+        }
+        if (keyed)
+            blit_keyed(dst, src, xe-xs);
+        else
+            blit_modulate(dst, src, xe-xs, q->colour, q->opaque);
+    }
+}
+
+// Draw quads, in order, as GL would with GL_SRC_ALPHA/GL_ONE_MINUS_SRC_ALPHA blending
+static void soft_draw(const s_quad* quad, u32 nb_quads)
+{
+    u32 i;
+
+    for (i=0; i<nb_quads; i++)
+        draw_quad(&quad[i]);
+}
+
+// Our framebuffer is never lost
+static bool soft_keeps_frame()
+{
+    return true;
+}
+
+static void soft_present()
+{
+}
+
+static u8* soft_read_frame(u16* w, u16* h)
+{
+    u8* rgb;
+    u32 i;
+
+    if ((rgb = (u8*) malloc(3*PSP_SCR_WIDTH*PSP_SCR_HEIGHT)) == NULL)
+        return NULL;
+    for (i=0; i<PSP_SCR_WIDTH*PSP_SCR_HEIGHT; i++)
+    {
+        rgb[3*i] = (u8)(soft_fb[i]>>16);
+        rgb[3*i+1] = (u8)(soft_fb[i]>>8);
+        rgb[3*i+2] = (u8)soft_fb[i];
+    }
+    *w = PSP_SCR_WIDTH;
+    *h = PSP_SCR_HEIGHT;
+    return rgb;
+}
+
+// The PSP_SCR_WIDTH x PSP_SCR_HEIGHT 0xFFRRGGBB framebuffer, for the CPU scalers
+const uint* soft_framebuffer()
+{
+    return soft_fb;
+}
+
+const s_renderer soft_renderer = { "soft", false, soft_init, soft_gen_texture, soft_upload,
+    soft_capture, soft_discard, soft_set_palette, soft_clear, soft_draw, soft_keeps_frame,
+    soft_present, soft_read_frame };
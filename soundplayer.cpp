@@ -74,7 +74,7 @@
 // Function Prototypes
 //////////////////////////////////////////////////////////////////////
 static void SetMasterVolume(int volume);
-static int  ReadModWord(unsigned char *data, int index);
+static int  ReadModWord(const u8 *data, int index);
 static void DoTremalo(int track);
 static void DoVibrato(int track);
 static void DoPorta(int track);
@@ -121,8 +121,6 @@ static RowData *m_CurrentRow;	// Pointer to the current row being played
 static bool m_bPlaying = false;	// Set to true when a mod is being played
 static bool m_bSet     = false;	// True when a mod has been set
 static bool no_audio   = true;	// Is the audio working
-static u8 *data;
-int size = 0;
 
 
 
@@ -366,9 +364,6 @@ void mod_release()
         return;
 
     // Tear down all the mallocs done
-    //free the file itself
-    if (data)
-        free(data);
     // Free patterns
     for (i = 0; i < m_Patterns_num; i++) {
         for (row = 0; row < 64; row++)
@@ -395,41 +390,62 @@ bool is_mod_playing()
     return m_bPlaying;
 }
 
+//  Loads a module from a file into the modplayer
+//  The file is only read into a temporary buffer, which is handed over
+//  to mod_init_from_memory() and freed right after
+bool mod_init(char *filename)
+{
+    FILE* fd;
+    u8* buffer;
+    long length;
+    bool r;
+
+    if (no_audio)
+        return false;
+
+    if ((fd = fopen (filename, "rb")) == NULL)
+        return false;
+    //  opened file, so get size now
+    fseek(fd, 0, SEEK_END);
+    length = ftell(fd);
+    fseek(fd, 0, SEEK_SET);
+    if ((length <= 0) || ((buffer = (u8*) malloc(length)) == NULL)) {
+        fclose(fd);
+        return false;
+    }
+    if (fread(buffer, 1, length, fd) != (size_t)length) {
+        fclose(fd);
+        free(buffer);
+        return false;
+    }
+    fclose(fd);
+
+    r = mod_init_from_memory(buffer, (size_t)length);
+    free(buffer);
+    return r;
+}
+
 //  This is the initialiser and module loader
 //  This is a general call, which loads the module from the
 //  given address into the modplayer
 //
 //  It basically loads into an internal format, so once this function
-//  has returned the buffer at 'data' will not be needed again.
-bool mod_init(char *filename)
+//  has returned, the caller owns 'data' again and can free or unmap it.
+//  Nothing is ever written to 'data', so a read-only mapping is fine.
+bool mod_init_from_memory(const u8 *data, size_t length)
 {
     int i, numpatterns, row, note;
-    int index = 0;
+    size_t index = 0;
     int numsamples;
     char modname[21];
-    FILE* fd;
 
     if (no_audio)
         return false;
 
     m_bPlaying = false;
 
-    if ((fd = fopen (filename, "rb")) != NULL) {
-        //  opened file, so get size now
-        fseek(fd, 0, SEEK_END);
-        size = ftell(fd);
-        fseek(fd, 0, SEEK_SET);
-        data = (unsigned char *) malloc(size + 8);
-        memset(data, 0, size + 8);
-        if (data != 0) {	// Read file in
-            fread(data, 1, size, fd);
-        } else {
-            fclose(fd);
-            return false;
-        }
-        // Close file
-        fclose(fd);
-    } else 	// we couldn't open the file
+    // We need at least the whole header, up to and including the ID at 1080
+    if ((data == NULL) || (length < 1084))
         return false;
 
 #if defined(PSP)
@@ -518,6 +534,14 @@ bool mod_init(char *filename)
     numpatterns++;
     index += 4;			// skip over the identifier
 
+    // Make sure the pattern data is all there
+    if (index + (size_t)numpatterns * 64 * m_nNumTracks * 4 > length) {
+        free(m_nOrders);
+        free(m_Samples);
+        free(m_TrackDat);
+        return false;
+    }
+
     // Load in the pattern data
     m_Patterns_num = numpatterns;
     m_Patterns = (Pattern *) malloc(m_Patterns_num * sizeof(Pattern));
@@ -559,20 +583,24 @@ bool mod_init(char *filename)
 
     // Load in the sample data
     for (i = 1; i < numsamples; i++) {
-        int length;
+        size_t sample_length;
+        if (m_Samples[i].nLength < 0)
+            m_Samples[i].nLength = 0;
+        sample_length = (size_t)m_Samples[i].nLength;
         m_Samples[i].data_length = m_Samples[i].nLength;
-        m_Samples[i].data = (char *) malloc(m_Samples[i].data_length + 1);
-        memset(m_Samples[i].data, 0, m_Samples[i].data_length + 1);
+        m_Samples[i].data = (char *) malloc(sample_length + 1);
+        memset(m_Samples[i].data, 0, sample_length + 1);
 
-        if (m_Samples[i].nLength) {
-            memcpy(&m_Samples[i].data[0], &data[index], m_Samples[i].nLength);
+        // Truncated sample data (quite common with ripped mods) is padded with silence
+        if ((sample_length) && (index < length)) {
+            memcpy(&m_Samples[i].data[0], &data[index],
+                (sample_length > length - index)?(length - index):sample_length);
         }
-        index += m_Samples[i].nLength;
+        index += sample_length;
 
         // Duplicate the last byte, we'll need an extra one in order to safely anti-alias
-        length = m_Samples[i].nLength;
-        if (length > 0) {
-            m_Samples[i].data[length] = m_Samples[i].data[length - 1];
+        if (sample_length > 0) {
+            m_Samples[i].data[sample_length] = m_Samples[i].data[sample_length - 1];
 
             if (m_Samples[i].nLoopLength > 2)
                 m_Samples[i].data[m_Samples[i].nLoopEnd] = m_Samples[i].data[m_Samples[i].nLoopStart];
@@ -1271,7 +1299,7 @@ static void SetMasterVolume(int volume)
 // They're also stored at half their actual value, thus doubling their range.
 // This function accepts a pointer to such a word and returns it's integer value
 // NOTE: relic from pc testing.
-static int ReadModWord(unsigned char *buffer, int index)
+static int ReadModWord(const u8 *buffer, int index)
 {
     int byte1 = (int) (unsigned char) *(buffer + index);
     int byte2 = (int) (unsigned char) *(buffer + index + 1);
@@ -43,6 +43,7 @@ extern "C" {
     bool audio_init();
     bool audio_release();
     bool mod_init(char *filename);
+    bool mod_init_from_memory(const u8 *data, size_t length);
     void mod_release();
     bool mod_play();
     bool is_mod_playing();
@@ -0,0 +1,360 @@
+/*
+ *  Colditz Escape! - Rewritten Engine for "Escape From Colditz"
+ *  copyright (C) 2008-2009 Aperture Software
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ *  ---------------------------------------------------------------------------
+ *  tasks.c: a minimal task graph, to run independent jobs on worker threads
+ *  The main thread takes part in the work, and is the only one to pick up
+ *  the tasks flagged main_thread. The worker threads are started on the first
+ *  graph that wants them, and then wait for the next one, until stop_workers().
+ *  On PSP, everything runs on the main thread.
+ *  ---------------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(WIN32)
+#include <windows.h>
+#elif defined(PSP)
+#include <psptypes.h>
+#include <psp/psp-printf.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+#include "data-types.h"
+
+#include "colditz.h"
+#include "low-level.h"
+#include "tasks.h"
+
+#if defined(WIN32)
+static CRITICAL_SECTION		task_lock;
+static CONDITION_VARIABLE	task_cond;
+#define TASK_LOCK()			EnterCriticalSection(&task_lock)
+#define TASK_UNLOCK()		LeaveCriticalSection(&task_lock)
+#define TASK_WAIT()			SleepConditionVariableCS(&task_cond, &task_lock, INFINITE)
+#define TASK_WAKE()			WakeAllConditionVariable(&task_cond)
+#elif defined(PSP)
+// No workers => no locking
+#define TASK_LOCK()
+#define TASK_UNLOCK()
+#define TASK_WAIT()
+#define TASK_WAKE()
+#else
+static pthread_mutex_t		task_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		task_cond = PTHREAD_COND_INITIALIZER;
+#define TASK_LOCK()			pthread_mutex_lock(&task_lock)
+#define TASK_UNLOCK()		pthread_mutex_unlock(&task_lock)
+#define TASK_WAIT()			pthread_cond_wait(&task_cond, &task_lock)
+#define TASK_WAKE()			pthread_cond_broadcast(&task_cond)
+#endif
+
+// The graph being run. Everything here is protected by task_lock
+static s_task*	tasks;
+static u32		nb_tasks_left;
+static u32		nb_tasks_running;
+static u32		nb_graph_tasks;
+static u64		tasks_done;
+static u64		graph_start;
+static bool		graph_failed;
+// The worker pool. Workers 1 to nb_active_workers take part in graph graph_id
+#if defined(WIN32)
+static bool		task_lock_ready = false;
+static HANDLE	worker[MAX_TASKS];
+#elif !defined(PSP)
+static pthread_t	worker[MAX_TASKS];
+#endif
+static u32		nb_pool_workers = 0;
+static u32		nb_active_workers;
+static u32		nb_workers_busy;		// active workers that haven't left the graph yet
+static u32		graph_id = 0;
+static u32		worker_graph[MAX_TASKS];	// last graph seen by each worker
+static bool		pool_stopping = false;
+
+
+// Number of CPUs we can use
+u32 nb_cpus()
+{
+#if defined(WIN32)
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	return (u32)si.dwNumberOfProcessors;
+#elif defined(PSP)
+	return 1;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return (n<1)?1:(u32)n;
+#endif
+}
+
+// Find a task we can start, or -1 if there's none
+// The main thread looks for the main thread only tasks first, as nobody else can run them
+static int next_task(bool main_thread)
+{
+	u32 i;
+	int pass;
+
+	for (pass=(main_thread?0:1); pass<2; pass++)
+		for (i=0; i<nb_graph_tasks; i++)
+			if ( (tasks[i].state == TASK_PENDING) && ((tasks[i].deps & tasks_done) == tasks[i].deps) &&
+				 (tasks[i].main_thread == (pass == 0)) )
+				return (int)i;
+	return -1;
+}
+
+// Run tasks until the graph is done or failed
+static void task_loop(u8 thread)
+{
+	int i;
+	bool success;
+
+	TASK_LOCK();
+	while ((nb_tasks_left != 0) && (!graph_failed))
+	{
+		i = next_task(thread == 0);
+		if (i < 0)
+		{
+			if ((nb_tasks_running == 0) && (next_task(true) < 0))
+			{	// Nothing running and nothing we can start => the dependencies are broken
+				perr("run_tasks: unsatisfiable task dependencies\n");
+				graph_failed = true;
+				TASK_WAKE();
+				break;
+			}
+			TASK_WAIT();
+			continue;
+		}
+		tasks[i].state = TASK_RUNNING;
+		tasks[i].thread = thread;
+		nb_tasks_running++;
+		TASK_UNLOCK();
+
+		tasks[i].start = (u32)(mtime() - graph_start);
+		success = tasks[i].run(tasks[i].param);
+		tasks[i].end = (u32)(mtime() - graph_start);
+
+		TASK_LOCK();
+		tasks[i].state = TASK_DONE;
+		tasks_done |= TASK_BIT(i);
+		nb_tasks_running--;
+		nb_tasks_left--;
+		if (!success)
+		{
+			perr("Task '%s' (%d) failed\n", tasks[i].name, (int)tasks[i].param);
+			graph_failed = true;
+		}
+		TASK_WAKE();
+	}
+	TASK_UNLOCK();
+}
+
+// Wait for each new graph we're part of, until the pool is stopped
+static void worker_loop(u8 thread)
+{
+	TASK_LOCK();
+	for (;;)
+	{
+		while ( (!pool_stopping) &&
+				((worker_graph[thread] == graph_id) || (thread > nb_active_workers)) )
+			TASK_WAIT();
+		if (pool_stopping)
+			break;
+		worker_graph[thread] = graph_id;
+		TASK_UNLOCK();
+		task_loop(thread);
+		TASK_LOCK();
+		nb_workers_busy--;
+		TASK_WAKE();
+	}
+	TASK_UNLOCK();
+}
+
+#if defined(WIN32)
+static DWORD WINAPI worker_thread(LPVOID arg)
+{
+	worker_loop((u8)(size_t)arg);
+	return 0;
+}
+#elif !defined(PSP)
+static void* worker_thread(void* arg)
+{
+	worker_loop((u8)(size_t)arg);
+	return NULL;
+}
+#endif
+
+// Grow the pool to nb_workers threads. Returns the number we actually have
+static u32 start_workers(u32 nb_workers)
+{
+#if defined(WIN32)
+	if (!task_lock_ready)
+	{
+		InitializeCriticalSection(&task_lock);
+		InitializeConditionVariable(&task_cond);
+		task_lock_ready = true;
+	}
+#endif
+#if !defined(PSP)
+	for (; nb_pool_workers<nb_workers; nb_pool_workers++)
+	{
+		// Not running yet, so no need to lock. It only waits for the graphs after this one
+		worker_graph[nb_pool_workers+1] = graph_id;
+#if defined(WIN32)
+		worker[nb_pool_workers] = CreateThread(NULL, 0, worker_thread,
+			(LPVOID)(size_t)(nb_pool_workers+1), 0, NULL);
+		if (worker[nb_pool_workers] == NULL)
+			break;
+#else
+		if (pthread_create(&worker[nb_pool_workers], NULL, worker_thread,
+			(void*)(size_t)(nb_pool_workers+1)) != 0)
+			break;
+#endif
+	}
+#endif
+	return min(nb_workers, nb_pool_workers);
+}
+
+// Join the worker threads. The pool is started again by the next run_tasks() that needs it
+void stop_workers()
+{
+#if !defined(PSP)
+	u32 i;
+
+	if (nb_pool_workers == 0)
+		return;
+	TASK_LOCK();
+	pool_stopping = true;
+	TASK_WAKE();
+	TASK_UNLOCK();
+	for (i=0; i<nb_pool_workers; i++)
+	{
+#if defined(WIN32)
+		WaitForSingleObject(worker[i], INFINITE);
+		CloseHandle(worker[i]);
+#else
+		pthread_join(worker[i], NULL);
+#endif
+	}
+	nb_pool_workers = 0;
+	pool_stopping = false;
+#endif
+}
+
+// Run a task graph on the main thread + nb_workers threads of the pool, and return
+// when it's done. If a task fails, no new task is started and false is returned
+bool run_tasks(s_task* task, u32 nb_tasks, u32 nb_workers)
+{
+	u32 i;
+
+	if (nb_tasks > MAX_TASKS)
+	{
+		perr("run_tasks: too many tasks (%d)\n", (int)nb_tasks);
+		return false;
+	}
+#if defined(PSP)
+	nb_workers = 0;
+#else
+	// No point in having more workers than tasks
+	if (nb_workers >= nb_tasks)
+		nb_workers = (nb_tasks>0)?nb_tasks-1:0;
+#endif
+
+	tasks = task;
+	nb_graph_tasks = nb_tasks;
+	nb_tasks_left = nb_tasks;
+	nb_tasks_running = 0;
+	tasks_done = 0;
+	graph_failed = false;
+	for (i=0; i<nb_tasks; i++)
+	{
+		task[i].state = TASK_PENDING;
+		task[i].thread = 0;
+		task[i].start = 0;
+		task[i].end = 0;
+	}
+	graph_start = mtime();
+
+	// If we couldn't start them all, just make do with what we have
+	nb_workers = start_workers(nb_workers);
+	TASK_LOCK();
+	nb_active_workers = nb_workers;
+	nb_workers_busy = nb_workers;
+	graph_id++;
+	TASK_WAKE();
+	TASK_UNLOCK();
+
+	task_loop(0);
+
+	// The graph's state must stay as is until every worker is done with it
+	TASK_LOCK();
+	while (nb_workers_busy != 0)
+		TASK_WAIT();
+	TASK_UNLOCK();
+
+	return !graph_failed;
+}
+
+// Print the time spent in each stage of a graph that has been run
+// busy is the sum of the tasks durations, span is from the first start to the last end
+void print_task_report(s_task* task, u32 nb_tasks)
+{
+	u32 i, j, n, busy, first, last, total = 0, wall = 0, nb_threads = 1;
+
+	print("%-16s %6s %6s %10s %10s\n", "stage", "tasks", "thread", "busy (ms)", "span (ms)");
+	for (i=0; i<nb_tasks; i++)
+	{
+		total += task[i].end - task[i].start;
+		if (task[i].end > wall)
+			wall = task[i].end;
+		if (task[i].thread+1u > nb_threads)
+			nb_threads = task[i].thread+1;
+		// Only report a stage on its first task
+		for (j=0; j<i; j++)
+			if (strcmp(task[j].name, task[i].name) == 0)
+				break;
+		if (j != i)
+			continue;
+		n = 0; busy = 0;
+		first = task[i].start;
+		last = task[i].end;
+		for (j=i; j<nb_tasks; j++)
+		{
+			if (strcmp(task[j].name, task[i].name) != 0)
+				continue;
+			n++;
+			busy += task[j].end - task[j].start;
+			if (task[j].start < first)
+				first = task[j].start;
+			if (task[j].end > last)
+				last = task[j].end;
+		}
+		// Thread is only meaningful for single task stages
+		if (n == 1)
+		{
+			print("%-16s %6d %6d %10d %10d\n", task[i].name, (int)n, (int)task[i].thread,
+				(int)busy, (int)(last-first));
+		}
+		else
+		{
+			print("%-16s %6d %6s %10d %10d\n", task[i].name, (int)n, "-", (int)busy, (int)(last-first));
+		}
+	}
+	print("%d tasks on %d thread(s): %d ms of work done in %d ms\n\n", (int)nb_tasks, (int)nb_threads,
+		(int)total, (int)wall);
+}
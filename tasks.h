@@ -0,0 +1,61 @@
+/*
+ *  Colditz Escape! - Rewritten Engine for "Escape From Colditz"
+ *  copyright (C) 2008-2009 Aperture Software
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ *  ---------------------------------------------------------------------------
+ *  tasks.h: a minimal task graph, to run independent jobs on worker threads
+ *  ---------------------------------------------------------------------------
+ */
+
+#pragma once
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+// Dependencies are kept in a 64 bit mask
+#define MAX_TASKS			64
+#define TASK_BIT(t)			(((u64)1)<<(t))
+
+#define TASK_PENDING		0
+#define TASK_RUNNING		1
+#define TASK_DONE			2
+
+typedef struct
+{
+	const char*	name;			// Tasks with the same name are reported as one stage
+	bool		(*run)(u32 param);
+	u32			param;
+	u64			deps;			// Tasks that must be done before this one can start
+	bool		main_thread;	// Must run on the main thread (eg. anything GL)
+	// Set by run_tasks()
+	u8			state;
+	u8			thread;			// 0 is the main thread
+	u32			start, end;		// in ms, relative to the start of the graph
+} s_task;
+
+/*
+ *	Public prototypes
+ */
+u32  nb_cpus();
+bool run_tasks(s_task* task, u32 nb_tasks, u32 nb_workers);
+void stop_workers();
+void print_task_report(s_task* task, u32 nb_tasks);
+
+#ifdef	__cplusplus
+}
+#endif